@@ -0,0 +1,530 @@
+/*
+ * ccdict.c
+ *
+ * A concurrent dictionary with lock-free reads, built from striped
+ * sequence locks. See ccdict.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ccdict.h"
+
+// The number of stripes, a power of two, and the hash bits that pick one
+#define CC_STRIPE_BITS 6
+#define CC_NUM_STRIPES (1 << CC_STRIPE_BITS)
+
+#define CC_DEFAULT_CAPACITY 16
+#define CC_MAX_LOAD 0.75
+
+// The size of a cache line, to keep stripes from sharing one
+#define CC_CACHE_LINE 64
+
+// How many times a reader spins on a stripe being written before it
+// yields, in case the writer has been preempted
+#define CC_SPINS_BEFORE_YIELD 64
+
+// A hash of 0 marks an empty slot
+#define CC_EMPTY 0
+
+/*
+ * A slot holds its key inline, so that a reader never follows a
+ * pointer that a writer might free. Readers load the hash and value
+ * with relaxed atomics; the key bytes may be torn by a concurrent
+ * write, but the sequence check then discards whatever was read.
+ */
+struct _cc_slot
+{
+  uint64_t hash;
+  CDictValueType value;
+  char key[CC_MAX_KEY + 1];
+};
+
+/*
+ * Each stripe is an open-addressed table with linear probing and
+ * deletion by backward shift. When it grows, the old table is kept on
+ * the new one's retired list until CC_free, since a reader may still
+ * be probing it.
+ */
+struct _cc_table
+{
+  unsigned int capacity; // a power of two
+  unsigned int size;
+  struct _cc_table *retired;
+  struct _cc_slot slot[];
+};
+
+/*
+ * The sequence number is odd while a writer is changing the stripe.
+ * Writers serialize on the mutex; readers only watch the sequence.
+ */
+struct _cc_stripe
+{
+  unsigned long seq;
+  pthread_mutex_t lock;
+  struct _cc_table *table;
+} __attribute__((aligned(CC_CACHE_LINE)));
+
+struct _cc_dictionary
+{
+  struct _cc_stripe stripe[CC_NUM_STRIPES];
+};
+
+/*
+ * Returns: The hash of key, as CD_hash but never CC_EMPTY
+ */
+static inline uint64_t _CC_hash(const char *key)
+{
+  uint64_t hash = CD_hash(key);
+
+  return hash == CC_EMPTY ? 1 : hash;
+}
+
+/*
+ * Returns: The stripe that holds keys with the given hash. The stripe
+ *   is taken from the top bits, the slot from the bottom ones.
+ */
+static inline struct _cc_stripe *_CC_stripe(CCDict dict, uint64_t hash)
+{
+  return &dict->stripe[hash >> (64 - CC_STRIPE_BITS)];
+}
+
+/*
+ * Wait for a writer to finish with a stripe: spin briefly, then give
+ * up the CPU
+ *
+ * Parameters:
+ *   spins    The number of times the caller has waited so far, which
+ *            this increments
+ *
+ * Returns: None
+ */
+static inline void _CC_wait(unsigned int *spins)
+{
+  if (++*spins % CC_SPINS_BEFORE_YIELD == 0)
+    sched_yield();
+#ifdef __SSE2__
+  else
+    _mm_pause();
+#endif
+}
+
+/*
+ * Returns: A newly allocated, empty table with room for capacity slots
+ */
+static struct _cc_table *_CC_table_new(unsigned int capacity)
+{
+  struct _cc_table *table = calloc(1, sizeof(struct _cc_table) + sizeof(struct _cc_slot) * capacity);
+  assert(table != NULL);
+
+  table->capacity = capacity;
+
+  return table;
+}
+
+/*
+ * Store a value into a slot with a relaxed atomic write, so that
+ * readers racing with the writer see either the old or the new value
+ *
+ * Parameters:
+ *   slot     The slot
+ *   value    The value
+ *
+ * Returns: None
+ */
+static inline void _CC_set_value(struct _cc_slot *slot, CDictValueType value)
+{
+  uint64_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  __atomic_store_n((uint64_t *)&slot->value, bits, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns: The value in a slot, read with a relaxed atomic load
+ */
+static inline CDictValueType _CC_get_value(const struct _cc_slot *slot)
+{
+  uint64_t bits = __atomic_load_n((const uint64_t *)&slot->value, __ATOMIC_RELAXED);
+  CDictValueType value;
+
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/*
+ * Copy one slot over another, publishing the hash last
+ *
+ * Parameters:
+ *   dest     The slot to overwrite
+ *   src      The slot to copy
+ *
+ * Returns: None
+ */
+static void _CC_move_slot(struct _cc_slot *dest, const struct _cc_slot *src)
+{
+  memcpy(dest->key, src->key, sizeof(dest->key));
+  _CC_set_value(dest, src->value);
+  __atomic_store_n(&dest->hash, src->hash, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the slot for a key in a table. The probe is bounded by the
+ * capacity, since a reader may see a table that a writer is halfway
+ * through changing.
+ *
+ * Parameters:
+ *   table    The table
+ *   key      The key
+ *   hash     The key's hash, from _CC_hash
+ *   found    Return space: true if the key is present
+ *
+ * Returns: The index of the key's slot if found, otherwise of the
+ *   empty slot that ended the probe, or capacity if there was none
+ */
+static unsigned int _CC_find(const struct _cc_table *table, const char *key, uint64_t hash, bool *found)
+{
+  unsigned int mask = table->capacity - 1;
+  unsigned int i = hash & mask;
+
+  *found = false;
+  for (unsigned int n = 0; n < table->capacity; n++, i = (i + 1) & mask)
+  {
+    uint64_t h = __atomic_load_n(&table->slot[i].hash, __ATOMIC_RELAXED);
+
+    if (h == CC_EMPTY)
+      return i;
+
+    if (h == hash && strncmp(table->slot[i].key, key, CC_MAX_KEY + 1) == 0)
+    {
+      *found = true;
+      return i;
+    }
+  }
+
+  return table->capacity;
+}
+
+/*
+ * Look a key up without taking a lock. The read is retried until no
+ * writer has touched the stripe while it ran.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   value    Return space for the value, or NULL
+ *
+ * Returns: true if the key was found
+ */
+static bool _CC_read(CCDict dict, const char *key, CDictValueType *value)
+{
+  uint64_t hash = _CC_hash(key);
+  struct _cc_stripe *stripe = _CC_stripe(dict, hash);
+  unsigned int spins = 0;
+
+  for (;;)
+  {
+    unsigned long seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+    {
+      _CC_wait(&spins);
+      continue;
+    }
+
+    const struct _cc_table *table = __atomic_load_n(&stripe->table, __ATOMIC_ACQUIRE);
+    bool found;
+    unsigned int i = _CC_find(table, key, hash, &found);
+    CDictValueType v = found ? _CC_get_value(&table->slot[i]) : INVALID_VALUE;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq)
+    {
+      if (value != NULL)
+        *value = v;
+      return found;
+    }
+  }
+}
+
+/*
+ * Begin a write to a stripe: take its lock and make its sequence odd
+ *
+ * Parameters:
+ *   stripe   The stripe
+ *
+ * Returns: None
+ */
+static void _CC_write_begin(struct _cc_stripe *stripe)
+{
+  pthread_mutex_lock(&stripe->lock);
+  __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * End a write to a stripe: make its sequence even and release its lock
+ *
+ * Parameters:
+ *   stripe   The stripe
+ *
+ * Returns: None
+ */
+static void _CC_write_end(struct _cc_stripe *stripe)
+{
+  __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+ * Replace a stripe's table with one of twice the capacity. The caller
+ * holds the stripe's lock.
+ *
+ * Parameters:
+ *   stripe   The stripe
+ *
+ * Returns: None
+ */
+static void _CC_grow(struct _cc_stripe *stripe)
+{
+  struct _cc_table *old = stripe->table;
+  struct _cc_table *table = _CC_table_new(old->capacity * 2);
+  unsigned int mask = table->capacity - 1;
+
+  for (unsigned int i = 0; i < old->capacity; i++)
+  {
+    if (old->slot[i].hash == CC_EMPTY)
+      continue;
+
+    unsigned int j = old->slot[i].hash & mask;
+
+    while (table->slot[j].hash != CC_EMPTY)
+      j = (j + 1) & mask;
+    table->slot[j] = old->slot[i];
+  }
+
+  table->size = old->size;
+  table->retired = old;
+  __atomic_store_n(&stripe->table, table, __ATOMIC_RELEASE);
+}
+
+// Documented in .h file
+CCDict CC_new()
+{
+  CCDict dict = aligned_alloc(CC_CACHE_LINE, sizeof(struct _cc_dictionary));
+  assert(dict != NULL);
+
+  for (int s = 0; s < CC_NUM_STRIPES; s++)
+  {
+    dict->stripe[s].seq = 0;
+    pthread_mutex_init(&dict->stripe[s].lock, NULL);
+    dict->stripe[s].table = _CC_table_new(CC_DEFAULT_CAPACITY);
+  }
+
+  return dict;
+}
+
+// Documented in .h file
+void CC_free(CCDict dict)
+{
+  if (dict == NULL)
+    return;
+
+  for (int s = 0; s < CC_NUM_STRIPES; s++)
+  {
+    struct _cc_table *table = dict->stripe[s].table;
+
+    while (table != NULL)
+    {
+      struct _cc_table *retired = table->retired;
+
+      free(table);
+      table = retired;
+    }
+    pthread_mutex_destroy(&dict->stripe[s].lock);
+  }
+
+  free(dict);
+}
+
+// Documented in .h file
+unsigned int CC_size(CCDict dict)
+{
+  unsigned int size = 0;
+
+  for (int s = 0; s < CC_NUM_STRIPES; s++)
+  {
+    struct _cc_table *table = __atomic_load_n(&dict->stripe[s].table, __ATOMIC_ACQUIRE);
+
+    size += __atomic_load_n(&table->size, __ATOMIC_RELAXED);
+  }
+
+  return size;
+}
+
+// Documented in .h file
+bool CC_contains(CCDict dict, const char *key)
+{
+  return _CC_read(dict, key, NULL);
+}
+
+// Documented in .h file
+void CC_store(CCDict dict, const char *key, CDictValueType value)
+{
+  if (isnan(value) || strlen(key) > CC_MAX_KEY)
+    return;
+
+  uint64_t hash = _CC_hash(key);
+  struct _cc_stripe *stripe = _CC_stripe(dict, hash);
+  bool found;
+
+  _CC_write_begin(stripe);
+
+  unsigned int i = _CC_find(stripe->table, key, hash, &found);
+
+  if (found)
+  {
+    _CC_set_value(&stripe->table->slot[i], value);
+    _CC_write_end(stripe);
+    return;
+  }
+
+  if (stripe->table->size + 1 > stripe->table->capacity * CC_MAX_LOAD)
+  {
+    _CC_grow(stripe);
+    i = _CC_find(stripe->table, key, hash, &found);
+  }
+
+  struct _cc_table *table = stripe->table;
+  struct _cc_slot *slot = &table->slot[i];
+
+  memset(slot->key, 0, sizeof(slot->key));
+  strcpy(slot->key, key);
+  _CC_set_value(slot, value);
+  __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&table->size, table->size + 1, __ATOMIC_RELAXED);
+
+  _CC_write_end(stripe);
+}
+
+// Documented in .h file
+CDictValueType CC_retrieve(CCDict dict, const char *key)
+{
+  CDictValueType value;
+
+  if (!_CC_read(dict, key, &value))
+    return INVALID_VALUE;
+
+  return value;
+}
+
+// Documented in .h file
+void CC_delete(CCDict dict, const char *key)
+{
+  uint64_t hash = _CC_hash(key);
+  struct _cc_stripe *stripe = _CC_stripe(dict, hash);
+  bool found;
+
+  _CC_write_begin(stripe);
+
+  struct _cc_table *table = stripe->table;
+  unsigned int mask = table->capacity - 1;
+  unsigned int i = _CC_find(table, key, hash, &found);
+
+  if (found)
+  {
+    // shift back each later key of the run that may live in slot i
+    unsigned int j = i;
+
+    for (;;)
+    {
+      j = (j + 1) & mask;
+      if (table->slot[j].hash == CC_EMPTY)
+        break;
+
+      unsigned int home = table->slot[j].hash & mask;
+
+      if (((j - home) & mask) >= ((j - i) & mask))
+      {
+        _CC_move_slot(&table->slot[i], &table->slot[j]);
+        i = j;
+      }
+    }
+
+    __atomic_store_n(&table->slot[i].hash, CC_EMPTY, __ATOMIC_RELAXED);
+    __atomic_store_n(&table->size, table->size - 1, __ATOMIC_RELAXED);
+  }
+
+  _CC_write_end(stripe);
+}
+
+// Documented in .h file
+void CC_foreach(CCDict dict, CD_foreach_callback callback, void *cb_data)
+{
+  struct _cc_slot *copy = NULL;
+  unsigned int copy_capacity = 0;
+
+  for (int s = 0; s < CC_NUM_STRIPES; s++)
+  {
+    struct _cc_stripe *stripe = &dict->stripe[s];
+    unsigned int n;
+    unsigned int spins = 0;
+
+    // copy the stripe out as it stood at one instant, then call back
+    // on the copy, so that the callback is free to write to dict
+    for (;;)
+    {
+      unsigned long seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+
+      if (seq & 1)
+      {
+        _CC_wait(&spins);
+        continue;
+      }
+
+      const struct _cc_table *table = __atomic_load_n(&stripe->table, __ATOMIC_ACQUIRE);
+      unsigned int capacity = table->capacity;
+
+      if (copy_capacity < capacity)
+      {
+        copy_capacity = capacity;
+        copy = realloc(copy, sizeof(struct _cc_slot) * copy_capacity);
+        assert(copy != NULL);
+      }
+
+      n = 0;
+      for (unsigned int i = 0; i < capacity; i++)
+      {
+        uint64_t h = __atomic_load_n(&table->slot[i].hash, __ATOMIC_RELAXED);
+
+        if (h == CC_EMPTY)
+          continue;
+
+        memcpy(copy[n].key, table->slot[i].key, sizeof(copy[n].key));
+        copy[n].value = _CC_get_value(&table->slot[i]);
+        n++;
+      }
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq)
+        break;
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+      callback(copy[i].key, copy[i].value, cb_data);
+  }
+
+  free(copy);
+}
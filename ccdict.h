@@ -0,0 +1,126 @@
+/*
+ * ccdict.h
+ *
+ * A concurrent dictionary from variable names to values, for a set of
+ * variables shared between threads. Any number of threads may read and
+ * write it at once. Readers never take a lock: each stripe of the
+ * table is guarded by a sequence lock, and a reader that overlaps a
+ * write to its stripe simply reads again. Writers to different stripes
+ * do not contend.
+ *
+ * The operations mirror those of CDict.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _CCDICT_H_
+#define _CCDICT_H_
+
+#include <stdbool.h>
+
+#include "cdict.h"
+
+// The longest key that a CCDict holds, the same as the longest symbol
+#define CC_MAX_KEY 31
+
+typedef struct _cc_dictionary *CCDict;
+
+/*
+ * Returns a newly-allocated, empty dictionary
+ *
+ * Parameters: None
+ *
+ * Returns: The new CCDict
+ *
+ * It is the responsibility of the caller to call CC_free on the
+ * dictionary.
+ */
+CCDict CC_new();
+
+/*
+ * Destroy all memory consumed by this dict. No other thread may be
+ * using it.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+void CC_free(CCDict dict);
+
+/*
+ * Returns the number of elements in the dictionary. While other
+ * threads are writing, the count is a snapshot that may already be out
+ * of date.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: the dictionary's size
+ */
+unsigned int CC_size(CCDict dict);
+
+/*
+ * Is key found in dictionary?
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: True if key is in dict, false otherwise
+ */
+bool CC_contains(CCDict dict, const char *key);
+
+/*
+ * Store the supplied key, value pair in the dictionary. If key is
+ * already present, its value is overwritten. As with CD_store, NaN
+ * values are not stored; nor are keys longer than CC_MAX_KEY.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   value    The value
+ *
+ * Returns: None
+ */
+void CC_store(CCDict dict, const char *key, CDictValueType value);
+
+/*
+ * Find the value for a given key
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in dict
+ */
+CDictValueType CC_retrieve(CCDict dict, const char *key);
+
+/*
+ * Delete a key from the dictionary. Does nothing if key is not in
+ * dict.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: None
+ */
+void CC_delete(CCDict dict, const char *key);
+
+/*
+ * Iterate through the dictionary, calling the user-specified callback
+ * function for each element, as CD_foreach does. Each stripe of the
+ * table is visited as it stood at one instant, but writes to other
+ * stripes may land during the walk. The callback may read and write
+ * dict.
+ *
+ * Parameters:
+ *   dict       The dictionary
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void CC_foreach(CCDict dict, CD_foreach_callback callback, void *cb_data);
+
+#endif /* _CCDICT_H_ */
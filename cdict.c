@@ -11,37 +11,97 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "cdict.h"
 
 #define DEBUG
 
 #define DEFAULT_DICT_CAPACITY 8
-#define REHASH_THRESHOLD 0.6
+#define REHASH_THRESHOLD 0.875
+
+// Marks the end of the list of free cells
+#define NO_CELL ((unsigned int)-1)
+
+/*
+ * Each slot has a control byte, kept in an array of its own so that a
+ * probe scans 16 slots with one 16-byte load. A full slot's control
+ * byte holds 7 bits of its key's hash, which rules out nearly every
+ * other key without looking at the slot; an empty slot has the top
+ * bit set. The array carries a copy of its first
+ * CTRL_GROUP_WIDTH - 1 bytes at the end, so that a group starting at
+ * any slot can be loaded without wrapping.
+ */
+#define CTRL_GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t)0x80)
 
 // Edit cdict.c and cdict.h so that the CDict type maps from char * to double. instead of char * to char *.
-typedef enum
+struct _hash_slot
 {
-  SLOT_UNUSED = 0,
-  SLOT_IN_USE,
-  SLOT_DELETED
-} CDictSlotStatus;
+  uint64_t hash;     // CD_hash(key), so that the key is never hashed again
+  unsigned int cell; // index of the cell holding this key's value
+};
 
-struct _hash_slot
+// The key offset of a cell that is free
+#define NO_KEY ((unsigned int)-1)
+
+/*
+ * Values live in cells, apart from the hash slots, so that a key's
+ * value stays at the same index when the slots are rehashed. A cell's
+ * generation changes whenever the cell is freed, which invalidates any
+ * CDictCell still referring to it. The cell also locates its key in
+ * the key arena, so walking the cells in order walks the keys in the
+ * order they were stored.
+ */
+struct _value_cell
 {
-  CDictSlotStatus status;
-  CDictKeyType key;
   CDictValueType value;
+  unsigned long version; // the dict's clock when value last changed
+  unsigned int generation;
+  unsigned int next_free;
+  unsigned int key; // offset of the key in the key arena, or NO_KEY
 };
 
 struct _dictionary
 {
   unsigned int num_stored;
-  unsigned int num_deleted;
   unsigned int capacity;
+  int8_t *ctrl; // capacity + CTRL_GROUP_WIDTH - 1 control bytes
   struct _hash_slot *slot;
+
+  unsigned long serial; // distinguishes this dict's cells from any other's
+  struct _value_cell *cell;
+  unsigned int num_cells;
+  unsigned int cell_capacity;
+  unsigned int free_cell;
+
+  unsigned long clock; // advanced by every change to the dict, see CD_clock
+
+  /*
+   * The keys, each NUL-terminated, packed one after another in a single
+   * buffer that the dictionary owns. Deleted keys are left in place
+   * until they make up half the buffer, when the live keys are copied
+   * to a fresh buffer in cell order.
+   */
+  char *keys;
+  unsigned int keys_used;
+  unsigned int keys_capacity;
+  unsigned int keys_dead; // bytes held by deleted keys
+
+  CDict parent; // the dict that lookups fall through to, see CD_push_scope
 };
 
+#define DEFAULT_KEYS_CAPACITY 256
+
+// How many keys ahead CD_store_many hashes and prefetches
+#define STORE_AHEAD 8
+
+// Source of CDict serial numbers; 0 is never issued
+static unsigned long _cd_next_serial = 1;
+
 // Documented in .h file
 CDict CD_new()
 {
@@ -51,24 +111,34 @@ CDict CD_new()
     return NULL;
 
   dict->num_stored = 0;
-  dict->num_deleted = 0;
   dict->capacity = DEFAULT_DICT_CAPACITY;
 
+  dict->serial = __atomic_fetch_add(&_cd_next_serial, 1, __ATOMIC_RELAXED);
+  dict->num_cells = 0;
+  dict->cell_capacity = DEFAULT_DICT_CAPACITY;
+  dict->free_cell = NO_CELL;
+  dict->clock = 0;
+  dict->cell = (struct _value_cell *)malloc(sizeof(struct _value_cell) * dict->cell_capacity);
+
   dict->slot = (struct _hash_slot *)malloc(sizeof(struct _hash_slot) * dict->capacity);
+  dict->ctrl = (int8_t *)malloc(dict->capacity + CTRL_GROUP_WIDTH - 1);
+
+  dict->keys_used = 0;
+  dict->keys_capacity = DEFAULT_KEYS_CAPACITY;
+  dict->keys_dead = 0;
+  dict->keys = (char *)malloc(dict->keys_capacity);
+  dict->parent = NULL;
 
-  if (dict->slot == NULL)
+  if (dict->slot == NULL || dict->ctrl == NULL || dict->cell == NULL || dict->keys == NULL)
   {
     CD_free(dict);
     return NULL;
   }
 
   // Initialize the slots
+  memset(dict->ctrl, CTRL_EMPTY, dict->capacity + CTRL_GROUP_WIDTH - 1);
   for (unsigned int i = 0; i < dict->capacity; i++)
-  {
-    dict->slot[i].status = SLOT_UNUSED;
-    dict->slot[i].key = NULL;
-    dict->slot[i].value = NAN; // To check if -1 is valid initial value
-  }
+    dict->slot[i].cell = NO_CELL;
 
   return dict;
 }
@@ -78,101 +148,406 @@ void CD_free(CDict dict)
 {
   if (dict)
   {
-    if (dict->slot)
-    {
-      for (unsigned int i = 0; i < dict->capacity; i++)
-      {
-        if (dict->slot[i].status == SLOT_IN_USE)
-          free(dict->slot[i].key);
-      }
-      free(dict->slot);
-    }
-
+    free(dict->keys);
+    free(dict->slot);
+    free(dict->ctrl);
+    free(dict->cell);
     free(dict);
   }
 }
 
+// Multipliers for CD_hash, from wyhash
+#define HASH_K0 0xa0761d6478bd642fULL
+#define HASH_K1 0xe7037ed1a0b428dbULL
+
+/*
+ * Multiply two 64-bit words to 128 bits and fold the halves together
+ */
+static inline uint64_t _CD_mum(uint64_t a, uint64_t b)
+{
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// Documented in .h file
+uint64_t CD_hash(const char *key)
+{
+  size_t len = strlen(key);
+  uint64_t h = HASH_K0;
+  uint64_t a, b;
+
+  for (size_t n = len; n > 8; n -= 8, key += 8)
+  {
+    memcpy(&a, key, 8);
+    h = _CD_mum(a ^ HASH_K1, h);
+  }
+
+  // the last 1-8 bytes, read as two overlapping halves; the length is
+  // mixed in below, so no two tails collide
+  size_t tail = (len == 0) ? 0 : (len - 1) % 8 + 1;
+  if (tail >= 4)
+  {
+    uint32_t lo, hi;
+
+    memcpy(&lo, key, 4);
+    memcpy(&hi, key + tail - 4, 4);
+    a = lo;
+    b = hi;
+  }
+  else if (tail > 0)
+  {
+    a = (uint64_t)(unsigned char)key[0] << 16 | (uint64_t)(unsigned char)key[tail / 2] << 8 |
+        (unsigned char)key[tail - 1];
+    b = 0;
+  }
+  else
+    a = b = 0;
+
+  return _CD_mum(HASH_K1 ^ len, _CD_mum(a ^ HASH_K1, b ^ h));
+}
+
+/*
+ * Returns: The control byte for a full slot whose key has hash. The
+ *   slot index comes from the low bits of the hash, and the control
+ *   byte from the top 7, so the two are independent.
+ */
+static inline int8_t _CD_h2(uint64_t hash)
+{
+  return (int8_t)(hash >> 57);
+}
+
 /*
- * Return a pseudorandom hash of a key with reasonable distribution
- * properties. Based on Python's implementation before Python 3.4
+ * Match a control byte against a group of CTRL_GROUP_WIDTH control
+ * bytes
  *
  * Parameters:
- *   str   The string to be hashed
- *   capacity  The capacity of the dictionary
+ *   group    The first byte of the group
+ *   byte     The control byte to look for
  *
- * Returns: The hash, in the range 0-(capacity-1) inclusive
+ * Returns: A mask with bit i set if group[i] == byte
  */
-static unsigned int _CD_hash(CDictKeyType str, unsigned int capacity)
+static inline unsigned int _CD_match(const int8_t *group, int8_t byte)
 {
-  unsigned int x;
-  unsigned int len = 0;
-
-  for (const char *p = str; *p; p++)
-    len++;
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+  unsigned int mask = 0;
 
-  if (len == 0)
-    return 0;
+  for (int i = 0; i < CTRL_GROUP_WIDTH; i++)
+    if (group[i] == byte)
+      mask |= 1u << i;
 
-  const char *p = str;
-  x = (unsigned int)*p << 7;
+  return mask;
+#endif
+}
 
-  for (int i = 0; i < len; i++)
-    x = (1000003 * x) ^ (unsigned int)*p++;
+/*
+ * Returns: A mask with bit i set if group[i] is an empty slot, the
+ *   only control byte with the top bit set
+ */
+static inline unsigned int _CD_match_empty(const int8_t *group)
+{
+#ifdef __SSE2__
+  return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  unsigned int mask = 0;
 
-  x ^= (unsigned int)len;
+  for (int i = 0; i < CTRL_GROUP_WIDTH; i++)
+    if (group[i] < 0)
+      mask |= 1u << i;
 
-  return x % capacity;
+  return mask;
+#endif
 }
 
 /*
- * Rehash the dictionary, doubling its capacity
+ * Set the control byte of a slot, and its copies past the end of the
+ * array
  *
  * Parameters:
- *   dict     The dictionary to rehash
+ *   dict     The dictionary
+ *   index    The slot
+ *   byte     The control byte
  *
  * Returns: None
  */
-static void _CD_rehash(CDict dict)
+static inline void _CD_set_ctrl(CDict dict, unsigned int index, int8_t byte)
 {
-  assert(dict != NULL);
+  dict->ctrl[index] = byte;
 
-  unsigned int new_capacity = dict->capacity * 2;
-  unsigned int new_num_stored = 0;
-  struct _hash_slot *new_slot = malloc(sizeof(struct _hash_slot) * new_capacity);
+  for (unsigned int i = index + dict->capacity; i < dict->capacity + CTRL_GROUP_WIDTH - 1; i += dict->capacity)
+    dict->ctrl[i] = byte;
+}
 
-  if (new_slot == NULL)
+/*
+ * Copy a key into the key arena
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: The offset of the copy in the arena
+ */
+static unsigned int _CD_add_key(CDict dict, CDictKeyType key)
+{
+  size_t size = strlen(key) + 1;
+  unsigned int offset = dict->keys_used;
+
+  assert(size <= UINT32_MAX - dict->keys_used);
+  if (dict->keys_used + size > dict->keys_capacity)
   {
-    CD_free(dict);
-    return;
+    while (dict->keys_used + size > dict->keys_capacity)
+      dict->keys_capacity = (dict->keys_capacity > UINT32_MAX / 2) ? UINT32_MAX : dict->keys_capacity * 2;
+    dict->keys = realloc(dict->keys, dict->keys_capacity);
+    assert(dict->keys != NULL);
   }
 
-  // Initialize the new slots
-  for (unsigned int i = 0; i < new_capacity; i++)
-    new_slot[i].status = SLOT_UNUSED;
+  memcpy(dict->keys + offset, key, size);
+  dict->keys_used += size;
+  return offset;
+}
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+/*
+ * Copy the live keys to a fresh arena, in cell order, dropping the
+ * deleted ones
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+static void _CD_compact_keys(CDict dict)
+{
+  unsigned int live = dict->keys_used - dict->keys_dead;
+  char *old_keys = dict->keys;
+
+  dict->keys_capacity = DEFAULT_KEYS_CAPACITY;
+  while (dict->keys_capacity < 2 * live)
+    dict->keys_capacity *= 2;
+  dict->keys = malloc(dict->keys_capacity);
+  assert(dict->keys != NULL);
+  dict->keys_used = 0;
+  dict->keys_dead = 0;
+
+  for (unsigned int c = 0; c < dict->num_cells; c++)
+    if (dict->cell[c].key != NO_KEY)
+      dict->cell[c].key = _CD_add_key(dict, old_keys + dict->cell[c].key);
+
+  free(old_keys);
+}
+
+/*
+ * Returns: The key held in a full slot
+ */
+static inline char *_CD_key(CDict dict, unsigned int index)
+{
+  return dict->keys + dict->cell[dict->slot[index].cell].key;
+}
+
+/*
+ * Find the slot holding a key. Probing is linear from the key's home
+ * slot, a group of control bytes at a time, and stops at the first
+ * group with an empty slot; strcmp is called only for slots whose
+ * control byte and stored hash both match the key's.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   hash     The hash of key
+ *
+ * Returns: The index of the slot, or NO_CELL if key is not in dict
+ */
+static unsigned int _CD_find(CDict dict, CDictKeyType key, uint64_t hash)
+{
+  unsigned int mask = dict->capacity - 1;
+  unsigned int pos = hash & mask;
+  int8_t h2 = _CD_h2(hash);
+
+  for (unsigned int probed = 0; probed < dict->capacity; probed += CTRL_GROUP_WIDTH)
   {
-    if (dict->slot[i].status == SLOT_IN_USE)
+    const int8_t *group = dict->ctrl + pos;
+
+    for (unsigned int m = _CD_match(group, h2); m != 0; m &= m - 1)
     {
-      unsigned int hash = _CD_hash(dict->slot[i].key, new_capacity); // avoid same hash ON NEW CAPACITY
+      unsigned int index = (pos + __builtin_ctz(m)) & mask;
 
-      while (new_slot[hash].status == SLOT_IN_USE)
-        hash = (hash + 1) % new_capacity;
+      if (dict->slot[index].hash == hash && strcmp(_CD_key(dict, index), key) == 0)
+        return index;
+    }
+
+    if (_CD_match_empty(group) != 0)
+      return NO_CELL;
+
+    pos = (pos + CTRL_GROUP_WIDTH) & mask;
+  }
+
+  return NO_CELL;
+}
 
-      new_slot[hash].status = SLOT_IN_USE;
-      new_slot[hash].key = dict->slot[i].key;
-      new_slot[hash].value = dict->slot[i].value;
-      new_num_stored++;
+/*
+ * Find the first empty slot on the probe sequence of a hash
+ *
+ * Parameters:
+ *   dict     The dictionary, which must have a free slot
+ *   hash     The hash
+ *
+ * Returns: The index of the slot
+ */
+static unsigned int _CD_find_free(CDict dict, uint64_t hash)
+{
+  unsigned int mask = dict->capacity - 1;
+  unsigned int pos = hash & mask;
+
+  while (true)
+  {
+    unsigned int m = _CD_match_empty(dict->ctrl + pos);
+
+    if (m != 0)
+      return (pos + __builtin_ctz(m)) & mask;
+
+    pos = (pos + CTRL_GROUP_WIDTH) & mask;
+  }
+}
+
+/*
+ * Allocate a cell, reusing a freed one if there is one
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key, which is copied into the key arena
+ *   value    The initial value for the cell
+ *
+ * Returns: The index of the cell
+ */
+static unsigned int _CD_new_cell(CDict dict, CDictKeyType key, CDictValueType value)
+{
+  unsigned int index = dict->free_cell;
+
+  if (index != NO_CELL)
+    dict->free_cell = dict->cell[index].next_free;
+  else
+  {
+    if (dict->num_cells == dict->cell_capacity)
+    {
+      dict->cell_capacity *= 2;
+      dict->cell = realloc(dict->cell, sizeof(struct _value_cell) * dict->cell_capacity);
+      assert(dict->cell != NULL);
     }
+
+    index = dict->num_cells++;
+    dict->cell[index].generation = 1;
+  }
+
+  dict->cell[index].value = value;
+  dict->cell[index].version = ++dict->clock;
+  dict->cell[index].next_free = NO_CELL;
+  dict->cell[index].key = _CD_add_key(dict, key);
+  return index;
+}
+
+/*
+ * Return a cell to the free list, invalidating any CDictCell that
+ * refers to it
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   index    The index of the cell
+ *
+ * Returns: None
+ */
+static void _CD_free_cell(CDict dict, unsigned int index)
+{
+  dict->cell[index].generation++;
+  dict->cell[index].value = NAN;
+  dict->clock++;
+  dict->cell[index].next_free = dict->free_cell;
+  dict->free_cell = index;
+
+  dict->keys_dead += strlen(dict->keys + dict->cell[index].key) + 1;
+  dict->cell[index].key = NO_KEY;
+  if (dict->keys_dead > dict->keys_used / 2 && dict->keys_used > DEFAULT_KEYS_CAPACITY)
+    _CD_compact_keys(dict);
+}
+
+/*
+ * Overwrite the value in a cell, advancing its version if the value
+ * changes
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   index    The index of the cell
+ *   value    The new value
+ *
+ * Returns: None
+ */
+static void _CD_set_cell(CDict dict, unsigned int index, CDictValueType value)
+{
+  // compare the bits, so that 0 and -0 count as different values
+  if (memcmp(&dict->cell[index].value, &value, sizeof(value)) == 0)
+    return;
+
+  dict->cell[index].value = value;
+  dict->cell[index].version = ++dict->clock;
+}
+
+/*
+ * Returns: The smallest capacity that holds num_keys keys without
+ *   exceeding REHASH_THRESHOLD
+ */
+static unsigned int _CD_capacity_for(unsigned int num_keys)
+{
+  unsigned int capacity = DEFAULT_DICT_CAPACITY;
+
+  while (num_keys > REHASH_THRESHOLD * capacity)
+  {
+    assert(capacity <= UINT32_MAX / 2);
+    capacity *= 2;
   }
 
-  // Free the old slot array
-  free(dict->slot);
+  return capacity;
+}
+
+/*
+ * Rehash the dictionary into a new capacity. The slots are moved using
+ * their stored hashes; no key is read.
+ *
+ * Parameters:
+ *   dict          The dictionary to rehash
+ *   new_capacity  The new capacity, a power of two large enough for
+ *                 the keys in dict
+ *
+ * Returns: None
+ */
+static void _CD_rehash(CDict dict, unsigned int new_capacity)
+{
+  assert(dict != NULL);
+  assert(dict->num_stored <= REHASH_THRESHOLD * new_capacity);
+
+  unsigned int old_capacity = dict->capacity;
+  struct _hash_slot *old_slot = dict->slot;
+  int8_t *old_ctrl = dict->ctrl;
 
-  // Update the old slot array to the new slot array
-  dict->slot = new_slot;
   dict->capacity = new_capacity;
-  dict->num_deleted = 0;
+  dict->slot = malloc(sizeof(struct _hash_slot) * dict->capacity);
+  dict->ctrl = malloc(dict->capacity + CTRL_GROUP_WIDTH - 1);
+  assert(dict->slot != NULL && dict->ctrl != NULL);
+
+  memset(dict->ctrl, CTRL_EMPTY, dict->capacity + CTRL_GROUP_WIDTH - 1);
+
+  for (unsigned int i = 0; i < old_capacity; i++)
+  {
+    if (old_ctrl[i] >= 0)
+    {
+      unsigned int index = _CD_find_free(dict, old_slot[i].hash);
+
+      _CD_set_ctrl(dict, index, old_ctrl[i]);
+      dict->slot[index] = old_slot[i];
+    }
+  }
+
+  free(old_slot);
+  free(old_ctrl);
 }
 
 // Documented in .h file
@@ -181,21 +556,48 @@ unsigned int CD_size(CDict dict)
 #ifdef DEBUG
   // iterate across slots, counting number of keys found
   int used = 0;
-  int deleted = 0;
 
   for (int i = 0; i < dict->capacity; i++)
-    if (dict->slot[i].status == SLOT_IN_USE)
+    if (dict->ctrl[i] >= 0)
       used++;
-    else if (dict->slot[i].status == SLOT_DELETED)
-      deleted++;
 
   assert(used == dict->num_stored);
-  assert(deleted == dict->num_deleted);
 #endif
 
   return dict->num_stored;
 }
 
+// Documented in .h file
+bool CD_check_invariants(CDict dict)
+{
+  unsigned int mask = dict->capacity - 1;
+  unsigned int used = 0;
+
+  for (unsigned int i = 0; i < dict->capacity; i++)
+  {
+    if (dict->ctrl[i] < 0)
+      continue;
+
+    // each key hashes to its slot's hash and control byte, and no empty
+    // slot separates it from its home slot
+    uint64_t hash = CD_hash(_CD_key(dict, i));
+
+    if (dict->slot[i].hash != hash || dict->ctrl[i] != _CD_h2(hash))
+      return false;
+    for (unsigned int j = hash & mask; j != i; j = (j + 1) & mask)
+      if (dict->ctrl[j] < 0)
+        return false;
+    used++;
+  }
+
+  // the control bytes past the end mirror the first group
+  for (unsigned int i = 0; i < CTRL_GROUP_WIDTH - 1; i++)
+    if (dict->ctrl[dict->capacity + i] != dict->ctrl[i % dict->capacity])
+      return false;
+
+  return used == dict->num_stored;
+}
+
 // Documented in .h file
 unsigned int CD_capacity(CDict dict)
 {
@@ -211,22 +613,68 @@ bool CD_contains(CDict dict, CDictKeyType key)
   if (dict == NULL || key == NULL)
     return false;
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  uint64_t hash = CD_hash(key);
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
-  {
-    unsigned int index = (hash + i) % dict->capacity;
+  for (; dict != NULL; dict = dict->parent)
+    if (_CD_find(dict, key, hash) != NO_CELL)
+      return true;
 
-    // Can't find it
-    if (dict->slot[index].status == SLOT_UNUSED)
-      return false;
+  return false;
+}
 
-    // Found it
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
-      return true;
+/*
+ * Add a key that is not in the dictionary, growing the table if it
+ * becomes too full
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   hash     CD_hash(key)
+ *   value    The value, which is not NaN
+ *
+ * Returns: The index of the key's cell
+ */
+static unsigned int _CD_insert(CDict dict, CDictKeyType key, uint64_t hash, CDictValueType value)
+{
+  // Insert at the first empty slot
+  unsigned int index = _CD_find_free(dict, hash);
+  unsigned int c = _CD_new_cell(dict, key, value);
+
+  _CD_set_ctrl(dict, index, _CD_h2(hash));
+  dict->slot[index].hash = hash;
+  dict->slot[index].cell = c;
+  dict->num_stored++;
+
+  // Check if rehashing is needed after storing new key
+  if (CD_load_factor(dict) > REHASH_THRESHOLD)
+    _CD_rehash(dict, dict->capacity * 2);
+
+  return c;
+}
+
+/*
+ * Store a key, value pair, as for CD_store, given the key's hash
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   hash     CD_hash(key)
+ *   value    The value, which is not NaN
+ *
+ * Returns: None
+ */
+static void _CD_store_hashed(CDict dict, CDictKeyType key, uint64_t hash, CDictValueType value)
+{
+  unsigned int index = _CD_find(dict, key, hash);
+
+  // Found a slot with the same key, update the value
+  if (index != NO_CELL)
+  {
+    _CD_set_cell(dict, dict->slot[index].cell, value);
+    return;
   }
 
-  return false;
+  _CD_insert(dict, key, hash, value);
 }
 
 // Documented in .h file
@@ -238,35 +686,70 @@ void CD_store(CDict dict, CDictKeyType key, CDictValueType value)
   if (isnan(value))
     return;
 
-  // Hash the key to get an index
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  _CD_store_hashed(dict, key, CD_hash(key), value);
+}
+
+// Documented in .h file
+void CD_reserve(CDict dict, unsigned int num_keys)
+{
+  if (dict == NULL)
+    return;
+
+  unsigned int capacity = _CD_capacity_for(num_keys);
 
-  // Check for collisions and deleted slots
-  while ((dict->slot[hash].status == SLOT_IN_USE && strcmp(dict->slot[hash].key, key) != 0) ||
-         dict->slot[hash].status == SLOT_DELETED)
-    hash = (hash + 1) % dict->capacity; // move to next slot
+  if (capacity > dict->capacity)
+    _CD_rehash(dict, capacity);
 
-  // Found a slot with the same key, update the value
-  if (dict->slot[hash].status == SLOT_IN_USE && strcmp(dict->slot[hash].key, key) == 0)
+  if (num_keys > dict->cell_capacity)
   {
-    dict->slot[hash].value = value;
-    return;
+    dict->cell_capacity = num_keys;
+    dict->cell = realloc(dict->cell, sizeof(struct _value_cell) * dict->cell_capacity);
+    assert(dict->cell != NULL);
   }
+}
+
+// Documented in .h file
+void CD_store_many(CDict dict, const CDictKeyType keys[], const CDictValueType values[], unsigned int num_keys)
+{
+  if (dict == NULL)
+    return;
+
+  assert(num_keys <= UINT32_MAX - dict->num_stored);
+  CD_reserve(dict, dict->num_stored + num_keys);
+
+  // hash each key STORE_AHEAD keys early and prefetch its home slot, so
+  // that the cache misses of several stores overlap; the table does
+  // not grow during the loop, so the home slots stay put
+  uint64_t hash[STORE_AHEAD];
+  unsigned int mask = dict->capacity - 1;
 
-  // Found an empty, insert here
-  else if (dict->slot[hash].status == SLOT_UNUSED)
+  for (unsigned int i = 0; i < num_keys + STORE_AHEAD; i++)
   {
-    dict->slot[hash].status = SLOT_IN_USE;
-    dict->slot[hash].key = strdup(key);
-    dict->slot[hash].value = value;
-    dict->num_stored++;
+    if (i >= STORE_AHEAD && !isnan(values[i - STORE_AHEAD]))
+      _CD_store_hashed(dict, keys[i - STORE_AHEAD], hash[i % STORE_AHEAD], values[i - STORE_AHEAD]);
 
-    // Check if rehashing is needed after storing new key
-    if (CD_load_factor(dict) > REHASH_THRESHOLD)
-      _CD_rehash(dict);
+    if (i < num_keys)
+    {
+      hash[i % STORE_AHEAD] = CD_hash(keys[i]);
+      __builtin_prefetch(&dict->ctrl[hash[i % STORE_AHEAD] & mask]);
+      __builtin_prefetch(&dict->slot[hash[i % STORE_AHEAD] & mask]);
+    }
+  }
+}
 
+// Documented in .h file
+void CD_shrink_to_fit(CDict dict)
+{
+  if (dict == NULL)
     return;
-  }
+
+  unsigned int capacity = _CD_capacity_for(dict->num_stored);
+
+  if (capacity < dict->capacity)
+    _CD_rehash(dict, capacity);
+
+  if (dict->keys_dead > 0)
+    _CD_compact_keys(dict);
 }
 
 // Documented in .h file
@@ -275,17 +758,14 @@ CDictValueType CD_retrieve(CDict dict, CDictKeyType key)
   if (dict == NULL || key == NULL)
     return INVALID_VALUE;
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  uint64_t hash = CD_hash(key);
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  for (; dict != NULL; dict = dict->parent)
   {
-    unsigned int index = (hash + i) % dict->capacity;
+    unsigned int index = _CD_find(dict, key, hash);
 
-    if (dict->slot[index].status == SLOT_UNUSED)
-      return INVALID_VALUE;
-
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
-      return dict->slot[index].value;
+    if (index != NO_CELL)
+      return dict->cell[dict->slot[index].cell].value;
   }
 
   return INVALID_VALUE;
@@ -297,30 +777,43 @@ void CD_delete(CDict dict, CDictKeyType key)
   assert(dict != NULL);
   assert(key != NULL);
 
-  unsigned int hash = _CD_hash(key, dict->capacity);
+  unsigned int index = _CD_find(dict, key, CD_hash(key));
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
+  // Can't find it
+  if (index == NO_CELL)
   {
-    unsigned int index = (hash + i) % dict->capacity;
+    printf("Error: cannot delete key [%s] not found\n", key);
+    return;
+  }
 
-    // Can't find it
-    if (dict->slot[index].status == SLOT_UNUSED)
-    {
-      printf("Error: cannot delete key [%s] not found\n", key);
-      return;
-    }
+  _CD_free_cell(dict, dict->slot[index].cell);
+  dict->num_stored--;
 
-    // Found it
-    else if (dict->slot[index].status == SLOT_IN_USE && strcmp(dict->slot[index].key, key) == 0)
+  /*
+   * Backward-shift deletion: rather than leave a tombstone, move back
+   * into the hole each later key of the same run whose home slot is
+   * not after the hole, so that every key stays reachable from its
+   * home slot without passing an empty slot
+   */
+  unsigned int mask = dict->capacity - 1;
+  unsigned int hole = index;
+
+  for (unsigned int j = (hole + 1) & mask; dict->ctrl[j] != CTRL_EMPTY; j = (j + 1) & mask)
+  {
+    unsigned int home = dict->slot[j].hash & mask;
+
+    // the key at j may move to the hole unless its home lies cyclically
+    // in (hole, j]
+    if (((j - home) & mask) >= ((j - hole) & mask))
     {
-      dict->slot[index].status = SLOT_DELETED;
-      dict->num_stored--;
-      dict->num_deleted++;
-      dict->slot[index].key = NULL;
-      dict->slot[index].value = NAN;
-      return;
+      _CD_set_ctrl(dict, hole, dict->ctrl[j]);
+      dict->slot[hole] = dict->slot[j];
+      hole = j;
     }
   }
+
+  _CD_set_ctrl(dict, hole, CTRL_EMPTY);
+  dict->slot[hole].cell = NO_CELL;
 }
 // Documented in .h file
 double CD_load_factor(CDict dict)
@@ -328,7 +821,7 @@ double CD_load_factor(CDict dict)
   if (dict == NULL || dict->capacity <= 0)
     return 0;
 
-  return (double)(dict->num_stored + dict->num_deleted) / dict->capacity;
+  return (double)dict->num_stored / dict->capacity;
 }
 
 // Documented in .h file
@@ -336,21 +829,19 @@ void CD_print(CDict dict)
 {
   assert(dict != NULL);
 
-  printf("*** capacity: %u stored: %u deleted: %u load_factor: %.2f\n",
-         dict->capacity, dict->num_stored, dict->num_deleted, CD_load_factor(dict));
+  printf("*** capacity: %u stored: %u load_factor: %.2f\n",
+         dict->capacity, dict->num_stored, CD_load_factor(dict));
 
   for (unsigned int i = 0; i < dict->capacity; i++)
   {
     printf("%02u: ", i);
 
-    if (dict->slot[i].status == SLOT_UNUSED)
+    if (dict->ctrl[i] == CTRL_EMPTY)
       printf("unused\n");
 
-    else if (dict->slot[i].status == SLOT_DELETED)
-      printf("DELETED\n");
-
-    else if (dict->slot[i].status == SLOT_IN_USE)
-      printf("IN_USE key=%s hash=%u value=%g\n", dict->slot[i].key, _CD_hash(dict->slot[i].key, dict->capacity), dict->slot[i].value);
+    else
+      printf("IN_USE key=%s home=%u h2=%02x value=%g\n", _CD_key(dict, i),
+             (unsigned int)(dict->slot[i].hash & (dict->capacity - 1)), dict->ctrl[i], dict->cell[dict->slot[i].cell].value);
   }
 }
 
@@ -359,7 +850,204 @@ void CD_foreach(CDict dict, CD_foreach_callback callback, void *cb_data)
   if (dict == NULL || callback == NULL)
     return;
 
-  for (unsigned int i = 0; i < dict->capacity; i++)
-    if (dict->slot[i].status == SLOT_IN_USE)
-      callback(dict->slot[i].key, dict->slot[i].value, cb_data);
-}
\ No newline at end of file
+  // walk the cells rather than the slots, so that the cells and the
+  // keys are both read in order
+  for (unsigned int c = 0; c < dict->num_cells; c++)
+    if (dict->cell[c].key != NO_KEY)
+      callback(dict->keys + dict->cell[c].key, dict->cell[c].value, cb_data);
+}
+// Documented in .h file
+bool CD_find_cell(CDict dict, CDictKeyType key, CDictCell *cell)
+{
+  if (dict == NULL || key == NULL)
+    return false;
+
+  uint64_t hash = CD_hash(key);
+
+  // the first layer that holds the key shadows those below it
+  for (; dict != NULL; dict = dict->parent)
+  {
+    unsigned int index = _CD_find(dict, key, hash);
+
+    if (index != NO_CELL)
+    {
+      unsigned int c = dict->slot[index].cell;
+
+      *cell = (CDictCell){dict->serial, c, dict->cell[c].generation};
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Documented in .h file
+CDictCell CD_find_or_add(CDict dict, CDictKeyType key, CDictValueType initial)
+{
+  if (dict == NULL || key == NULL)
+    return INVALID_CELL;
+
+  uint64_t hash = CD_hash(key);
+
+  for (CDict layer = dict; layer != NULL; layer = layer->parent)
+  {
+    unsigned int index = _CD_find(layer, key, hash);
+
+    if (index != NO_CELL)
+    {
+      unsigned int c = layer->slot[index].cell;
+
+      return (CDictCell){layer->serial, c, layer->cell[c].generation};
+    }
+  }
+
+  if (isnan(initial))
+    return INVALID_CELL;
+
+  unsigned int c = _CD_insert(dict, key, hash, initial);
+
+  return (CDictCell){dict->serial, c, dict->cell[c].generation};
+}
+
+/*
+ * Find the layer of a scope chain that a cell belongs to, provided the
+ * cell is still valid there and its key is not shadowed by a layer
+ * above it
+ *
+ * Parameters:
+ *   dict     The dictionary, which may be a scope
+ *   cell     The cell
+ *
+ * Returns: The dictionary that holds the cell, which is dict itself or
+ *   one of its parents; or NULL if cell is not valid for dict
+ */
+static CDict _CD_cell_owner(CDict dict, CDictCell cell)
+{
+  CDict owner = dict;
+
+  while (owner != NULL && owner->serial != cell.dict_serial)
+    owner = owner->parent;
+
+  if (owner == NULL || cell.index >= owner->num_cells || owner->cell[cell.index].generation != cell.generation)
+    return NULL;
+
+  if (owner == dict)
+    return owner;
+
+  // a key stored in a layer above the owner since the cell was found
+  // hides the owner's
+  const char *key = owner->keys + owner->cell[cell.index].key;
+  uint64_t hash = 0;
+
+  for (CDict layer = dict; layer != owner; layer = layer->parent)
+  {
+    if (layer->num_stored == 0)
+      continue;
+    if (hash == 0)
+      hash = CD_hash(key);
+    if (_CD_find(layer, (CDictKeyType)key, hash) != NO_CELL)
+      return NULL;
+  }
+
+  return owner;
+}
+
+// Documented in .h file
+bool CD_cell_valid(CDict dict, CDictCell cell)
+{
+  if (dict == NULL)
+    return false;
+
+  if (cell.dict_serial == dict->serial)
+    return cell.index < dict->num_cells && dict->cell[cell.index].generation == cell.generation;
+
+  return dict->parent != NULL && _CD_cell_owner(dict, cell) != NULL;
+}
+
+// Documented in .h file
+CDictValueType CD_cell_load(CDict dict, CDictCell cell)
+{
+  CDict owner = (dict == NULL) ? NULL : _CD_cell_owner(dict, cell);
+
+  if (owner == NULL)
+    return INVALID_VALUE;
+
+  return owner->cell[cell.index].value;
+}
+
+// Documented in .h file
+void CD_cell_store(CDict dict, CDictCell cell, CDictValueType value)
+{
+  if (isnan(value) || dict == NULL)
+    return;
+
+  CDict owner = _CD_cell_owner(dict, cell);
+
+  if (owner == dict)
+    _CD_set_cell(dict, cell.index, value);
+  else if (owner != NULL)
+  {
+    // a scope never writes to its parents: the key gets a value of its
+    // own in this layer, which shadows the parent's
+    char *key = owner->keys + owner->cell[cell.index].key;
+
+    _CD_store_hashed(dict, key, CD_hash(key), value);
+  }
+}
+
+// Documented in .h file
+unsigned long CD_clock(CDict dict)
+{
+  unsigned long clock = 0;
+
+  // a change to any layer of a scope chain advances the sum
+  for (; dict != NULL; dict = dict->parent)
+    clock += dict->clock;
+
+  return clock;
+}
+
+// Documented in .h file
+unsigned long CD_version(CDict dict, CDictKeyType key)
+{
+  CDictCell cell;
+
+  if (!CD_find_cell(dict, key, &cell))
+    return 0;
+
+  return CD_cell_version(dict, cell);
+}
+
+// Documented in .h file
+unsigned long CD_cell_version(CDict dict, CDictCell cell)
+{
+  CDict owner = (dict == NULL) ? NULL : _CD_cell_owner(dict, cell);
+
+  if (owner == NULL)
+    return 0;
+
+  return owner->cell[cell.index].version;
+}
+
+// Documented in .h file
+CDict CD_push_scope(CDict parent)
+{
+  assert(parent != NULL);
+
+  CDict scope = CD_new();
+  assert(scope != NULL);
+
+  scope->parent = parent;
+  return scope;
+}
+
+// Documented in .h file
+CDict CD_pop_scope(CDict scope)
+{
+  assert(scope != NULL);
+
+  CDict parent = scope->parent;
+
+  CD_free(scope);
+  return parent;
+}
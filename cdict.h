@@ -10,6 +10,7 @@
 #define _CDICT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <math.h>
 
@@ -88,6 +89,46 @@ bool CD_contains(CDict dict, CDictKeyType key);
  */
 void CD_store(CDict dict, CDictKeyType key, CDictValueType value);
 
+/*
+ * Grow the dictionary, if need be, so that it holds num_keys keys in
+ * all without rehashing. Storing many keys into a dictionary that has
+ * been reserved for them rehashes it once rather than at every
+ * doubling.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   num_keys The number of keys to make room for
+ *
+ * Returns: None
+ */
+void CD_reserve(CDict dict, unsigned int num_keys);
+
+/*
+ * Store many key, value pairs, as for CD_store, reserving room for all
+ * of them first
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   keys     The keys
+ *   values   The values, in the order of keys
+ *   num_keys The number of keys
+ *
+ * Returns: None
+ */
+void CD_store_many(CDict dict, const CDictKeyType keys[], const CDictValueType values[], unsigned int num_keys);
+
+/*
+ * Shrink the dictionary to the smallest capacity that holds its keys,
+ * and release the space held by deleted keys. The value cells are
+ * kept, so every CDictCell stays valid.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: None
+ */
+void CD_shrink_to_fit(CDict dict);
+
 /*
  * Find the value for a given key
  *
@@ -117,13 +158,29 @@ void CD_delete(CDict dict, CDictKeyType key);
  *   dict     The dictionary
  *
  * Returns: The current load factor, which is
- *     (num_elements + num_deleted) / (total_elements_allocated)
+ *     num_elements / total_elements_allocated
+ *   Deleting a key frees its slot at once, so deleted keys do not
+ *   count.
  */
 double CD_load_factor(CDict dict);
 
+/*
+ * For debugging: Check the dictionary's internal invariants: that every
+ * key sits in a slot its hash can reach, that the control bytes match
+ * the keys, and that the count of keys is right. This rehashes every
+ * key, so it takes time in proportion to the keys and their probe
+ * lengths.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: true if the dictionary is consistent, false otherwise
+ */
+bool CD_check_invariants(CDict dict);
+
 /*
  * For debugging: Walk the dictionary and print all entries, including
- * the unused and deleted slots.
+ * the unused slots.
  *
  * Parameters:
  *   dict     The dictionary
@@ -142,7 +199,8 @@ typedef void (*CD_foreach_callback)(CDictKeyType key, CDictValueType value, void
  *   callback( <key>, <value>, <cb_data> )
  *
  * There is no guarantee as to the order in which the callback is
- * called.
+ * called. The key passed to callback is valid only until the call
+ * returns, and callback must not store into or delete from dict.
  *
  * Parameters:
  *   dict       The dictionary
@@ -153,4 +211,173 @@ typedef void (*CD_foreach_callback)(CDictKeyType key, CDictValueType value, void
  */
 void CD_foreach(CDict dict, CD_foreach_callback callback, void *cb_data);
 
+/*
+ * Return the hash that the dictionary uses for a key. The key is read
+ * 8 bytes at a time and mixed with 64-bit multiplies, so every bit of
+ * the result depends on every byte of the key; the dictionary takes
+ * the slot from the low bits and a 7-bit tag from the top bits.
+ *
+ * Parameters:
+ *   key      The key
+ *
+ * Returns: The 64-bit hash
+ */
+uint64_t CD_hash(const char *key);
+
+/*
+ * Returns a new, empty scope layered over a dictionary, for temporary
+ * assignments that overlay its variables without changing them. A
+ * scope is itself a CDict, so it can be passed to ET_evaluate and to
+ * any function here. Lookups, cells and versions fall through to the
+ * parent, and on up its chain, for keys the scope does not hold;
+ * stores, including CD_cell_store through a parent's cell, always go
+ * to the scope, where the new value shadows the parent's. CD_size,
+ * CD_foreach and CD_delete see only the scope's own keys, and CD_clock
+ * advances on a change to any layer.
+ *
+ * Parameters:
+ *   parent   The dictionary to overlay, which may itself be a scope,
+ *            and which must outlive the new scope
+ *
+ * Returns: The new scope
+ *
+ * It is the responsibility of the caller to call CD_pop_scope or
+ * CD_free on the scope.
+ */
+CDict CD_push_scope(CDict parent);
+
+/*
+ * Discard a scope and every value assigned in it, leaving its parent
+ * as it was. This takes a fixed number of frees, however many keys
+ * the scope holds.
+ *
+ * Parameters:
+ *   scope    The scope, from CD_push_scope
+ *
+ * Returns: The scope's parent
+ */
+CDict CD_pop_scope(CDict scope);
+
+/*
+ * A reference to the value of one key in one dictionary. A cell stays
+ * valid while its key remains in the dictionary, however much the
+ * dictionary grows; it is invalidated when the key is deleted or the
+ * dictionary is freed. Loads and stores through a valid cell skip the
+ * hashing and probing that CD_retrieve and CD_store perform.
+ */
+typedef struct
+{
+  unsigned long dict_serial;
+  unsigned int index;
+  unsigned int generation;
+} CDictCell;
+
+// A cell that is never valid
+#define INVALID_CELL ((CDictCell){0, 0, 0})
+
+/*
+ * Find the cell that holds the value for a key
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   cell     Return space for the cell
+ *
+ * Returns: True if key is in dict, in which case its cell is copied
+ *   into cell; false otherwise
+ */
+bool CD_find_cell(CDict dict, CDictKeyType key, CDictCell *cell);
+
+/*
+ * Find the cell that holds the value for a key, adding the key with an
+ * initial value if it is not present. This takes a single probe, where
+ * CD_store followed by CD_find_cell takes two. The cell can then be
+ * read and written with CD_cell_load and CD_cell_store, which skip the
+ * hashing and probing entirely, for as long as the key is not deleted.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *   initial  The value to give key if it is added; as with CD_store,
+ *            a NaN value is not stored
+ *
+ * Returns: The cell for key, whose value is left unchanged if key was
+ *   already present; or INVALID_CELL if key was absent and initial
+ *   is NaN. In a scope, a key found in a parent gives the parent's
+ *   cell, and a key found nowhere is added to the scope.
+ */
+CDictCell CD_find_or_add(CDict dict, CDictKeyType key, CDictValueType initial);
+
+/*
+ * Does a cell refer to a key that is still in the dictionary?
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   cell     The cell
+ *
+ * Returns: True if cell was found in dict and its key has not been
+ *   deleted since, false otherwise
+ */
+bool CD_cell_valid(CDict dict, CDictCell cell);
+
+/*
+ * Return the value held in a cell
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   cell     The cell
+ *
+ * Returns: The value, or INVALID_VALUE if cell is not valid for dict
+ */
+CDictValueType CD_cell_load(CDict dict, CDictCell cell);
+
+/*
+ * Overwrite the value held in a cell. As with CD_store, NaN values are
+ * not stored. Does nothing if cell is not valid for dict.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   cell     The cell
+ *   value    The value
+ *
+ * Returns: None
+ */
+void CD_cell_store(CDict dict, CDictCell cell, CDictValueType value);
+
+/*
+ * Return the dictionary's clock, which advances whenever a key is
+ * added or deleted or a value changes. Comparing two readings of the
+ * clock is a quick way to tell whether anything at all has changed.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *
+ * Returns: The clock
+ */
+unsigned long CD_clock(CDict dict);
+
+/*
+ * Return the version of a key's value: the reading of CD_clock just
+ * after the value last changed. Storing the value that a key already
+ * holds does not change its version.
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   key      The key
+ *
+ * Returns: The version, or 0 if key is not in dict
+ */
+unsigned long CD_version(CDict dict, CDictKeyType key);
+
+/*
+ * Return the version of the value held in a cell, as for CD_version
+ *
+ * Parameters:
+ *   dict     The dictionary
+ *   cell     The cell
+ *
+ * Returns: The version, or 0 if cell is not valid for dict
+ */
+unsigned long CD_cell_version(CDict dict, CDictCell cell);
+
 #endif /* _CDICT_H_ */
@@ -0,0 +1,338 @@
+/*
+ * eval_cache.c
+ *
+ * A bounded LRU cache of ET_evaluate results, keyed by tree structure
+ * and variable versions. See eval_cache.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "eval_cache.h"
+#include "expr_tree_internal.h"
+
+// Marks the end of a bucket chain or of the LRU list
+#define EC_NONE ((unsigned int)-1)
+
+// Large enough for any message that ET_evaluate writes
+#define EC_ERRMSG_SIZE 128
+
+// A variable read by a cached tree, and its version when the result was computed
+struct _ec_var
+{
+  char *name; // points into the entry's copy of the tree
+  CDictCell cell;
+  unsigned long version;
+};
+
+struct _ec_entry
+{
+  uint64_t hash;
+  ExprTree tree; // a private copy of the tree the result was computed for
+  CDict vars;
+  struct _ec_var *var;
+  int num_vars;
+  double value;
+  unsigned int prev; // neighbours in the LRU list, most recent first
+  unsigned int next;
+  unsigned int chain; // the next entry in the same hash bucket
+};
+
+struct _eval_cache
+{
+  struct _ec_entry *entry;
+  unsigned int capacity;
+  unsigned int size;
+  unsigned int *bucket;
+  unsigned int num_buckets; // a power of two
+  unsigned int head;        // most recently used entry
+  unsigned int tail;        // least recently used entry
+  EvalCacheStats stats;
+};
+
+/*
+ * Returns: A newly allocated copy of tree
+ */
+static ExprTree _EC_copy(ExprTree tree)
+{
+  if (tree == NULL)
+    return NULL;
+
+  if (tree->type == VALUE)
+    return ET_value(tree->n.value);
+
+  if (tree->type == SYMBOL)
+    return ET_symbol(tree->n.symbol);
+
+  return ET_node(tree->type, _EC_copy(tree->n.child[LEFT]), _EC_copy(tree->n.child[RIGHT]));
+}
+
+/*
+ * Record the current version of every distinct variable that an
+ * entry's tree reads
+ *
+ * Parameters:
+ *   e        The entry
+ *   tree     A subtree of the entry's tree
+ *
+ * Returns: None
+ */
+static void _EC_collect_vars(struct _ec_entry *e, ExprTree tree)
+{
+  if (tree == NULL || tree->type == VALUE)
+    return;
+
+  if (tree->type != SYMBOL)
+  {
+    _EC_collect_vars(e, tree->n.child[LEFT]);
+    _EC_collect_vars(e, tree->n.child[RIGHT]);
+    return;
+  }
+
+  for (int i = 0; i < e->num_vars; i++)
+    if (strcmp(e->var[i].name, tree->n.symbol) == 0)
+      return;
+
+  e->var = realloc(e->var, sizeof(struct _ec_var) * (e->num_vars + 1));
+  assert(e->var != NULL);
+
+  struct _ec_var *v = &e->var[e->num_vars++];
+
+  v->name = tree->n.symbol;
+  if (!CD_find_cell(e->vars, v->name, &v->cell))
+    v->cell = INVALID_CELL;
+  v->version = CD_cell_version(e->vars, v->cell);
+}
+
+/*
+ * Returns: true if no variable read by an entry's tree has changed
+ *   since its result was computed
+ */
+static bool _EC_current(const struct _ec_entry *e)
+{
+  for (int i = 0; i < e->num_vars; i++)
+    if (CD_cell_version(e->vars, e->var[i].cell) != e->var[i].version)
+      return false;
+
+  return true;
+}
+
+/*
+ * Remove an entry from the LRU list
+ *
+ * Parameters:
+ *   cache    The cache
+ *   i        The index of the entry
+ *
+ * Returns: None
+ */
+static void _EC_unlink(EvalCache cache, unsigned int i)
+{
+  struct _ec_entry *e = &cache->entry[i];
+
+  if (e->prev != EC_NONE)
+    cache->entry[e->prev].next = e->next;
+  else
+    cache->head = e->next;
+
+  if (e->next != EC_NONE)
+    cache->entry[e->next].prev = e->prev;
+  else
+    cache->tail = e->prev;
+}
+
+/*
+ * Put an entry at the front of the LRU list
+ *
+ * Parameters:
+ *   cache    The cache
+ *   i        The index of the entry, which must not be in the list
+ *
+ * Returns: None
+ */
+static void _EC_push_front(EvalCache cache, unsigned int i)
+{
+  struct _ec_entry *e = &cache->entry[i];
+
+  e->prev = EC_NONE;
+  e->next = cache->head;
+  if (cache->head != EC_NONE)
+    cache->entry[cache->head].prev = i;
+  cache->head = i;
+  if (cache->tail == EC_NONE)
+    cache->tail = i;
+}
+
+/*
+ * Release what an entry holds and take it out of its hash bucket. The
+ * entry must already be out of the LRU list.
+ *
+ * Parameters:
+ *   cache    The cache
+ *   i        The index of the entry
+ *
+ * Returns: None
+ */
+static void _EC_drop(EvalCache cache, unsigned int i)
+{
+  struct _ec_entry *e = &cache->entry[i];
+  unsigned int *link = &cache->bucket[e->hash & (cache->num_buckets - 1)];
+
+  while (*link != i)
+    link = &cache->entry[*link].chain;
+  *link = e->chain;
+
+  ET_free(e->tree);
+  free(e->var);
+  e->tree = NULL;
+  e->var = NULL;
+  e->num_vars = 0;
+}
+
+// Documented in .h file
+EvalCache EC_new(unsigned int capacity)
+{
+  assert(capacity >= 1);
+
+  EvalCache cache = malloc(sizeof(struct _eval_cache));
+  assert(cache != NULL);
+
+  cache->capacity = capacity;
+  cache->size = 0;
+  cache->entry = malloc(sizeof(struct _ec_entry) * capacity);
+  assert(cache->entry != NULL);
+
+  cache->num_buckets = 1;
+  while (cache->num_buckets < 2 * capacity)
+    cache->num_buckets *= 2;
+  cache->bucket = malloc(sizeof(unsigned int) * cache->num_buckets);
+  assert(cache->bucket != NULL);
+  for (unsigned int b = 0; b < cache->num_buckets; b++)
+    cache->bucket[b] = EC_NONE;
+
+  cache->head = EC_NONE;
+  cache->tail = EC_NONE;
+  cache->stats = (EvalCacheStats){0, 0, 0, 0};
+
+  return cache;
+}
+
+// Documented in .h file
+void EC_free(EvalCache cache)
+{
+  if (cache == NULL)
+    return;
+
+  EC_clear(cache);
+  free(cache->bucket);
+  free(cache->entry);
+  free(cache);
+}
+
+// Documented in .h file
+void EC_clear(EvalCache cache)
+{
+  for (unsigned int i = 0; i < cache->size; i++)
+  {
+    ET_free(cache->entry[i].tree);
+    free(cache->entry[i].var);
+  }
+
+  for (unsigned int b = 0; b < cache->num_buckets; b++)
+    cache->bucket[b] = EC_NONE;
+
+  cache->size = 0;
+  cache->head = EC_NONE;
+  cache->tail = EC_NONE;
+}
+
+// Documented in .h file
+double EC_evaluate(EvalCache cache, ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
+{
+  uint64_t hash = ET_hash(tree);
+
+  if (tree != NULL && tree->has_assign)
+  {
+    cache->stats.bypasses++;
+    return ET_evaluate(tree, vars, errmsg, errmsg_sz);
+  }
+
+  unsigned int *bucket = &cache->bucket[hash & (cache->num_buckets - 1)];
+  unsigned int i;
+
+  for (i = *bucket; i != EC_NONE; i = cache->entry[i].chain)
+    if (cache->entry[i].hash == hash && cache->entry[i].vars == vars && ET_equal(cache->entry[i].tree, tree))
+      break;
+
+  if (i != EC_NONE && _EC_current(&cache->entry[i]))
+  {
+    cache->stats.hits++;
+    _EC_unlink(cache, i);
+    _EC_push_front(cache, i);
+    return cache->entry[i].value;
+  }
+
+  cache->stats.misses++;
+
+  // ET_evaluate only writes the message on failure
+  char msg[EC_ERRMSG_SIZE] = "";
+  double value = ET_evaluate(tree, vars, msg, sizeof(msg));
+
+  if (msg[0] != '\0')
+  {
+    snprintf(errmsg, errmsg_sz, "%s", msg);
+    return value;
+  }
+
+  if (i != EC_NONE)
+  {
+    // a stale result for the same tree: refresh it in place
+    _EC_unlink(cache, i);
+    free(cache->entry[i].var);
+  }
+  else
+  {
+    if (cache->size < cache->capacity)
+      i = cache->size++;
+    else
+    {
+      i = cache->tail;
+      _EC_unlink(cache, i);
+      _EC_drop(cache, i);
+      cache->stats.evictions++;
+    }
+
+    cache->entry[i].hash = hash;
+    cache->entry[i].tree = _EC_copy(tree);
+    cache->entry[i].vars = vars;
+    cache->entry[i].chain = *bucket;
+    *bucket = i;
+  }
+
+  struct _ec_entry *e = &cache->entry[i];
+
+  e->var = NULL;
+  e->num_vars = 0;
+  _EC_collect_vars(e, e->tree);
+  e->value = value;
+  _EC_push_front(cache, i);
+
+  return value;
+}
+
+// Documented in .h file
+unsigned int EC_size(EvalCache cache)
+{
+  return cache->size;
+}
+
+// Documented in .h file
+EvalCacheStats EC_stats(EvalCache cache)
+{
+  return cache->stats;
+}
@@ -0,0 +1,98 @@
+/*
+ * eval_cache.h
+ *
+ * An optional result cache in front of ET_evaluate. Results are keyed
+ * by the structure of the tree together with the versions of the
+ * variables it reads, so a tree that is evaluated again, or any tree
+ * of the same structure, with none of its variables changed is
+ * answered without evaluating it. The cache holds a bounded number of
+ * results and evicts the least recently used.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EVAL_CACHE_H_
+#define _EVAL_CACHE_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "cdict.h"
+
+typedef struct _eval_cache *EvalCache;
+
+typedef struct
+{
+  unsigned long hits;      // answered from the cache
+  unsigned long misses;    // evaluated, because no current result was cached
+  unsigned long evictions; // results dropped to make room for others
+  unsigned long bypasses;  // evaluated without the cache, see EC_evaluate
+} EvalCacheStats;
+
+/*
+ * Create an empty cache
+ *
+ * Parameters:
+ *   capacity  The most results the cache holds at once; at least 1
+ *
+ * Returns: The new cache
+ *
+ * It is the responsibility of the caller to call EC_free on the cache.
+ */
+EvalCache EC_new(unsigned int capacity);
+
+/*
+ * Destroy a cache
+ *
+ * Parameters:
+ *   cache    The cache
+ *
+ * Returns: None
+ */
+void EC_free(EvalCache cache);
+
+/*
+ * Evaluate a tree as ET_evaluate does, returning a cached result if
+ * one is current.
+ *
+ * A result is current if it was computed for a tree of the same
+ * structure against the same dictionary, and no variable that the tree
+ * reads has been stored, deleted or assigned since. Trees that contain
+ * OP_ASSIGN are always evaluated, so that their assignments take
+ * place, and bypass the cache; the versions they change make any
+ * cached result that read the assigned variables stale. Evaluations
+ * that fail are not cached.
+ *
+ * Parameters:
+ *   cache      The cache
+ *   tree       The tree to compute
+ *   vars       The variables, as for ET_evaluate
+ *   errmsg     Return space for an error message, as for ET_evaluate
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The computed value, exactly as ET_evaluate would return it
+ */
+double EC_evaluate(EvalCache cache, ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Drop every cached result. The counters are not reset.
+ *
+ * Parameters:
+ *   cache    The cache
+ *
+ * Returns: None
+ */
+void EC_clear(EvalCache cache);
+
+/*
+ * Returns: The number of results currently held in cache
+ */
+unsigned int EC_size(EvalCache cache);
+
+/*
+ * Returns: The hit, miss, eviction and bypass counts of cache since it
+ *   was created
+ */
+EvalCacheStats EC_stats(EvalCache cache);
+
+#endif /* _EVAL_CACHE_H_ */
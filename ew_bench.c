@@ -0,0 +1,1725 @@
+/*
+ * ew_bench.c
+ *
+ * Benchmarks for ExpressionWhizz++. Run with no arguments to run every
+ * benchmark, or name the benchmarks to run on the command line, for
+ * instance:
+ *
+ *   ./ew_bench tree2string
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "expr_tree.h"
+#include "expr_tree_internal.h"
+#include "clist.h"
+#include "tokenize.h"
+#include "parse.h"
+#include "cdict.h"
+#include "expr_batch.h"
+#include "thread_pool.h"
+#include "expr_codegen.h"
+#include "reactive.h"
+#include "eval_cache.h"
+#include "expr_diff.h"
+#include "ccdict.h"
+#include "penv.h"
+
+/*
+ * Returns: A monotonic timestamp, in seconds
+ */
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * The ET_tree2string writer as it stood before the single-pass
+ * rewrite, kept here so the two can be compared. Each level formats
+ * its children into buf_sz-byte stack buffers and then copies them
+ * into its own output.
+ */
+static size_t legacy_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+{
+  static const char op_char[] = {[OP_ADD] = '+', [OP_SUB] = '-', [OP_MUL] = '*',
+                                 [OP_DIV] = '/', [OP_POWER] = '^', [OP_ASSIGN] = '='};
+
+  if (tree == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  size_t length = 0;
+  char leftBuffer[buf_sz];
+  char rightBuffer[buf_sz];
+
+  if (tree->type == VALUE)
+    length = snprintf(buf, buf_sz, "%g", tree->n.value);
+  else if (tree->type == SYMBOL)
+    length = snprintf(buf, buf_sz, "%s", tree->n.symbol);
+  else
+  {
+    legacy_tree2string(tree->n.child[LEFT], leftBuffer, buf_sz);
+
+    if (tree->type == UNARY_NEGATE)
+      length = snprintf(buf, buf_sz, "(-%s)", leftBuffer);
+    else
+    {
+      legacy_tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
+
+      if (tree->n.child[LEFT]->type != VALUE && tree->n.child[LEFT]->type != SYMBOL)
+      {
+        char tempBuffer[buf_sz];
+        snprintf(tempBuffer, buf_sz, "%s", leftBuffer);
+        strcpy(leftBuffer, tempBuffer);
+      }
+
+      if (tree->n.child[RIGHT]->type != VALUE && tree->n.child[RIGHT]->type != SYMBOL)
+      {
+        char tempBuffer[buf_sz];
+        snprintf(tempBuffer, buf_sz, "%s", rightBuffer);
+        strcpy(rightBuffer, tempBuffer);
+      }
+
+      length = snprintf(buf, buf_sz, "(%s %c %s)", leftBuffer, op_char[tree->type], rightBuffer);
+    }
+  }
+
+  if (length >= buf_sz)
+  {
+    buf[buf_sz - 2] = '$';
+    buf[buf_sz - 1] = '\0';
+    return buf_sz - 1;
+  }
+
+  buf[length] = '\0';
+  return length;
+}
+
+/*
+ * Build a balanced tree of the given depth, cycling through the
+ * binary operators and mixing values and symbols at the leaves.
+ */
+static ExprTree build_balanced(int depth, int *counter)
+{
+  static const ExprNodeType ops[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POWER};
+  char name[16];
+
+  if (depth <= 1)
+  {
+    (*counter)++;
+    if (*counter % 3 == 0)
+    {
+      snprintf(name, sizeof(name), "v%d", *counter);
+      return ET_symbol(name);
+    }
+    return ET_value(*counter * 0.25);
+  }
+
+  ExprTree left = build_balanced(depth - 1, counter);
+  ExprTree right = build_balanced(depth - 1, counter);
+  return ET_node(ops[depth % 5], left, right);
+}
+
+/*
+ * Build a left-deep chain of n additions
+ */
+static ExprTree build_chain(int n)
+{
+  ExprTree tree = ET_symbol("x");
+
+  for (int i = 0; i < n; i++)
+    tree = ET_node(OP_ADD, tree, ET_value(i));
+
+  return tree;
+}
+
+/*
+ * Time one writer on one tree and buffer size
+ *
+ * Returns: Nanoseconds per call
+ */
+static double time_writer(size_t (*writer)(ExprTree, char *, size_t), ExprTree tree,
+                          char *buf, size_t buf_sz, int iters)
+{
+  double start = now_sec();
+
+  for (int i = 0; i < iters; i++)
+    writer(tree, buf, buf_sz);
+
+  return (now_sec() - start) * 1e9 / iters;
+}
+
+/*
+ * Compares the legacy recursive ET_tree2string with the single-pass
+ * writer, checking along the way that they produce identical output.
+ */
+static void bench_tree2string()
+{
+  static const size_t sizes[] = {64, 1024, 16384};
+  struct
+  {
+    const char *name;
+    ExprTree tree;
+  } cases[3];
+  int counter = 0;
+
+  cases[0].name = "balanced d=6";
+  cases[0].tree = build_balanced(6, &counter);
+  cases[1].name = "balanced d=12";
+  cases[1].tree = build_balanced(12, &counter);
+  cases[2].name = "chain n=200";
+  cases[2].tree = build_chain(200);
+
+  char *old_buf = malloc(sizes[2]);
+  char *new_buf = malloc(sizes[2]);
+  assert(old_buf != NULL && new_buf != NULL);
+
+  printf("%-16s %8s %14s %14s %8s\n", "tree", "buf_sz", "legacy ns", "single ns", "speedup");
+
+  for (int c = 0; c < 3; c++)
+  {
+    for (int s = 0; s < 3; s++)
+    {
+      size_t old_len = legacy_tree2string(cases[c].tree, old_buf, sizes[s]);
+      size_t new_len = ET_tree2string(cases[c].tree, new_buf, sizes[s]);
+      assert(old_len == new_len && strcmp(old_buf, new_buf) == 0);
+
+      int iters = 200;
+      double old_ns = time_writer(legacy_tree2string, cases[c].tree, old_buf, sizes[s], iters);
+      double new_ns = time_writer(ET_tree2string, cases[c].tree, new_buf, sizes[s], iters);
+
+      printf("%-16s %8zu %14.0f %14.0f %7.1fx\n", cases[c].name, sizes[s], old_ns, new_ns, old_ns / new_ns);
+    }
+  }
+
+  free(old_buf);
+  free(new_buf);
+  for (int c = 0; c < 3; c++)
+    ET_free(cases[c].tree);
+}
+
+/*
+ * Build the polynomial-style expression used by the evaluation
+ * benchmarks: ((x * y) + (x / (y + 1))) - ((x - 2.5) * (y * 0.5))
+ */
+static ExprTree build_formula()
+{
+  return ET_node(OP_SUB,
+                 ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("y")),
+                         ET_node(OP_DIV, ET_symbol("x"), ET_node(OP_ADD, ET_symbol("y"), ET_value(1)))),
+                 ET_node(OP_MUL, ET_node(OP_SUB, ET_symbol("x"), ET_value(2.5)),
+                         ET_node(OP_MUL, ET_symbol("y"), ET_value(0.5))));
+}
+
+/*
+ * Compares evaluating one expression over a million rows with
+ * ET_evaluate, one row at a time, against EB_run with each
+ * instruction set this CPU supports.
+ */
+static void bench_batch()
+{
+  const size_t num_rows = 1000000;
+  const char *symbols[] = {"x", "y"};
+  const char *isas[] = {"scalar", "avx2", "avx512f"};
+  double *x = malloc(sizeof(double) * num_rows);
+  double *y = malloc(sizeof(double) * num_rows);
+  double *out = malloc(sizeof(double) * num_rows);
+  unsigned char *errmask = malloc((num_rows + 7) / 8);
+  const double *columns[] = {x, y};
+  char errmsg[128];
+  CDict vars = CD_new();
+  ExprTree tree = build_formula();
+
+  assert(x != NULL && y != NULL && out != NULL && errmask != NULL);
+
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    x[r] = (r % 1000) * 0.01;
+    y[r] = (r % 777) * 0.02;
+  }
+
+  double start = now_sec();
+  double checksum = 0;
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    CD_store(vars, "x", x[r]);
+    CD_store(vars, "y", y[r]);
+    checksum += ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  }
+  double tree_sec = now_sec() - start;
+
+  printf("%-14s %10s %10s %10s\n", "evaluator", "ns/row", "speedup", "checksum");
+  printf("%-14s %10.2f %10s %10.4g\n", "ET_evaluate", tree_sec * 1e9 / num_rows, "1.0x", checksum);
+
+  ExprBatch batch = EB_compile(tree, NULL, symbols, 2, errmsg, sizeof(errmsg));
+  assert(batch != NULL);
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (!EB_use_isa(batch, isas[i]))
+      continue;
+
+    int reps = 10;
+    start = now_sec();
+    for (int rep = 0; rep < reps; rep++)
+      EB_run(batch, columns, num_rows, out, errmask);
+    double sec = (now_sec() - start) / reps;
+
+    checksum = 0;
+    for (size_t r = 0; r < num_rows; r++)
+      checksum += out[r];
+
+    char label[32];
+    snprintf(label, sizeof(label), "EB_run %s", isas[i]);
+    printf("%-14s %10.2f %9.1fx %10.4g\n", label, sec * 1e9 / num_rows, tree_sec / sec, checksum);
+  }
+
+  EB_free(batch);
+  ET_free(tree);
+  CD_free(vars);
+  free(x);
+  free(y);
+  free(out);
+  free(errmask);
+}
+
+/*
+ * Compares evaluating one expression a row at a time with ET_evaluate
+ * against the same expression compiled by ET_compile, and reports the
+ * cost of compiling it and of loading it back from the cache.
+ */
+static void bench_codegen()
+{
+  const size_t num_rows = 1000000;
+  char dir[] = "/tmp/ew_bench_XXXXXX";
+  char errmsg[256];
+  char path[FILENAME_MAX + 32];
+  CDict vars = CD_new();
+  ExprTree tree = build_formula();
+
+  if (mkdtemp(dir) == NULL)
+  {
+    perror(dir);
+    exit(1);
+  }
+
+  double start = now_sec();
+  CompiledExpr ce = ET_compile(tree, dir, errmsg, sizeof(errmsg));
+  double compile_sec = now_sec() - start;
+  if (ce == NULL)
+  {
+    printf("%s\n", errmsg);
+    exit(1);
+  }
+
+  start = now_sec();
+  CompiledExpr cached = ET_compile(tree, dir, errmsg, sizeof(errmsg));
+  double load_sec = now_sec() - start;
+  assert(cached != NULL);
+  CE_free(cached);
+
+  printf("compile %.1f ms, load from cache %.3f ms\n", compile_sec * 1e3, load_sec * 1e3);
+
+  start = now_sec();
+  double checksum = 0;
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    CD_store(vars, "x", (r % 1000) * 0.01);
+    CD_store(vars, "y", (r % 777) * 0.02);
+    checksum += ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  }
+  double tree_sec = now_sec() - start;
+
+  printf("%-14s %10s %10s %10s\n", "evaluator", "ns/row", "speedup", "checksum");
+  printf("%-14s %10.2f %10s %10.4g\n", "ET_evaluate", tree_sec * 1e9 / num_rows, "1.0x", checksum);
+
+  assert(CE_num_vars(ce) == 2 && strcmp(CE_var_name(ce, 0), "x") == 0);
+  start = now_sec();
+  checksum = 0;
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    double v[2] = {(r % 1000) * 0.01, (r % 777) * 0.02};
+    checksum += CE_evaluate(ce, v);
+  }
+  double sec = now_sec() - start;
+  printf("%-14s %10.2f %9.1fx %10.4g\n", "CE_evaluate", sec * 1e9 / num_rows, tree_sec / sec, checksum);
+
+  snprintf(path, sizeof(path), "%s/ew_%016llx.c", dir, (unsigned long long)CE_hash(ce));
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/ew_%016llx.so", dir, (unsigned long long)CE_hash(ce));
+  unlink(path);
+  rmdir(dir);
+
+  CE_free(ce);
+  ET_free(tree);
+  CD_free(vars);
+}
+
+/*
+ * Compares x^n with a constant exponent, which is evaluated by
+ * repeated squaring, against x^k with k a variable holding the same
+ * value, which goes through pow()
+ */
+static void bench_pow()
+{
+  const size_t num_rows = 1000000;
+  const int exponents[] = {2, 3, -1, 7, 16};
+  char errmsg[128];
+  CDict vars = CD_new();
+
+  printf("%-6s %14s %14s %10s\n", "n", "pow() ns/row", "const ns/row", "speedup");
+
+  for (int e = 0; e < sizeof(exponents) / sizeof(exponents[0]); e++)
+  {
+    int n = exponents[e];
+    ExprTree general = ET_node(OP_POWER, ET_symbol("x"), ET_symbol("k"));
+    ExprTree constant = ET_node(OP_POWER, ET_symbol("x"),
+                                (n < 0) ? ET_node(UNARY_NEGATE, ET_value(-n), NULL) : ET_value(n));
+    double sec[2];
+    double checksum[2] = {0, 0};
+
+    CD_store(vars, "k", n);
+    for (int t = 0; t < 2; t++)
+    {
+      ExprTree tree = (t == 0) ? general : constant;
+      double start = now_sec();
+
+      for (size_t r = 0; r < num_rows; r++)
+      {
+        CD_store(vars, "x", 1 + (r % 1000) * 0.001);
+        checksum[t] += ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+      }
+      sec[t] = now_sec() - start;
+    }
+
+    printf("%-6d %14.2f %14.2f %9.2fx\n", n, sec[0] * 1e9 / num_rows, sec[1] * 1e9 / num_rows,
+           sec[0] / sec[1]);
+    assert(fabs(checksum[0] - checksum[1]) <= 1e-9 * fabs(checksum[0]));
+
+    ET_free(general);
+    ET_free(constant);
+  }
+
+  CD_free(vars);
+}
+
+/*
+ * Registers several hundred formulas over a few hundred variables and
+ * compares bringing them up to date after one variable changes, with
+ * RX_update, against re-evaluating every formula
+ */
+static void bench_reactive()
+{
+  const int num_vars = 300;
+  const int num_formulas = 600;
+  const int reps = 2000;
+  CDict vars = CD_new();
+  Reactive rx = RX_new(vars);
+  ExprTree *trees = malloc(sizeof(ExprTree) * num_formulas);
+  char name[32], a[32], b[32], errmsg[128];
+
+  assert(trees != NULL);
+  for (int v = 0; v < num_vars; v++)
+  {
+    snprintf(name, sizeof(name), "v%d", v);
+    CD_store(vars, name, v);
+  }
+
+  // f<i> = f<i/2> + v<i%num_vars> * v<(i*7)%num_vars>, with f<0> reading only variables
+  for (int i = 0; i < num_formulas; i++)
+  {
+    snprintf(name, sizeof(name), "f%d", i);
+    snprintf(a, sizeof(a), "v%d", i % num_vars);
+    snprintf(b, sizeof(b), "v%d", (i * 7) % num_vars);
+    ExprTree product = ET_node(OP_MUL, ET_symbol(a), ET_symbol(b));
+    if (i > 0)
+    {
+      char parent[32];
+      snprintf(parent, sizeof(parent), "f%d", i / 2);
+      product = ET_node(OP_ADD, ET_symbol(parent), product);
+    }
+    trees[i] = ET_node(OP_ASSIGN, ET_symbol(name), product);
+    int id = RX_register(rx, trees[i], errmsg, sizeof(errmsg));
+    assert(id == i);
+  }
+  RX_update(rx);
+
+  long evaluated = 0;
+  double start = now_sec();
+  for (int rep = 0; rep < reps; rep++)
+  {
+    snprintf(name, sizeof(name), "v%d", rep % num_vars);
+    CD_store(vars, name, rep);
+    evaluated += RX_update(rx);
+  }
+  double rx_sec = now_sec() - start;
+
+  start = now_sec();
+  for (int rep = 0; rep < reps; rep++)
+  {
+    snprintf(name, sizeof(name), "v%d", rep % num_vars);
+    CD_store(vars, name, rep + 1);
+    for (int i = 0; i < num_formulas; i++)
+      ET_evaluate(trees[i], vars, errmsg, sizeof(errmsg));
+  }
+  double all_sec = now_sec() - start;
+
+  printf("%d formulas, %d variables, one variable changed per update\n", num_formulas, num_vars);
+  printf("%-14s %12s %14s %10s\n", "method", "us/update", "formulas/upd", "speedup");
+  printf("%-14s %12.2f %14d %10s\n", "evaluate all", all_sec * 1e6 / reps, num_formulas, "1.0x");
+  printf("%-14s %12.2f %14.1f %9.1fx\n", "RX_update", rx_sec * 1e6 / reps, (double)evaluated / reps,
+         all_sec / rx_sec);
+
+  RX_free(rx);
+  CD_free(vars);
+  free(trees);
+}
+
+/*
+ * Compares ET_evaluate against EC_evaluate on a stream of requests
+ * that mostly repeat a small set of formulas with unchanged variables
+ */
+static void bench_cache()
+{
+  const int num_trees = 64;
+  const int num_requests = 1000000;
+  ExprTree trees[num_trees];
+  char errmsg[128];
+  CDict vars = CD_new();
+  EvalCache cache = EC_new(num_trees);
+
+  CD_store(vars, "x", 1.5);
+  CD_store(vars, "y", 2.5);
+  // each tree sums four non-integral powers of the formula, so is
+  // costly enough to evaluate that caching it pays
+  for (int t = 0; t < num_trees; t++)
+  {
+    trees[t] = ET_value(t);
+    for (int k = 1; k <= 4; k++)
+      trees[t] = ET_node(OP_ADD, trees[t], ET_node(OP_POWER, build_formula(), ET_value(k * 0.37)));
+  }
+
+  for (int method = 0; method < 2; method++)
+  {
+    double checksum = 0;
+    double start = now_sec();
+
+    for (int r = 0; r < num_requests; r++)
+    {
+      ExprTree tree = trees[(r * 7) % num_trees];
+
+      // one request in a thousand changes a variable
+      if (r % 1000 == 0)
+        CD_store(vars, "x", r);
+      checksum += (method == 0) ? ET_evaluate(tree, vars, errmsg, sizeof(errmsg))
+                                : EC_evaluate(cache, tree, vars, errmsg, sizeof(errmsg));
+    }
+
+    printf("%-12s %8.2f ns/request  checksum %.6g\n", (method == 0) ? "ET_evaluate" : "EC_evaluate",
+           (now_sec() - start) * 1e9 / num_requests, checksum);
+  }
+
+  EvalCacheStats stats = EC_stats(cache);
+  printf("hits %lu misses %lu evictions %lu bypasses %lu\n", stats.hits, stats.misses, stats.evictions,
+         stats.bypasses);
+
+  for (int t = 0; t < num_trees; t++)
+    ET_free(trees[t]);
+  EC_free(cache);
+  CD_free(vars);
+}
+
+/*
+ * Compares restoring a set of formulas at startup by tokenizing and
+ * parsing their text against loading them with ET_load from a file
+ * written by ET_save.
+ */
+static void bench_image()
+{
+  const int num_formulas = 10000;
+  const int repeats = 10;
+  ExprTree *trees = malloc(sizeof(ExprTree) * num_formulas);
+  char **text = malloc(sizeof(char *) * num_formulas);
+  char path[64], errmsg[128], buf[512];
+  int num_nodes = 0;
+
+  assert(trees != NULL && text != NULL);
+  for (int f = 0; f < num_formulas; f++)
+  {
+    char name[16];
+
+    snprintf(name, sizeof(name), "cell%d", f % 500);
+    trees[f] = ET_node(OP_ADD, build_formula(), ET_node(OP_MUL, ET_symbol(name), ET_value(f)));
+    ET_tree2string(trees[f], buf, sizeof(buf));
+    text[f] = strdup(buf);
+    assert(text[f] != NULL);
+    num_nodes += ET_count(trees[f]);
+  }
+
+  snprintf(path, sizeof(path), "/tmp/ew_bench_%d.ewx", (int)getpid());
+  if (!ET_save(trees, num_formulas, path, errmsg, sizeof(errmsg)))
+  {
+    printf("ET_save failed: %s\n", errmsg);
+    goto image_done;
+  }
+
+  double start = now_sec();
+  for (int r = 0; r < repeats; r++)
+    for (int f = 0; f < num_formulas; f++)
+    {
+      CList tokens = TOK_tokenize_input(text[f], errmsg, sizeof(errmsg));
+      ExprTree tree = Parse(tokens, errmsg, sizeof(errmsg));
+
+      assert(tree != NULL);
+      ET_free(tree);
+      CL_free(tokens);
+    }
+  double parse_time = (now_sec() - start) / repeats;
+
+  start = now_sec();
+  for (int r = 0; r < repeats; r++)
+  {
+    ExprImage image = ET_load(path, errmsg, sizeof(errmsg));
+
+    assert(image != NULL && ET_image_count(image) == num_formulas);
+    ET_image_free(image);
+  }
+  double load_time = (now_sec() - start) / repeats;
+
+  printf("%d formulas, %d nodes\n", num_formulas, num_nodes);
+  printf("%-18s %8.3f ms\n", "tokenize + parse", parse_time * 1e3);
+  printf("%-18s %8.3f ms  (%.1fx)\n", "ET_load", load_time * 1e3, parse_time / load_time);
+
+image_done:
+  remove(path);
+  for (int f = 0; f < num_formulas; f++)
+  {
+    ET_free(trees[f]);
+    free(text[f]);
+  }
+  free(trees);
+  free(text);
+}
+
+/*
+ * Compares computing a gradient with respect to eight variables by
+ * central finite differences, at 2N + 1 calls to ET_evaluate, against
+ * one call to ET_derivatives.
+ */
+static void bench_derivatives()
+{
+  const char *wrt[] = {"a", "b", "c", "d", "e", "f", "g", "h"};
+  const int num_wrt = 8;
+  const int repeats = 100000;
+  const double step = 1e-6;
+  char errmsg[128];
+  CDict vars = CD_new();
+  CList tokens = TOK_tokenize_input("a*b + b/c + c^2.5 + d*e - e/f + f^3 + g*h + h^0.5 + (a+b+c+d)^1.7 - g/(h+a)",
+                                    errmsg, sizeof(errmsg));
+  ExprTree tree = Parse(tokens, errmsg, sizeof(errmsg));
+  double fd[8], ad[8], value, checksum = 0;
+
+  assert(tree != NULL);
+  for (int k = 0; k < num_wrt; k++)
+    CD_store(vars, (char *)wrt[k], 1.25 + 0.5 * k);
+
+  double start = now_sec();
+  for (int r = 0; r < repeats; r++)
+  {
+    value = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    for (int k = 0; k < num_wrt; k++)
+    {
+      double x = CD_retrieve(vars, (char *)wrt[k]);
+
+      CD_store(vars, (char *)wrt[k], x + step);
+      double up = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+      CD_store(vars, (char *)wrt[k], x - step);
+      double down = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+      CD_store(vars, (char *)wrt[k], x);
+      fd[k] = (up - down) / (2 * step);
+    }
+    checksum += value + fd[0];
+  }
+  double fd_time = (now_sec() - start) / repeats;
+
+  start = now_sec();
+  for (int r = 0; r < repeats; r++)
+  {
+    ET_derivatives(tree, vars, wrt, num_wrt, &value, ad, NULL);
+    checksum += value + ad[0];
+  }
+  double ad_time = (now_sec() - start) / repeats;
+
+  double max_diff = 0;
+  for (int k = 0; k < num_wrt; k++)
+    max_diff = fmax(max_diff, fabs(fd[k] - ad[k]));
+
+  printf("%-20s %8.1f ns/gradient\n", "finite differences", fd_time * 1e9);
+  printf("%-20s %8.1f ns/gradient  (%.1fx)\n", "ET_derivatives", ad_time * 1e9, fd_time / ad_time);
+  printf("largest difference %.3g  checksum %.6g\n", max_diff, checksum);
+
+  ET_free(tree);
+  CL_free(tokens);
+  CD_free(vars);
+}
+
+/*
+ * Compares the gradient of a sum of products of 200 variables by
+ * forward mode, ET_derivatives, against reverse mode, AD_gradient,
+ * with a tape that is reused from one call to the next.
+ */
+static void bench_gradient()
+{
+  const int n = 200;
+  const int repeats = 200;
+  char names[200][8], errmsg[128];
+  const char *wrt[200];
+  char *text = malloc(16 * n);
+  double fwd[200], rev[200], value, checksum = 0;
+  CDict vars = CD_new();
+  ADTape tape = AD_tape_new();
+
+  assert(text != NULL);
+  text[0] = '\0';
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "x%d", i);
+    wrt[i] = names[i];
+    CD_store(vars, names[i], 1 + i * 0.01);
+    sprintf(text + strlen(text), "%sx%d*x%d", (i > 0) ? "+" : "", i, (i * 7 + 3) % n);
+  }
+
+  CList tokens = TOK_tokenize_input(text, errmsg, sizeof(errmsg));
+  ExprTree tree = Parse(tokens, errmsg, sizeof(errmsg));
+
+  assert(tree != NULL);
+
+  double start = now_sec();
+  for (int r = 0; r < repeats; r++)
+  {
+    ET_derivatives(tree, vars, wrt, n, &value, fwd, NULL);
+    checksum += fwd[r % n];
+  }
+  double fwd_time = (now_sec() - start) / repeats;
+
+  start = now_sec();
+  for (int r = 0; r < repeats; r++)
+  {
+    AD_gradient(tape, tree, vars, wrt, n, &value, rev, NULL);
+    checksum += rev[r % n];
+  }
+  double rev_time = (now_sec() - start) / repeats;
+
+  double max_diff = 0;
+  for (int i = 0; i < n; i++)
+    max_diff = fmax(max_diff, fabs(fwd[i] - rev[i]));
+
+  printf("%d variables, %d nodes, tape of %d operations\n", n, ET_count(tree), AD_tape_size(tape));
+  printf("%-16s %10.1f us/gradient\n", "ET_derivatives", fwd_time * 1e6);
+  printf("%-16s %10.1f us/gradient  (%.1fx)\n", "AD_gradient", rev_time * 1e6, fwd_time / rev_time);
+  printf("largest difference %.3g  checksum %.6g\n", max_diff, checksum);
+
+  ET_free(tree);
+  CL_free(tokens);
+  AD_tape_free(tape);
+  CD_free(vars);
+  free(text);
+}
+
+/*
+ * The body of bench_rebalance, which runs on a thread with a large
+ * stack, since evaluating a left-deep chain of a million operands
+ * recurses a million deep
+ */
+static void *rebalance_body(void *arg)
+{
+  const int n = 1000000;
+  const int repeats = 20;
+  char errmsg[128];
+  CDict vars = CD_new();
+  long double exact = 0;
+
+  (void)arg;
+
+  // sum 1/k over a pseudo-random order of k, with one term in a
+  // thousand read from a variable
+  CD_store(vars, "x", 0.5);
+  ExprTree tree = ET_value(1);
+  exact = 1;
+  for (int i = 1; i < n; i++)
+  {
+    int k = 1 + (int)(((uint64_t)i * 2654435761u) % n);
+
+    if (i % 1000 == 0)
+    {
+      tree = ET_node(OP_ADD, tree, ET_symbol("x"));
+      exact += 0.5L;
+    }
+    else
+    {
+      tree = ET_node(OP_ADD, tree, ET_value(1.0 / k));
+      exact += (long double)(1.0 / k);
+    }
+  }
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    double value = 0;
+    double start = now_sec();
+
+    for (int r = 0; r < repeats; r++)
+      value = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+
+    printf("%-10s depth %8d  %8.3f ms/evaluation  error %.3g\n", (pass == 0) ? "left-deep" : "balanced",
+           ET_depth(tree), (now_sec() - start) * 1e3 / repeats, (double)fabsl(value - exact));
+
+    if (pass == 0)
+    {
+      start = now_sec();
+      tree = ET_rebalance(tree);
+      printf("ET_rebalance %.3f ms\n", (now_sec() - start) * 1e3);
+    }
+  }
+
+  ET_free(tree);
+  CD_free(vars);
+  return NULL;
+}
+
+/*
+ * Compares evaluating a sum of a million terms as the parser would
+ * build it, left-deep, against the same sum after ET_rebalance
+ */
+static void bench_rebalance()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, (size_t)1 << 30);
+  if (pthread_create(&thread, &attr, rebalance_body, NULL) != 0)
+    printf("Cannot create a thread with a large stack\n");
+  else
+    pthread_join(thread, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * Time EB_run_parallel over num_rows rows on a pool of num_threads
+ *
+ * Returns: Seconds per run
+ */
+static double time_parallel(ExprBatch batch, int num_threads, const double *const columns[],
+                            size_t num_rows, double *out, unsigned char *errmask)
+{
+  ThreadPool pool = TP_new(num_threads);
+  int reps = 3;
+
+  EB_run_parallel(batch, pool, columns, num_rows, 0, out, errmask);
+
+  double start = now_sec();
+  for (int rep = 0; rep < reps; rep++)
+    EB_run_parallel(batch, pool, columns, num_rows, 0, out, errmask);
+  double sec = (now_sec() - start) / reps;
+
+  TP_free(pool);
+  return sec;
+}
+
+/*
+ * Strong and weak scaling of EB_run_parallel from one thread up to one
+ * per online CPU. Strong scaling keeps the row count fixed; weak
+ * scaling keeps the rows per thread fixed.
+ */
+static void bench_parallel()
+{
+  const size_t strong_rows = 1 << 24;
+  const size_t weak_rows_per_thread = 1 << 22;
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_rows = (strong_rows > weak_rows_per_thread * max_threads) ? strong_rows : weak_rows_per_thread * max_threads;
+  const char *symbols[] = {"x", "y"};
+  double *x = malloc(sizeof(double) * max_rows);
+  double *y = malloc(sizeof(double) * max_rows);
+  double *out = malloc(sizeof(double) * max_rows);
+  unsigned char *errmask = malloc((max_rows + 7) / 8);
+  const double *columns[] = {x, y};
+  char errmsg[128];
+  ExprTree tree = build_formula();
+  ExprBatch batch = EB_compile(tree, NULL, symbols, 2, errmsg, sizeof(errmsg));
+
+  assert(x != NULL && y != NULL && out != NULL && errmask != NULL && batch != NULL);
+
+  for (size_t r = 0; r < max_rows; r++)
+  {
+    x[r] = (r % 1000) * 0.01;
+    y[r] = (r % 777) * 0.02;
+  }
+
+  printf("%d online CPUs, %s kernels\n", max_threads, EB_isa(batch));
+  printf("%-8s %8s %12s %10s %10s\n", "scaling", "threads", "rows", "ms", "efficiency");
+
+  double base = 0;
+  for (int t = 1; t <= max_threads; t = (t * 2 > max_threads && t < max_threads) ? max_threads : t * 2)
+  {
+    double sec = time_parallel(batch, t, columns, strong_rows, out, errmask);
+    if (t == 1)
+      base = sec;
+    printf("%-8s %8d %12zu %10.2f %9.0f%%\n", "strong", t, strong_rows, sec * 1e3, 100 * base / (sec * t));
+  }
+
+  for (int t = 1; t <= max_threads; t = (t * 2 > max_threads && t < max_threads) ? max_threads : t * 2)
+  {
+    double sec = time_parallel(batch, t, columns, weak_rows_per_thread * t, out, errmask);
+    if (t == 1)
+      base = sec;
+    printf("%-8s %8d %12zu %10.2f %9.0f%%\n", "weak", t, weak_rows_per_thread * t, sec * 1e3, 100 * base / sec);
+  }
+
+  EB_free(batch);
+  ET_free(tree);
+  free(x);
+  free(y);
+  free(out);
+  free(errmask);
+}
+
+/*
+ * The CDict probing engine as it stood before control bytes, kept here
+ * so the two can be compared: each probe reads a whole slot and calls
+ * strcmp, and the table grows once it is more than threshold full.
+ */
+struct legacy_slot
+{
+  int status; // 0 unused, 1 in use, 2 deleted
+  char *key;
+  double value;
+};
+
+struct legacy_dict
+{
+  struct legacy_slot *slot;
+  unsigned int capacity;
+  unsigned int num_used; // in use or deleted
+  double threshold;
+};
+
+static unsigned int legacy_hash(const char *str, unsigned int capacity)
+{
+  unsigned int len = strlen(str);
+
+  if (len == 0)
+    return 0;
+
+  unsigned int x = (unsigned int)*str << 7;
+  for (unsigned int i = 0; i < len; i++)
+    x = (1000003 * x) ^ (unsigned int)str[i];
+  x ^= len;
+
+  return x % capacity;
+}
+
+static void legacy_init(struct legacy_dict *d, double threshold)
+{
+  d->capacity = 8;
+  d->num_used = 0;
+  d->threshold = threshold;
+  d->slot = calloc(d->capacity, sizeof(struct legacy_slot));
+  assert(d->slot != NULL);
+}
+
+static void legacy_free(struct legacy_dict *d)
+{
+  for (unsigned int i = 0; i < d->capacity; i++)
+    if (d->slot[i].status == 1)
+      free(d->slot[i].key);
+  free(d->slot);
+}
+
+static struct legacy_slot *legacy_find(struct legacy_dict *d, const char *key)
+{
+  unsigned int h = legacy_hash(key, d->capacity);
+
+  for (unsigned int i = 0; i < d->capacity; i++)
+  {
+    struct legacy_slot *s = &d->slot[(h + i) % d->capacity];
+
+    if (s->status == 0)
+      return NULL;
+    if (s->status == 1 && strcmp(s->key, key) == 0)
+      return s;
+  }
+
+  return NULL;
+}
+
+static void legacy_store(struct legacy_dict *d, const char *key, double value)
+{
+  unsigned int h = legacy_hash(key, d->capacity);
+
+  while ((d->slot[h].status == 1 && strcmp(d->slot[h].key, key) != 0) || d->slot[h].status == 2)
+    h = (h + 1) % d->capacity;
+
+  if (d->slot[h].status == 1)
+  {
+    d->slot[h].value = value;
+    return;
+  }
+
+  d->slot[h] = (struct legacy_slot){1, strdup(key), value};
+  if (++d->num_used <= d->threshold * d->capacity)
+    return;
+
+  struct legacy_slot *old = d->slot;
+  unsigned int old_capacity = d->capacity;
+
+  d->capacity *= 2;
+  d->num_used = 0;
+  d->slot = calloc(d->capacity, sizeof(struct legacy_slot));
+  assert(d->slot != NULL);
+  for (unsigned int i = 0; i < old_capacity; i++)
+  {
+    if (old[i].status != 1)
+      continue;
+
+    h = legacy_hash(old[i].key, d->capacity);
+    while (d->slot[h].status == 1)
+      h = (h + 1) % d->capacity;
+    d->slot[h] = old[i];
+    d->num_used++;
+  }
+  free(old);
+}
+
+static void legacy_delete(struct legacy_dict *d, const char *key)
+{
+  struct legacy_slot *s = legacy_find(d, key);
+
+  if (s != NULL)
+  {
+    s->status = 2;
+    free(s->key);
+  }
+}
+
+/*
+ * Compares CDict with the legacy engine at a range of load factors.
+ * Each row inserts enough identifier-like keys to fill a table of 2^20
+ * slots to the load factor, then looks each one up, looks up as many
+ * absent keys, and deletes them all. CDict grows past 0.875, so at 0.9
+ * it runs at half that load.
+ */
+static void bench_cdict()
+{
+  const unsigned int slots = 1 << 20;
+  const double loads[] = {0.5, 0.6, 0.7, 0.8, 0.875, 0.9};
+  const int max_keys = 0.9 * slots;
+  char (*keys)[16] = malloc(sizeof(*keys) * 2 * max_keys);
+  assert(keys != NULL);
+
+  // the second half of keys are never stored
+  for (int i = 0; i < 2 * max_keys; i++)
+    snprintf(keys[i], sizeof(keys[i]), "%s_%d", (i < max_keys) ? "var" : "tmp", i % max_keys);
+
+  // shuffle each half, so that keys named in sequence are not visited in
+  // sequence, which would favour a hash that maps them to nearby slots
+  srand(1);
+  for (int half = 0; half < 2; half++)
+  {
+    for (int i = max_keys - 1; i > 0; i--)
+    {
+      char tmp[16];
+      int j = half * max_keys + rand() % (i + 1);
+
+      memcpy(tmp, keys[half * max_keys + i], 16);
+      memcpy(keys[half * max_keys + i], keys[j], 16);
+      memcpy(keys[j], tmp, 16);
+    }
+  }
+
+  printf("%-8s %6s %6s %10s %10s %10s %10s\n", "engine", "target", "load", "insert ns", "hit ns", "miss ns",
+         "delete ns");
+
+  for (int l = 0; l < sizeof(loads) / sizeof(loads[0]); l++)
+  {
+    int n = loads[l] * slots;
+
+    for (int engine = 0; engine < 2; engine++)
+    {
+      struct legacy_dict legacy;
+      CDict dict = NULL;
+      double found = 0, load, t[5];
+
+      if (engine == 0)
+        legacy_init(&legacy, 0.9);
+      else
+        dict = CD_new();
+
+      t[0] = now_sec();
+      for (int i = 0; i < n; i++)
+        (engine == 0) ? legacy_store(&legacy, keys[i], i) : CD_store(dict, keys[i], i);
+      t[1] = now_sec();
+      for (int i = 0; i < n; i++)
+        found += (engine == 0) ? (legacy_find(&legacy, keys[i]) != NULL) : CD_contains(dict, keys[i]);
+      t[2] = now_sec();
+      for (int i = 0; i < n; i++)
+        found -= (engine == 0) ? (legacy_find(&legacy, keys[max_keys + i]) != NULL)
+                               : CD_contains(dict, keys[max_keys + i]);
+      t[3] = now_sec();
+      load = (engine == 0) ? (double)legacy.num_used / legacy.capacity : CD_load_factor(dict);
+      for (int i = 0; i < n; i++)
+        (engine == 0) ? legacy_delete(&legacy, keys[i]) : CD_delete(dict, keys[i]);
+      t[4] = now_sec();
+      assert(found == n);
+
+      printf("%-8s %6.3f %6.3f %10.1f %10.1f %10.1f %10.1f\n", (engine == 0) ? "legacy" : "CDict", loads[l], load,
+             (t[1] - t[0]) * 1e9 / n, (t[2] - t[1]) * 1e9 / n, (t[3] - t[2]) * 1e9 / n, (t[4] - t[3]) * 1e9 / n);
+
+      if (engine == 0)
+        legacy_free(&legacy);
+      else
+        CD_free(dict);
+    }
+  }
+
+  free(keys);
+}
+
+/*
+ * Compares the throughput of CD_hash with the legacy CDict hash on
+ * identifier-like keys of several lengths
+ */
+static void bench_hash()
+{
+  const int num_keys = 4096;
+  const int reps = 2000;
+  const int lengths[] = {1, 3, 8, 15, 31};
+  char (*keys)[32] = malloc(sizeof(*keys) * num_keys);
+  assert(keys != NULL);
+
+  printf("%-8s %12s %12s\n", "length", "legacy ns", "CD_hash ns");
+
+  for (int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+  {
+    for (int k = 0; k < num_keys; k++)
+    {
+      // a letter followed by letters, digits and underscores
+      for (int c = 0; c < lengths[l]; c++)
+        keys[k][c] = (c == 0) ? 'a' + (k * 7 + c) % 26 : "abcdefghijklmnopqrstuvwxyz_0123456789"[(k >> (c % 12)) % 37];
+      keys[k][lengths[l]] = '\0';
+    }
+
+    unsigned long checksum = 0;
+    double start = now_sec();
+    for (int r = 0; r < reps; r++)
+      for (int k = 0; k < num_keys; k++)
+        checksum += legacy_hash(keys[k], 1u << 31);
+    double legacy_ns = (now_sec() - start) * 1e9 / ((double)reps * num_keys);
+
+    start = now_sec();
+    for (int r = 0; r < reps; r++)
+      for (int k = 0; k < num_keys; k++)
+        checksum += CD_hash(keys[k]);
+    double new_ns = (now_sec() - start) * 1e9 / ((double)reps * num_keys);
+
+    printf("%-8d %12.2f %12.2f  (checksum %lx)\n", lengths[l], legacy_ns, new_ns, checksum);
+  }
+
+  free(keys);
+}
+
+static void count_key_bytes(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  *(size_t *)cb_data += strlen(key);
+}
+
+/*
+ * Times each growth of a CDict as it fills up to ten million keys.
+ * The insert that takes the table over its load threshold performs the
+ * rehash, so its time is the time to rehash. Then times a walk over
+ * every key with CD_foreach, and freeing the table.
+ */
+static void bench_rehash()
+{
+  const int num_keys = 10000000;
+  CDict dict = CD_new();
+  double total = 0;
+  char key[32];
+
+  printf("%10s %10s %10s %10s\n", "capacity", "keys", "ms", "ns/key");
+
+  for (int i = 0; i < num_keys; i++)
+  {
+    unsigned int capacity = CD_capacity(dict);
+
+    snprintf(key, sizeof(key), "var_%d", i);
+    double start = now_sec();
+    CD_store(dict, key, i);
+    double sec = now_sec() - start;
+
+    if (CD_capacity(dict) != capacity)
+    {
+      total += sec;
+      if (CD_capacity(dict) >= (1 << 16))
+        printf("%10u %10u %10.2f %10.2f\n", CD_capacity(dict), CD_size(dict), sec * 1e3, sec * 1e9 / CD_size(dict));
+    }
+  }
+
+  printf("all rehashes %.1f ms\n", total * 1e3);
+
+  size_t key_bytes = 0;
+  double start = now_sec();
+  CD_foreach(dict, count_key_bytes, &key_bytes);
+  printf("CD_foreach %.1f ms (%zu key bytes)\n", (now_sec() - start) * 1e3, key_bytes);
+
+  start = now_sec();
+  CD_free(dict);
+  printf("CD_free %.1f ms\n", (now_sec() - start) * 1e3);
+}
+
+/*
+ * A soak test of CDict under churn: a working set of temporary
+ * variables of constant size, in which each step deletes the oldest
+ * variable and stores a new one. Reports the time per operation and
+ * the table's capacity as the run goes on.
+ */
+static void bench_churn()
+{
+  const int live = 100000;
+  const long num_ops = 100000000;
+  const long report = num_ops / 10;
+  CDict dict = CD_new();
+  char key[32];
+  double found = 0;
+
+  for (int i = 0; i < live; i++)
+  {
+    snprintf(key, sizeof(key), "tmp_%d", i);
+    CD_store(dict, key, i);
+  }
+
+  printf("%12s %10s %10s %8s\n", "operations", "ns/op", "capacity", "load");
+
+  double start = now_sec();
+  for (long op = 0; op < num_ops; op += 2)
+  {
+    long n = live + op / 2;
+
+    snprintf(key, sizeof(key), "tmp_%ld", n - live);
+    CD_delete(dict, key);
+    snprintf(key, sizeof(key), "tmp_%ld", n);
+    CD_store(dict, key, n);
+    found += CD_retrieve(dict, key);
+
+    if ((op + 2) % report == 0)
+    {
+      double sec = now_sec() - start;
+      printf("%12ld %10.1f %10u %8.3f\n", op + 2, sec * 1e9 / report, CD_capacity(dict), CD_load_factor(dict));
+      start = now_sec();
+    }
+  }
+
+  assert(CD_size(dict) == live && found > 0);
+  CD_free(dict);
+}
+
+/*
+ * Compares preloading a million variables one CD_store at a time with
+ * CD_store_many, then times CD_shrink_to_fit after most are deleted
+ */
+static void bench_preload()
+{
+  const int num_keys = 1000000;
+  char (*names)[16] = malloc(sizeof(*names) * num_keys);
+  CDictKeyType *keys = malloc(sizeof(CDictKeyType) * num_keys);
+  CDictValueType *values = malloc(sizeof(CDictValueType) * num_keys);
+  assert(names != NULL && keys != NULL && values != NULL);
+
+  for (int i = 0; i < num_keys; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "const_%d", i);
+    keys[i] = names[i];
+    values[i] = i;
+  }
+
+  CDict dict = NULL;
+  for (int method = 0; method < 2; method++)
+  {
+    CD_free(dict);
+    dict = CD_new();
+
+    double start = now_sec();
+    if (method == 0)
+      for (int i = 0; i < num_keys; i++)
+        CD_store(dict, keys[i], values[i]);
+    else
+      CD_store_many(dict, keys, values, num_keys);
+
+    printf("%-14s %8.1f ms  capacity %u\n", (method == 0) ? "CD_store" : "CD_store_many",
+           (now_sec() - start) * 1e3, CD_capacity(dict));
+  }
+
+  for (int i = 0; i < num_keys; i++)
+    if (i % 100 != 0)
+      CD_delete(dict, keys[i]);
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    unsigned int capacity = CD_capacity(dict);
+    double start, sum = 0;
+
+    if (pass == 1)
+    {
+      start = now_sec();
+      CD_shrink_to_fit(dict);
+      printf("%-14s %8.1f ms  capacity %u -> %u for %u keys\n", "CD_shrink", (now_sec() - start) * 1e3, capacity,
+             CD_capacity(dict), CD_size(dict));
+    }
+
+    start = now_sec();
+    for (int r = 0; r < 100; r++)
+      for (int i = 0; i < num_keys; i += 100)
+        sum += CD_retrieve(dict, keys[i]);
+    printf("%-14s %8.1f ns/lookup %s shrinking (checksum %g)\n", "CD_retrieve", (now_sec() - start) * 1e9 / num_keys,
+           (pass == 0) ? "before" : "after", sum);
+  }
+
+  CD_free(dict);
+  free(names);
+  free(keys);
+  free(values);
+}
+
+// The shared dictionaries and the mix of operations for bench_concurrent
+struct concurrent_job
+{
+  CCDict ccdict;
+  CDict cdict;
+  pthread_rwlock_t *rwlock; // guards cdict
+  char (*keys)[16];
+  int num_keys;
+  int num_ops;
+  int read_percent;
+  unsigned int seed;
+  double sum;
+};
+
+static void *concurrent_body(void *arg)
+{
+  struct concurrent_job *job = arg;
+  uint64_t x = job->seed;
+  double sum = 0;
+
+  for (int i = 0; i < job->num_ops; i++)
+  {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    char *key = job->keys[(x >> 33) % job->num_keys];
+    bool read = (int)((x >> 20) % 100) < job->read_percent;
+
+    if (job->ccdict != NULL)
+    {
+      if (read)
+        sum += CC_retrieve(job->ccdict, key);
+      else
+        CC_store(job->ccdict, key, i);
+    }
+    else if (read)
+    {
+      pthread_rwlock_rdlock(job->rwlock);
+      sum += CD_retrieve(job->cdict, key);
+      pthread_rwlock_unlock(job->rwlock);
+    }
+    else
+    {
+      pthread_rwlock_wrlock(job->rwlock);
+      CD_store(job->cdict, key, i);
+      pthread_rwlock_unlock(job->rwlock);
+    }
+  }
+
+  job->sum = sum;
+  return NULL;
+}
+
+/*
+ * Compares the throughput of a CCDict against a CDict behind a
+ * readers-writer lock, as threads are added, at several mixes of
+ * lookups and stores over a shared set of variables
+ */
+static void bench_concurrent()
+{
+  const int num_keys = 10000;
+  const int num_ops = 1000000;
+  const int read_percents[] = {100, 99, 90, 50};
+  const int max_threads = 64;
+  char (*keys)[16] = malloc(sizeof(*keys) * num_keys);
+  pthread_t thread[max_threads];
+  struct concurrent_job job[max_threads];
+  pthread_rwlock_t rwlock;
+  assert(keys != NULL);
+
+  pthread_rwlock_init(&rwlock, NULL);
+  for (int i = 0; i < num_keys; i++)
+    snprintf(keys[i], sizeof(keys[i]), "var_%d", i);
+
+  printf("%d cores; Mops/s, CDict with rwlock / CCDict\n", (int)sysconf(_SC_NPROCESSORS_ONLN));
+  printf("threads");
+  for (int r = 0; r < 4; r++)
+    printf("   %3d%% reads     ", read_percents[r]);
+  printf("\n");
+
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+  {
+    printf("%7d", num_threads);
+    for (int r = 0; r < 4; r++)
+    {
+      double mops[2];
+
+      for (int engine = 0; engine < 2; engine++)
+      {
+        CCDict ccdict = (engine == 1) ? CC_new() : NULL;
+        CDict cdict = (engine == 0) ? CD_new() : NULL;
+
+        for (int i = 0; i < num_keys; i++)
+          if (engine == 1)
+            CC_store(ccdict, keys[i], i);
+          else
+            CD_store(cdict, keys[i], i);
+
+        double start = now_sec();
+        for (int t = 0; t < num_threads; t++)
+        {
+          job[t] = (struct concurrent_job){ccdict, cdict, &rwlock, keys, num_keys, num_ops, read_percents[r], t + 1, 0};
+          pthread_create(&thread[t], NULL, concurrent_body, &job[t]);
+        }
+        for (int t = 0; t < num_threads; t++)
+          pthread_join(thread[t], NULL);
+        mops[engine] = (double)num_ops * num_threads / (now_sec() - start) / 1e6;
+
+        CC_free(ccdict);
+        CD_free(cdict);
+      }
+      printf("   %6.1f / %6.1f", mops[0], mops[1]);
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  pthread_rwlock_destroy(&rwlock);
+  free(keys);
+}
+
+static void copy_entry(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  CD_store((CDict)cb_data, key, value);
+}
+
+/*
+ * Compares a persistent environment against a CDict that is copied to
+ * give each request a consistent view: the cost of a snapshot, of an
+ * update, of a lookup and of evaluating a formula, as the number of
+ * variables grows
+ */
+static void bench_penv()
+{
+  const int sizes[] = {1000, 100000, 1000000};
+  const int num_updates = 100000;
+  const int num_evals = 1000000;
+  char key[32];
+
+  printf("%9s %-6s %12s %12s %12s %12s\n", "variables", "", "snapshot ns", "update ns", "lookup ns",
+         "evaluate ns");
+
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    int n = sizes[s];
+    CDict dict = CD_new();
+    PEnv env = PE_env_new();
+    ExprTree formula = build_formula();
+    double sum = 0, start;
+    double ns[2][4];
+
+    for (int i = 0; i < n; i++)
+    {
+      snprintf(key, sizeof(key), "var_%d", i);
+      CD_store(dict, key, i);
+      PE_env_store(env, key, i);
+    }
+    CD_store(dict, "x", 3);
+    CD_store(dict, "y", 4);
+    PE_env_store(env, "x", 3);
+    PE_env_store(env, "y", 4);
+
+    // a snapshot: copying every variable, against taking a reference
+    int copies = (n >= 100000) ? 3 : 100;
+    start = now_sec();
+    for (int r = 0; r < copies; r++)
+    {
+      CDict copy = CD_new();
+      CD_reserve(copy, CD_size(dict));
+      CD_foreach(dict, copy_entry, copy);
+      sum += CD_size(copy);
+      CD_free(copy);
+    }
+    ns[0][0] = (now_sec() - start) * 1e9 / copies;
+
+    start = now_sec();
+    for (int r = 0; r < num_evals; r++)
+    {
+      PEMap snapshot = PE_env_snapshot(env);
+      sum += PE_size(snapshot);
+      PE_release(snapshot);
+    }
+    ns[1][0] = (now_sec() - start) * 1e9 / num_evals;
+
+    start = now_sec();
+    for (int r = 0; r < num_updates; r++)
+    {
+      snprintf(key, sizeof(key), "var_%d", (int)(((uint64_t)r * 2654435761u) % n));
+      CD_store(dict, key, r);
+    }
+    ns[0][1] = (now_sec() - start) * 1e9 / num_updates;
+
+    start = now_sec();
+    for (int r = 0; r < num_updates; r++)
+    {
+      snprintf(key, sizeof(key), "var_%d", (int)(((uint64_t)r * 2654435761u) % n));
+      PE_env_store(env, key, r);
+    }
+    ns[1][1] = (now_sec() - start) * 1e9 / num_updates;
+
+    PEMap snapshot = PE_env_snapshot(env);
+    char (*keys)[32] = malloc(sizeof(*keys) * num_updates);
+    assert(keys != NULL);
+    for (int r = 0; r < num_updates; r++)
+      snprintf(keys[r], sizeof(keys[r]), "var_%d", (int)(((uint64_t)r * 40503u) % n));
+
+    start = now_sec();
+    for (int r = 0; r < 10; r++)
+      for (int k = 0; k < num_updates; k++)
+        sum += CD_retrieve(dict, keys[k]);
+    ns[0][2] = (now_sec() - start) * 1e9 / (10.0 * num_updates);
+
+    start = now_sec();
+    for (int r = 0; r < 10; r++)
+      for (int k = 0; k < num_updates; k++)
+        sum += PE_retrieve(snapshot, keys[k]);
+    ns[1][2] = (now_sec() - start) * 1e9 / (10.0 * num_updates);
+
+    double value;
+    start = now_sec();
+    for (int r = 0; r < num_evals; r++)
+    {
+      ET_evaluate_checked(formula, dict, &value, NULL);
+      sum += value;
+    }
+    ns[0][3] = (now_sec() - start) * 1e9 / num_evals;
+
+    start = now_sec();
+    for (int r = 0; r < num_evals; r++)
+    {
+      ET_evaluate_persistent(formula, &snapshot, &value, NULL);
+      sum += value;
+    }
+    ns[1][3] = (now_sec() - start) * 1e9 / num_evals;
+
+    for (int e = 0; e < 2; e++)
+      printf("%9d %-6s %12.1f %12.1f %12.1f %12.1f\n", n, (e == 0) ? "CDict" : "PEnv", ns[e][0], ns[e][1],
+             ns[e][2], ns[e][3]);
+    printf("(checksum %g)\n", sum);
+
+    free(keys);
+    PE_release(snapshot);
+    ET_free(formula);
+    PE_env_free(env);
+    CD_free(dict);
+  }
+}
+
+/*
+ * Compares updating variables in a large dictionary by name, with
+ * CD_store, against updating them through cells from CD_find_or_add
+ */
+static void bench_handles()
+{
+  const int num_keys = 1000000;
+  const int num_hot = 64;
+  const int rounds = 200000;
+  char (*names)[16] = malloc(sizeof(*names) * num_keys);
+  CDictCell hot[num_hot];
+  CDict dict = CD_new();
+  assert(names != NULL);
+
+  for (int i = 0; i < num_keys; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "var_%d", i);
+    CD_store(dict, names[i], i);
+  }
+
+  // a scattered handful of variables, each updated many times
+  for (int h = 0; h < num_hot; h++)
+    hot[h] = CD_find_or_add(dict, names[(int)(((uint64_t)h * 2654435761u) % num_keys)], 0);
+
+  double start = now_sec();
+  for (int r = 0; r < rounds; r++)
+    for (int h = 0; h < num_hot; h++)
+      CD_store(dict, names[(int)(((uint64_t)h * 2654435761u) % num_keys)], r);
+  double by_name = (now_sec() - start) * 1e9 / ((double)rounds * num_hot);
+
+  start = now_sec();
+  for (int r = 0; r < rounds; r++)
+    for (int h = 0; h < num_hot; h++)
+      CD_cell_store(dict, hot[h], r + 1);
+  double by_cell = (now_sec() - start) * 1e9 / ((double)rounds * num_hot);
+
+  double sum = 0;
+  start = now_sec();
+  for (int r = 0; r < rounds; r++)
+    for (int h = 0; h < num_hot; h++)
+      sum += CD_cell_load(dict, hot[h]);
+  double load = (now_sec() - start) * 1e9 / ((double)rounds * num_hot);
+
+  printf("%-14s %6.1f ns/update\n", "CD_store", by_name);
+  printf("%-14s %6.1f ns/update\n", "CD_cell_store", by_cell);
+  printf("%-14s %6.1f ns/read (checksum %g)\n", "CD_cell_load", load, sum);
+
+  CD_free(dict);
+  free(names);
+}
+
+/*
+ * Compares evaluating per-row temporary assignments over a large
+ * dictionary of constants in a scope that is pushed and popped for
+ * each row, against assigning into the dictionary itself and deleting
+ * the temporaries afterwards
+ */
+static void bench_scope()
+{
+  const int num_constants = 1000000;
+  const int num_rows = 200000;
+  const int temps[] = {1, 4, 16};
+  char key[32];
+  char errmsg[128];
+  CDict globals = CD_new();
+
+  for (int i = 0; i < num_constants; i++)
+  {
+    snprintf(key, sizeof(key), "const_%d", i);
+    CD_store(globals, key, i);
+  }
+  CD_store(globals, "x", 3);
+  CD_store(globals, "y", 4);
+
+  printf("%-6s %14s %14s\n", "temps", "scope ns/row", "in place ns/row");
+
+  for (int t = 0; t < sizeof(temps) / sizeof(temps[0]); t++)
+  {
+    // t_i = x * y + i for each temporary, then the sum of them all
+    ExprTree *assign = malloc(sizeof(ExprTree) * temps[t]);
+    char (*names)[16] = malloc(sizeof(*names) * temps[t]);
+    assert(assign != NULL && names != NULL);
+
+    ExprTree sum = ET_value(0);
+    for (int i = 0; i < temps[t]; i++)
+    {
+      snprintf(names[i], sizeof(names[i]), "t%d", i);
+      assign[i] = ET_node(OP_ASSIGN, ET_symbol(names[i]),
+                          ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("y")), ET_value(i)));
+      sum = ET_node(OP_ADD, sum, ET_symbol(names[i]));
+    }
+
+    double ns[2];
+    double checksum = 0;
+
+    for (int method = 0; method < 2; method++)
+    {
+      double start = now_sec();
+
+      for (int r = 0; r < num_rows; r++)
+      {
+        CDict vars = (method == 0) ? CD_push_scope(globals) : globals;
+
+        for (int i = 0; i < temps[t]; i++)
+          ET_evaluate(assign[i], vars, errmsg, sizeof(errmsg));
+        checksum += ET_evaluate(sum, vars, errmsg, sizeof(errmsg));
+
+        if (method == 0)
+          CD_pop_scope(vars);
+        else
+          for (int i = 0; i < temps[t]; i++)
+            CD_delete(globals, names[i]);
+      }
+      ns[method] = (now_sec() - start) * 1e9 / num_rows;
+    }
+
+    printf("%-6d %14.1f %14.1f  (checksum %g)\n", temps[t], ns[0], ns[1], checksum);
+
+    for (int i = 0; i < temps[t]; i++)
+      ET_free(assign[i]);
+    ET_free(sum);
+    free(assign);
+    free(names);
+  }
+
+  CD_free(globals);
+}
+
+static const struct
+{
+  const char *name;
+  void (*fn)();
+} benchmarks[] = {
+    {"tree2string", bench_tree2string},
+    {"batch", bench_batch},
+    {"parallel", bench_parallel},
+    {"codegen", bench_codegen},
+    {"pow", bench_pow},
+    {"reactive", bench_reactive},
+    {"cache", bench_cache},
+    {"image", bench_image},
+    {"derivatives", bench_derivatives},
+    {"gradient", bench_gradient},
+    {"rebalance", bench_rebalance},
+    {"cdict", bench_cdict},
+    {"hash", bench_hash},
+    {"rehash", bench_rehash},
+    {"churn", bench_churn},
+    {"preload", bench_preload},
+    {"concurrent", bench_concurrent},
+    {"penv", bench_penv},
+    {"handles", bench_handles},
+    {"scope", bench_scope},
+};
+
+int main(int argc, char *argv[])
+{
+  const int num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+  for (int b = 0; b < num_benchmarks; b++)
+  {
+    bool selected = (argc == 1);
+
+    for (int a = 1; a < argc; a++)
+      if (strcmp(argv[a], benchmarks[b].name) == 0)
+        selected = true;
+
+    if (!selected)
+      continue;
+
+    printf("== %s ==\n", benchmarks[b].name);
+    benchmarks[b].fn();
+    printf("\n");
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -13,6 +13,10 @@
 #include <ctype.h>  // isblank
 #include <math.h>   // fabs
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h> // unlink, rmdir
+#include <dirent.h>
+#include <pthread.h>
 
 #include "clist.h"
 #include "token.h"
@@ -20,6 +24,13 @@
 #include "expr_tree.h"
 #include "parse.h"
 #include "cdict.h"
+#include "expr_batch.h"
+#include "expr_codegen.h"
+#include "reactive.h"
+#include "eval_cache.h"
+#include "expr_diff.h"
+#include "ccdict.h"
+#include "penv.h"
 
 // If value is not true; prints a failure message and returns 0.
 #define test_assert(value)                                         \
@@ -257,6 +268,2416 @@ test_error:
   return 0;
 }
 
+/*
+ * Tests ET_tree2string on truncated output and on trees that are far
+ * deeper than the buffer is long. Every truncated result must be the
+ * leading characters of the full string followed by a '$'.
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_tree2string()
+{
+  ExprTree tree = NULL;
+  char full[1024];
+  char buffer[1024];
+  size_t full_len;
+  size_t len;
+
+  // (x = ((-2.5) * (y ^ 3))) - 7
+  tree = ET_node(OP_SUB,
+                 ET_node(OP_ASSIGN, ET_symbol("x"),
+                         ET_node(OP_MUL, ET_node(UNARY_NEGATE, ET_value(2.5), NULL),
+                                 ET_node(OP_POWER, ET_symbol("y"), ET_value(3)))),
+                 ET_value(7));
+  full_len = ET_tree2string(tree, full, sizeof(full));
+  test_assert(strcmp(full, "((x = ((-2.5) * (y ^ 3))) - 7)") == 0);
+  test_assert(full_len == strlen(full));
+
+  for (size_t sz = 2; sz <= full_len + 2; sz++)
+  {
+    memset(buffer, '#', sizeof(buffer));
+    len = ET_tree2string(tree, buffer, sz);
+    test_assert(len == strlen(buffer));
+
+    if (sz > full_len)
+    {
+      test_assert(strcmp(buffer, full) == 0);
+    }
+    else
+    {
+      test_assert(len == sz - 1);
+      test_assert(strncmp(buffer, full, sz - 2) == 0);
+      test_assert(buffer[sz - 2] == '$');
+    }
+    test_assert(buffer[sz] == '#');
+  }
+
+  len = ET_tree2string(tree, buffer, 1);
+  test_assert(len == 0 && buffer[0] == '\0');
+  ET_free(tree);
+
+  // a chain 20000 nodes deep, printed into a 1 KB buffer
+  tree = ET_symbol("a");
+  for (int i = 0; i < 20000; i++)
+    tree = ET_node(i % 2 ? OP_ADD : OP_MUL, tree, ET_value(i));
+
+  len = ET_tree2string(tree, buffer, sizeof(buffer));
+  test_assert(len == sizeof(buffer) - 1);
+  test_assert(buffer[len - 1] == '$');
+  test_assert(strncmp(buffer, "((((", 4) == 0);
+  ET_free(tree);
+
+  // a right-leaning chain, which needs the full traversal stack
+  tree = ET_symbol("b");
+  for (int i = 0; i < 20000; i++)
+    tree = ET_node(OP_POWER, ET_value(i % 10), tree);
+
+  len = ET_tree2string(tree, buffer, sizeof(buffer));
+  test_assert(len == sizeof(buffer) - 1);
+  test_assert(strncmp(buffer, "(9 ^ (8 ^ (7 ^", 14) == 0);
+  ET_free(tree);
+
+  return 1;
+
+test_error:
+  ET_free(tree);
+  return 0;
+}
+
+// Output collected by collect_chunk
+struct collect_data
+{
+  char *text;
+  size_t len;
+  size_t max_chunk;
+  int num_calls;
+  int stop_after;
+};
+
+int collect_chunk(const char *chunk, size_t len, void *cb_data)
+{
+  struct collect_data *cd = (struct collect_data *)cb_data;
+
+  if (cd->stop_after > 0 && cd->num_calls == cd->stop_after)
+    return -1;
+
+  cd->num_calls++;
+  if (len > cd->max_chunk)
+    cd->max_chunk = len;
+
+  cd->text = realloc(cd->text, cd->len + len + 1);
+  memcpy(cd->text + cd->len, chunk, len);
+  cd->len += len;
+  cd->text[cd->len] = '\0';
+  return 0;
+}
+
+/*
+ * Tests ET_tree2callback and ET_tree2file against ET_tree2string
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_tree2stream()
+{
+  ExprTree tree = NULL;
+  FILE *stream = NULL;
+  struct collect_data cd = {NULL, 0, 0, 0, 0};
+  char buffer[16384];
+  char from_file[16384];
+  size_t len;
+
+  // a few hundred nodes, so the output spans many chunks
+  tree = ET_symbol("total");
+  for (int i = 0; i < 300; i++)
+    tree = ET_node(i % 3 ? OP_ADD : OP_DIV, tree, ET_node(UNARY_NEGATE, ET_value(i * 1.5), NULL));
+
+  len = ET_tree2string(tree, buffer, sizeof(buffer));
+  test_assert(buffer[len - 1] != '$');
+
+  test_assert(ET_tree2callback(tree, collect_chunk, &cd) == len);
+  test_assert(cd.len == len);
+  test_assert(strcmp(cd.text, buffer) == 0);
+  test_assert(cd.num_calls > 1);
+  test_assert(cd.max_chunk <= 256);
+
+  stream = tmpfile();
+  test_assert(stream != NULL);
+  test_assert(ET_tree2file(tree, stream) == len);
+  rewind(stream);
+  test_assert(fread(from_file, 1, sizeof(from_file), stream) == len);
+  test_assert(memcmp(from_file, buffer, len) == 0);
+
+  // stop after the second chunk
+  free(cd.text);
+  cd = (struct collect_data){NULL, 0, 0, 0, 2};
+  test_assert(ET_tree2callback(tree, collect_chunk, &cd) == cd.len);
+  test_assert(cd.num_calls == 2);
+  test_assert(strncmp(cd.text, buffer, cd.len) == 0);
+
+  test_assert(ET_tree2callback(NULL, collect_chunk, &cd) == 0);
+
+  fclose(stream);
+  free(cd.text);
+  ET_free(tree);
+  return 1;
+
+test_error:
+  if (stream != NULL)
+    fclose(stream);
+  free(cd.text);
+  ET_free(tree);
+  return 0;
+}
+
+/*
+ * Tests EB_compile and EB_run against ET_evaluate, row by row, for
+ * every instruction set that this CPU supports
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_batch()
+{
+  const char *isas[] = {"scalar", "avx2", "avx512f"};
+  const char *symbols[] = {"x", "y"};
+  const size_t num_rows = 1000;
+  double x[num_rows], y[num_rows], out[num_rows];
+  const double *columns[] = {x, y};
+  unsigned char errmask[(num_rows + 7) / 8];
+  char errmsg[128];
+  ExprTree tree = NULL;
+  ExprBatch batch = NULL;
+  CDict vars = CD_new();
+  CDict row_vars = CD_new();
+
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    x[r] = (double)(r % 17);
+    y[r] = r * 0.5 - 100;
+  }
+  CD_store(vars, "c", 3);
+  CD_store(row_vars, "c", 3);
+
+  // ((t = (x + (y * 2))) / (x - 1)) - ((y ^ 2) + (-c)) + t
+  tree = ET_node(OP_ADD,
+                 ET_node(OP_SUB,
+                         ET_node(OP_DIV,
+                                 ET_node(OP_ASSIGN, ET_symbol("t"), ET_node(OP_ADD, ET_symbol("x"), ET_node(OP_MUL, ET_symbol("y"), ET_value(2)))),
+                                 ET_node(OP_SUB, ET_symbol("x"), ET_value(1))),
+                         ET_node(OP_ADD, ET_node(OP_POWER, ET_symbol("y"), ET_value(2)), ET_node(UNARY_NEGATE, ET_symbol("c"), NULL))),
+                 ET_symbol("t"));
+
+  batch = EB_compile(tree, vars, symbols, 2, errmsg, sizeof(errmsg));
+  test_assert(batch != NULL);
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (!EB_use_isa(batch, isas[i]))
+      continue;
+    test_assert(strcmp(EB_isa(batch), isas[i]) == 0);
+
+    memset(out, 0, sizeof(out));
+    size_t failed = EB_run(batch, columns, num_rows, out, errmask);
+    size_t expected_failed = 0;
+
+    for (size_t r = 0; r < num_rows; r++)
+    {
+      bool row_failed = (x[r] == 1);
+
+      CD_store(row_vars, "x", x[r]);
+      CD_store(row_vars, "y", y[r]);
+      double expected = ET_evaluate(tree, row_vars, errmsg, sizeof(errmsg));
+
+      test_assert(((errmask[r / 8] >> (r % 8)) & 1) == row_failed);
+      if (row_failed)
+      {
+        expected_failed++;
+        test_assert(isnan(out[r]));
+      }
+      else
+        test_assert(out[r] == expected);
+    }
+    test_assert(failed == expected_failed);
+  }
+
+  EB_free(batch);
+  batch = NULL;
+
+  // an assignment of NaN that is not an error keeps the variable's
+  // previous value, whether that came from a column or a slot:
+  // ((t = x + 1)^0) + ((y = (x - 8)^0.5)^0) + ((t = (x - 8)^0.5)^0) + y * t
+  ET_free(tree);
+  tree = ET_node(OP_ADD,
+                 ET_node(OP_ADD,
+                         ET_node(OP_ADD,
+                                 ET_node(OP_POWER, ET_node(OP_ASSIGN, ET_symbol("t"), ET_node(OP_ADD, ET_symbol("x"), ET_value(1))), ET_value(0)),
+                                 ET_node(OP_POWER, ET_node(OP_ASSIGN, ET_symbol("y"), ET_node(OP_POWER, ET_node(OP_SUB, ET_symbol("x"), ET_value(8)), ET_value(0.5))), ET_value(0))),
+                         ET_node(OP_POWER, ET_node(OP_ASSIGN, ET_symbol("t"), ET_node(OP_POWER, ET_node(OP_SUB, ET_symbol("x"), ET_value(8)), ET_value(0.5))), ET_value(0))),
+                 ET_node(OP_MUL, ET_symbol("y"), ET_symbol("t")));
+  batch = EB_compile(tree, vars, symbols, 2, errmsg, sizeof(errmsg));
+  test_assert(batch != NULL);
+  test_assert(EB_run(batch, columns, num_rows, out, errmask) == 0);
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    CD_delete(row_vars, "t");
+    CD_store(row_vars, "x", x[r]);
+    CD_store(row_vars, "y", y[r]);
+    double expected = ET_evaluate(tree, row_vars, errmsg, sizeof(errmsg));
+
+    test_assert(!isnan(expected) && out[r] == expected);
+  }
+  EB_free(batch);
+  batch = NULL;
+
+  // a bare column, and an input that is only partly a chunk
+  ET_free(tree);
+  tree = ET_symbol("y");
+  batch = EB_compile(tree, vars, symbols, 2, errmsg, sizeof(errmsg));
+  test_assert(batch != NULL);
+  test_assert(EB_run(batch, columns, 3, out, NULL) == 0);
+  test_assert(out[0] == y[0] && out[1] == y[1] && out[2] == y[2]);
+  EB_free(batch);
+  batch = NULL;
+
+  // errors found while compiling
+  ET_free(tree);
+  tree = ET_node(OP_MUL, ET_symbol("x"), ET_symbol("z"));
+  test_assert(EB_compile(tree, vars, symbols, 2, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Undefined variable: z") == 0);
+
+  ET_free(tree);
+  tree = ET_node(OP_ASSIGN, ET_value(2), ET_symbol("x"));
+  test_assert(EB_compile(tree, vars, symbols, 2, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Syntax error on token EQUAL") == 0);
+
+  ET_free(tree);
+  CD_free(vars);
+  CD_free(row_vars);
+  return 1;
+
+test_error:
+  EB_free(batch);
+  ET_free(tree);
+  CD_free(vars);
+  CD_free(row_vars);
+  return 0;
+}
+
+// TP_task_fn that counts the runs of each task; tasks are uneven in length
+void count_task(size_t task, int worker, void *cb_data)
+{
+  int *runs = (int *)cb_data;
+  volatile double spin = 0;
+
+  for (size_t i = 0; i < (task % 7) * 1000; i++)
+    spin += i;
+
+  __atomic_fetch_add(&runs[task], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Tests TP_run and EB_run_parallel, which must give exactly the same
+ * results as EB_run for every thread count and chunk size
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_batch_parallel()
+{
+  const char *symbols[] = {"x", "y"};
+  const size_t num_rows = 5000;
+  const size_t num_tasks = 1000;
+  static double x[5000], y[5000], serial[5000], parallel[5000];
+  static int runs[1000];
+  const double *columns[] = {x, y};
+  unsigned char serial_mask[(num_rows + 7) / 8];
+  unsigned char parallel_mask[(num_rows + 7) / 8];
+  char errmsg[128];
+  ExprTree tree = NULL;
+  ExprBatch batch = NULL;
+  ThreadPool pool = NULL;
+
+  for (size_t r = 0; r < num_rows; r++)
+  {
+    x[r] = (double)(r % 23) - 11;
+    y[r] = r * 0.25;
+  }
+
+  // (x * y) / (x + 3) - (-y)
+  tree = ET_node(OP_SUB,
+                 ET_node(OP_DIV, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("y")), ET_node(OP_ADD, ET_symbol("x"), ET_value(3))),
+                 ET_node(UNARY_NEGATE, ET_symbol("y"), NULL));
+  batch = EB_compile(tree, NULL, symbols, 2, errmsg, sizeof(errmsg));
+  test_assert(batch != NULL);
+  size_t serial_failed = EB_run(batch, columns, num_rows, serial, serial_mask);
+  test_assert(serial_failed > 0);
+
+  for (int threads = 1; threads <= 4; threads++)
+  {
+    pool = TP_new(threads);
+    test_assert(TP_num_threads(pool) == threads);
+
+    memset(runs, 0, sizeof(runs));
+    TP_run(pool, num_tasks, count_task, runs);
+    for (size_t t = 0; t < num_tasks; t++)
+      test_assert(runs[t] == 1);
+
+    size_t chunk_sizes[] = {0, 1, 256, 1000, 100000};
+    for (int c = 0; c < 5; c++)
+    {
+      memset(parallel, 0, sizeof(parallel));
+      memset(parallel_mask, 0xff, sizeof(parallel_mask));
+      size_t failed = EB_run_parallel(batch, pool, columns, num_rows, chunk_sizes[c], parallel, parallel_mask);
+
+      test_assert(failed == serial_failed);
+      test_assert(memcmp(parallel, serial, sizeof(serial)) == 0);
+      test_assert(memcmp(parallel_mask, serial_mask, sizeof(serial_mask)) == 0);
+    }
+
+    TP_free(pool);
+    pool = NULL;
+  }
+
+  EB_free(batch);
+  ET_free(tree);
+  return 1;
+
+test_error:
+  TP_free(pool);
+  EB_free(batch);
+  ET_free(tree);
+  return 0;
+}
+
+struct bind_race
+{
+  ExprTree tree;
+  double x;
+  bool failed;
+};
+
+/*
+ * Evaluate a shared tree, y = x * k10 + z, against a dictionary of the
+ * thread's own
+ */
+static void *bind_evaluator(void *arg)
+{
+  struct bind_race *race = arg;
+  CDict vars = CD_new();
+  char errmsg[128];
+
+  CD_store(vars, "x", race->x);
+  CD_store(vars, "k10", 10);
+  CD_store(vars, "z", 1);
+  for (int i = 0; i < 20000 && !race->failed; i++)
+    race->failed = (ET_evaluate(race->tree, vars, errmsg, sizeof(errmsg)) != race->x * 10 + 1);
+
+  CD_free(vars);
+  return NULL;
+}
+
+/*
+ * Tests CDict cells and ET_bind: bindings must survive the dictionary
+ * growing, and must fall back to lookup by name once a variable is
+ * deleted or the tree is evaluated against another dictionary
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_bind()
+{
+  ExprTree tree = NULL;
+  CDict vars = CD_new();
+  CDict other = CD_new();
+  CDictCell cell, again;
+  char errmsg[128];
+  char key[16];
+
+  CD_store(vars, "x", 2);
+  test_assert(CD_find_cell(vars, "x", &cell));
+  test_assert(!CD_find_cell(vars, "nope", &again));
+  test_assert(!CD_cell_valid(vars, INVALID_CELL));
+  test_assert(!CD_cell_valid(other, cell));
+
+  // grow the dictionary well past its initial capacity
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    CD_store(vars, key, i);
+  }
+  test_assert(CD_cell_valid(vars, cell));
+  test_assert(CD_cell_load(vars, cell) == 2);
+  CD_cell_store(vars, cell, 5);
+  test_assert(CD_retrieve(vars, "x") == 5);
+  CD_cell_store(vars, cell, NAN);
+  test_assert(CD_retrieve(vars, "x") == 5);
+
+  // a deleted key's cell is invalid, even once the cell is reused
+  CD_delete(vars, "x");
+  test_assert(!CD_cell_valid(vars, cell));
+  test_assert(isnan(CD_cell_load(vars, cell)));
+  CD_store(vars, "x", 7);
+  test_assert(CD_find_cell(vars, "x", &again));
+  test_assert(!CD_cell_valid(vars, cell));
+  test_assert(CD_cell_load(vars, again) == 7);
+
+  // find-or-add returns the existing cell, or adds the key
+  cell = CD_find_or_add(vars, "x", 9);
+  test_assert(CD_cell_valid(vars, cell) && cell.index == again.index && CD_cell_load(vars, cell) == 7);
+  cell = CD_find_or_add(vars, "w", 9);
+  test_assert(CD_retrieve(vars, "w") == 9 && CD_size(vars) == 1002);
+  test_assert(CD_find_cell(vars, "w", &again) && again.index == cell.index);
+  cell = CD_find_or_add(vars, "v", NAN);
+  test_assert(!CD_cell_valid(vars, cell) && !CD_contains(vars, "v"));
+
+  // y = x * k10 + z
+  tree = ET_node(OP_ASSIGN, ET_symbol("y"),
+                 ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("k10")), ET_symbol("z")));
+  test_assert(ET_bind(tree, vars) == 2);
+  CD_store(vars, "z", 1);
+  test_assert(ET_evaluate(tree, vars, errmsg, sizeof(errmsg)) == 71);
+  test_assert(CD_retrieve(vars, "y") == 71);
+  test_assert(ET_bind(tree, vars) == 0);
+
+  CD_store(vars, "x", 3);
+  test_assert(ET_evaluate(tree, vars, errmsg, sizeof(errmsg)) == 31);
+
+  CD_delete(vars, "k10");
+  test_assert(isnan(ET_evaluate(tree, vars, errmsg, sizeof(errmsg))));
+  test_assert(strcmp(errmsg, "Undefined variable: k10") == 0);
+  CD_store(vars, "k10", 100);
+  test_assert(ET_evaluate(tree, vars, errmsg, sizeof(errmsg)) == 301);
+
+  // the same tree against a different dictionary
+  CD_store(other, "x", 1);
+  CD_store(other, "k10", 1);
+  CD_store(other, "z", 1);
+  test_assert(ET_evaluate(tree, other, errmsg, sizeof(errmsg)) == 2);
+  test_assert(CD_retrieve(other, "y") == 2);
+  test_assert(CD_retrieve(vars, "y") == 301);
+
+  // evaluation leaves the bindings alone, so threads may share the tree
+  pthread_t thread[4];
+  struct bind_race race[4];
+
+  for (int t = 0; t < 4; t++)
+  {
+    race[t] = (struct bind_race){tree, t + 1, false};
+    pthread_create(&thread[t], NULL, bind_evaluator, &race[t]);
+  }
+  for (int t = 0; t < 4; t++)
+    pthread_join(thread[t], NULL);
+  for (int t = 0; t < 4; t++)
+    test_assert(!race[t].failed);
+  test_assert(ET_evaluate(tree, vars, errmsg, sizeof(errmsg)) == 301);
+
+  ET_free(tree);
+  CD_free(vars);
+  CD_free(other);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  CD_free(vars);
+  CD_free(other);
+  return 0;
+}
+
+/*
+ * Tests ET_evaluate_checked and ET_error_message
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_evaluate_checked()
+{
+  ExprTree tree = NULL;
+  ExprTree failing;
+  CDict vars = CD_new();
+  ETError err;
+  char errmsg[128];
+  double result = -1;
+
+  CD_store(vars, "x", 4);
+
+  // x = (x * 2) + 1
+  tree = ET_node(OP_ASSIGN, ET_symbol("x"), ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_value(2)), ET_value(1)));
+  test_assert(ET_evaluate_checked(tree, vars, &result, &err) == ET_OK);
+  test_assert(result == 9);
+  test_assert(CD_retrieve(vars, "x") == 9);
+  ET_free(tree);
+
+  // assigning to a new variable does not read it first
+  tree = ET_node(OP_ASSIGN, ET_symbol("fresh"), ET_value(3));
+  test_assert(ET_evaluate_checked(tree, vars, &result, NULL) == ET_OK);
+  test_assert(result == 3);
+  ET_free(tree);
+
+  // (x / (x - 9)) + (y = 2): stops at the division, so y is never assigned
+  failing = ET_node(OP_DIV, ET_symbol("x"), ET_node(OP_SUB, ET_symbol("x"), ET_value(9)));
+  tree = ET_node(OP_ADD, failing, ET_node(OP_ASSIGN, ET_symbol("y"), ET_value(2)));
+  result = -1;
+  test_assert(ET_evaluate_checked(tree, vars, &result, &err) == ET_ERR_DIV_BY_ZERO);
+  test_assert(err.code == ET_ERR_DIV_BY_ZERO);
+  test_assert(err.node == failing);
+  test_assert(result == -1);
+  test_assert(!CD_contains(vars, "y"));
+  test_assert(ET_error_message(&err, errmsg, sizeof(errmsg)) == strlen("Division by zero"));
+  test_assert(strcmp(errmsg, "Division by zero") == 0);
+  ET_free(tree);
+
+  // the first undefined symbol is reported, not the last
+  failing = ET_symbol("a");
+  tree = ET_node(OP_MUL, ET_node(UNARY_NEGATE, failing, NULL), ET_symbol("b"));
+  test_assert(ET_evaluate_checked(tree, vars, &result, &err) == ET_ERR_UNDEFINED);
+  test_assert(err.node == failing);
+  ET_error_message(&err, errmsg, sizeof(errmsg));
+  test_assert(strcmp(errmsg, "Undefined variable: a") == 0);
+  test_assert(ET_error_message(&err, errmsg, 6) == 5);
+  test_assert(strcmp(errmsg, "Undef") == 0);
+  ET_free(tree);
+
+  // 2 = x
+  tree = ET_node(OP_ASSIGN, ET_value(2), ET_symbol("x"));
+  test_assert(ET_evaluate_checked(tree, vars, &result, &err) == ET_ERR_BAD_ASSIGN);
+  test_assert(err.node == tree);
+  ET_error_message(&err, errmsg, sizeof(errmsg));
+  test_assert(strcmp(errmsg, "Syntax error on token EQUAL") == 0);
+  ET_free(tree);
+
+  // a NaN result is not an error
+  tree = ET_node(OP_POWER, ET_value(-8), ET_value(0.5));
+  test_assert(ET_evaluate_checked(tree, vars, &result, &err) == ET_OK);
+  test_assert(isnan(result));
+
+  ET_free(tree);
+  CD_free(vars);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  CD_free(vars);
+  return 0;
+}
+
+/*
+ * Removes every file in dir, and then dir itself
+ */
+static void remove_dir(const char *dir)
+{
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  char path[FILENAME_MAX];
+
+  while (d != NULL && (ent = readdir(d)) != NULL)
+  {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    unlink(path);
+  }
+  if (d != NULL)
+    closedir(d);
+  rmdir(dir);
+}
+
+/*
+ * Returns: the number of files in dir
+ */
+static int count_files(const char *dir)
+{
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  int count = 0;
+
+  while (d != NULL && (ent = readdir(d)) != NULL)
+    if (ent->d_name[0] != '.')
+      count++;
+  if (d != NULL)
+    closedir(d);
+  return count;
+}
+
+/*
+ * Builds (y = x * 0.5) + (x / (x - 2)) ^ y
+ */
+static ExprTree build_codegen_tree()
+{
+  return ET_node(OP_ADD, ET_node(OP_ASSIGN, ET_symbol("y"), ET_node(OP_MUL, ET_symbol("x"), ET_value(0.5))),
+                 ET_node(OP_POWER, ET_node(OP_DIV, ET_symbol("x"), ET_node(OP_SUB, ET_symbol("x"), ET_value(2))),
+                         ET_symbol("y")));
+}
+
+/*
+ * Tests ET_emit_c and ET_compile
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_codegen()
+{
+  char dir[] = "/tmp/ew_codegen_XXXXXX";
+  ExprTree tree = build_codegen_tree();
+  ExprTree again = NULL;
+  CompiledExpr ce = NULL, cached = NULL;
+  CDict vars = CD_new();
+  char errmsg[256];
+  char *source = NULL;
+  size_t len = 0;
+  const double xs[] = {-3, 0, 1.5, 2, 7.25};
+
+  FILE *out = open_memstream(&source, &len);
+  test_assert(ET_emit_c(tree, "formula", out, errmsg, sizeof(errmsg)) == 2);
+  fclose(out);
+  test_assert(strstr(source, "double formula(double *vars)") != NULL);
+  test_assert(strstr(source, "formula_var_names[] = {\"y\", \"x\", 0}") != NULL);
+
+  test_assert(mkdtemp(dir) != NULL);
+  ce = ET_compile(tree, dir, errmsg, sizeof(errmsg));
+  test_assert(ce != NULL);
+  test_assert(CE_num_vars(ce) == 2);
+  test_assert(strcmp(CE_var_name(ce, 0), "y") == 0);
+  test_assert(strcmp(CE_var_name(ce, 1), "x") == 0);
+  test_assert(CE_var_name(ce, 2) == NULL);
+
+  for (int i = 0; i < sizeof(xs) / sizeof(xs[0]); i++)
+  {
+    double v[2] = {-1, xs[i]};
+
+    CD_store(vars, "x", xs[i]);
+    CD_store(vars, "y", -1);
+    double expected = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    double got = CE_evaluate(ce, v);
+
+    test_assert((isnan(expected) && isnan(got)) || expected == got);
+    test_assert(v[0] == CD_retrieve(vars, "y"));
+    test_assert(v[1] == xs[i]);
+  }
+
+  // an identical tree is loaded from the cache without compiling
+  again = build_codegen_tree();
+  test_assert(count_files(dir) == 2);
+  setenv("CC", "/nonexistent/cc", 1);
+  cached = ET_compile(again, dir, errmsg, sizeof(errmsg));
+  unsetenv("CC");
+  test_assert(cached != NULL);
+  test_assert(CE_hash(cached) == CE_hash(ce));
+  test_assert(count_files(dir) == 2);
+  ET_free(again);
+
+  // a different tree is not
+  again = ET_node(OP_ADD, ET_symbol("x"), ET_value(1));
+  setenv("CC", "/nonexistent/cc", 1);
+  test_assert(ET_compile(again, dir, errmsg, sizeof(errmsg)) == NULL);
+  unsetenv("CC");
+  test_assert(strncmp(errmsg, "Cannot run", 10) == 0);
+
+  // another tree's files planted under this tree's key are not trusted,
+  // whether both are foreign or just the shared object
+  char path[2][2][FILENAME_MAX];
+  CompiledExpr other = ET_compile(again, dir, errmsg, sizeof(errmsg));
+  test_assert(other != NULL);
+  for (int i = 0; i < 2; i++)
+  {
+    uint64_t hash = (i == 0) ? CE_hash(ce) : CE_hash(other);
+    snprintf(path[i][0], FILENAME_MAX, "%s/ew_%016llx.c", dir, (unsigned long long)hash);
+    snprintf(path[i][1], FILENAME_MAX, "%s/ew_%016llx.so", dir, (unsigned long long)hash);
+  }
+  CE_free(other);
+  CE_free(ce);
+  CE_free(cached);
+  ce = cached = NULL;
+
+  for (int planted = 0; planted < 2; planted++)
+  {
+    if (planted == 1)
+    {
+      other = ET_compile(again, dir, errmsg, sizeof(errmsg));
+      test_assert(other != NULL);
+      CE_free(other);
+    }
+    for (int f = planted; f < 2; f++)
+      test_assert(rename(path[1][f], path[0][f]) == 0);
+
+    setenv("CC", "/nonexistent/cc", 1);
+    test_assert(ET_compile(tree, dir, errmsg, sizeof(errmsg)) == NULL);
+    unsetenv("CC");
+    test_assert(strncmp(errmsg, "Cannot run", 10) == 0);
+
+    ce = ET_compile(tree, dir, errmsg, sizeof(errmsg));
+    test_assert(ce != NULL);
+    double v[2] = {-1, 7.25};
+    CD_store(vars, "x", 7.25);
+    CD_store(vars, "y", -1);
+    test_assert(CE_evaluate(ce, v) == ET_evaluate(tree, vars, errmsg, sizeof(errmsg)));
+    CE_free(ce);
+    ce = NULL;
+  }
+  ET_free(again);
+
+  // 2 = x
+  again = ET_node(OP_ASSIGN, ET_value(2), ET_symbol("x"));
+  test_assert(ET_compile(again, dir, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strcmp(errmsg, "Syntax error on token EQUAL") == 0);
+
+  ET_free(again);
+  ET_free(tree);
+  CE_free(ce);
+  CE_free(cached);
+  CD_free(vars);
+  free(source);
+  remove_dir(dir);
+  return 1;
+
+test_error:
+  unsetenv("CC");
+  ET_free(again);
+  ET_free(tree);
+  CE_free(ce);
+  CE_free(cached);
+  CD_free(vars);
+  free(source);
+  remove_dir(dir);
+  return 0;
+}
+
+/*
+ * Returns: the distance between a and b in units in the last place
+ */
+static int64_t ulp_distance(double a, double b)
+{
+  int64_t ia, ib;
+
+  memcpy(&ia, &a, sizeof(ia));
+  memcpy(&ib, &b, sizeof(ib));
+  ia = (ia < 0) ? INT64_MIN - ia : ia;
+  ib = (ib < 0) ? INT64_MIN - ib : ib;
+  return (ia > ib) ? ia - ib : ib - ia;
+}
+
+/*
+ * Returns: true if a and b are the same double, bit for bit
+ */
+static bool same_double(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+/*
+ * Tests the evaluation of OP_POWER with constant integral exponents
+ * and with the exponent 0.5
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_pow_constant()
+{
+  ExprTree tree = NULL;
+  ExprBatch batch = NULL;
+  CompiledExpr ce = NULL;
+  CDict vars = CD_new();
+  char errmsg[256];
+  char dir[] = "/tmp/ew_pow_XXXXXX";
+  const char *symbols[] = {"x"};
+  const double specials[] = {0.0, -0.0, 1, -1, INFINITY, -INFINITY, 1e-300, -3e300};
+  const int num_specials = sizeof(specials) / sizeof(specials[0]);
+  double xs[1000], out[1000];
+  const double *columns[] = {xs};
+
+  for (int i = 0; i < 1000; i++)
+    xs[i] = (i < num_specials) ? specials[i] : (rand() / (double)RAND_MAX - 0.5) * ((i % 2) ? 8 : 2000);
+
+  for (int n = -17; n <= 17; n++)
+  {
+    ExprTree exponent = (n < 0) ? ET_node(UNARY_NEGATE, ET_value(-n), NULL) : ET_value(n);
+
+    tree = ET_node(OP_POWER, ET_symbol("x"), exponent);
+    for (int i = 0; i < 1000; i++)
+    {
+      double expected = pow(xs[i], n);
+
+      CD_store(vars, "x", xs[i]);
+      double got = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+      if (i < num_specials || expected == 0 || isinf(expected))
+      {
+        test_assert(same_double(got, expected) || (isnan(got) && isnan(expected)));
+      }
+      else if (fabs(expected) > 1e-300 && fabs(expected) < 1e300)
+      {
+        test_assert(ulp_distance(got, expected) <= ((abs(n) > 1) ? abs(n) : 1));
+      }
+    }
+    ET_free(tree);
+  }
+
+  // NaN cannot be stored in vars, so take it as a literal base
+  tree = ET_node(OP_POWER, ET_value(NAN), ET_value(0));
+  test_assert(ET_evaluate(tree, vars, errmsg, sizeof(errmsg)) == 1);
+  ET_free(tree);
+  tree = ET_node(OP_POWER, ET_value(NAN), ET_value(-3));
+  test_assert(isnan(ET_evaluate(tree, vars, errmsg, sizeof(errmsg))));
+  ET_free(tree);
+
+  // x ^ 0.5
+  tree = ET_node(OP_POWER, ET_symbol("x"), ET_value(0.5));
+  for (int i = 0; i < 1000; i++)
+  {
+    double expected = pow(xs[i], 0.5);
+
+    CD_store(vars, "x", xs[i]);
+    double got = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    if (i < num_specials)
+    {
+      test_assert(same_double(got, expected) || (isnan(got) && isnan(expected)));
+    }
+    else
+    {
+      test_assert(ulp_distance(got, expected) <= 1 || (isnan(got) && isnan(expected)));
+    }
+  }
+  ET_free(tree);
+
+  // batch and compiled evaluation agree with ET_evaluate bit for bit:
+  // x^3 - 2 * x^-2 + x^0.5 / x^16
+  tree = ET_node(OP_ADD,
+                 ET_node(OP_SUB, ET_node(OP_POWER, ET_symbol("x"), ET_value(3)),
+                         ET_node(OP_MUL, ET_value(2),
+                                 ET_node(OP_POWER, ET_symbol("x"), ET_node(UNARY_NEGATE, ET_value(2), NULL)))),
+                 ET_node(OP_DIV, ET_node(OP_POWER, ET_symbol("x"), ET_value(0.5)),
+                         ET_node(OP_POWER, ET_symbol("x"), ET_value(16))));
+  batch = EB_compile(tree, NULL, symbols, 1, errmsg, sizeof(errmsg));
+  test_assert(batch != NULL);
+  EB_run(batch, columns, 1000, out, NULL);
+  test_assert(mkdtemp(dir) != NULL);
+  ce = ET_compile(tree, dir, errmsg, sizeof(errmsg));
+  test_assert(ce != NULL);
+
+  for (int i = 0; i < 1000; i++)
+  {
+    double v[1] = {xs[i]};
+
+    CD_store(vars, "x", xs[i]);
+    double expected = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    test_assert(same_double(out[i], expected) || (isnan(out[i]) && isnan(expected)));
+    double compiled = CE_evaluate(ce, v);
+    test_assert(same_double(compiled, expected) || (isnan(compiled) && isnan(expected)));
+  }
+
+  ET_free(tree);
+  EB_free(batch);
+  CE_free(ce);
+  CD_free(vars);
+  remove_dir(dir);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  EB_free(batch);
+  CE_free(ce);
+  CD_free(vars);
+  remove_dir(dir);
+  return 0;
+}
+
+/*
+ * Tests the reactive recalculation engine
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_reactive()
+{
+  CDict vars = CD_new();
+  Reactive rx = RX_new(vars);
+  ExprTree rejected = NULL;
+  char errmsg[128];
+  int total, subtotal, shipping, unrelated, ratio;
+
+  CD_store(vars, "price", 2);
+  CD_store(vars, "qty", 3);
+  CD_store(vars, "tax", 0.5);
+
+  // registered out of order: total reads what subtotal assigns
+  total = RX_register(rx, ET_node(OP_ASSIGN, ET_symbol("total"),
+                                  ET_node(OP_MUL, ET_symbol("subtotal"), ET_node(OP_ADD, ET_value(1), ET_symbol("tax")))),
+                      errmsg, sizeof(errmsg));
+  subtotal = RX_register(rx, ET_node(OP_ASSIGN, ET_symbol("subtotal"), ET_node(OP_MUL, ET_symbol("price"), ET_symbol("qty"))),
+                         errmsg, sizeof(errmsg));
+  shipping = RX_register(rx, ET_node(OP_ASSIGN, ET_symbol("shipping"), ET_node(OP_MUL, ET_symbol("qty"), ET_value(5))),
+                         errmsg, sizeof(errmsg));
+  unrelated = RX_register(rx, ET_node(OP_MUL, ET_symbol("price"), ET_value(10)), errmsg, sizeof(errmsg));
+  ratio = RX_register(rx, ET_node(OP_DIV, ET_symbol("total"), ET_node(OP_SUB, ET_symbol("qty"), ET_value(4))),
+                      errmsg, sizeof(errmsg));
+  test_assert(total == 0 && subtotal == 1 && shipping == 2 && unrelated == 3 && ratio == 4);
+  test_assert(RX_num_formulas(rx) == 5);
+
+  test_assert(RX_update(rx) == 5);
+  test_assert(RX_value(rx, total) == 9);
+  test_assert(CD_retrieve(vars, "total") == 9);
+  test_assert(RX_value(rx, ratio) == -9);
+  test_assert(RX_update(rx) == 0);
+
+  // only total, and ratio which reads it
+  CD_store(vars, "tax", 1);
+  test_assert(RX_update(rx) == 2);
+  test_assert(RX_value(rx, total) == 12);
+  test_assert(RX_value(rx, ratio) == -12);
+
+  // storing the value a variable already holds changes nothing
+  CD_store(vars, "tax", 1);
+  test_assert(RX_update(rx) == 0);
+
+  // an assignment made by evaluating a tree is noticed too
+  rejected = ET_node(OP_ASSIGN, ET_symbol("qty"), ET_value(4));
+  ET_evaluate(rejected, vars, errmsg, sizeof(errmsg));
+  ET_free(rejected);
+  rejected = NULL;
+  test_assert(RX_update(rx) == 4);
+  test_assert(RX_value(rx, subtotal) == 8);
+  test_assert(RX_value(rx, shipping) == 20);
+  test_assert(RX_error(rx, ratio) == ET_ERR_DIV_BY_ZERO);
+  test_assert(isnan(RX_value(rx, ratio)));
+
+  // price and qty change, but subtotal does not, so total is not redone
+  CD_store(vars, "price", 4);
+  CD_store(vars, "qty", 2);
+  test_assert(RX_update(rx) == 4);
+  test_assert(RX_value(rx, unrelated) == 40);
+  test_assert(RX_error(rx, ratio) == ET_OK);
+  test_assert(RX_value(rx, ratio) == -8);
+
+  // tax = total * 0.1 would close a cycle
+  rejected = ET_node(OP_ASSIGN, ET_symbol("tax"), ET_node(OP_MUL, ET_symbol("total"), ET_value(0.1)));
+  test_assert(RX_register(rx, rejected, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "Circular reference") == 0);
+  ET_free(rejected);
+
+  // qty = qty + 1
+  rejected = ET_node(OP_ASSIGN, ET_symbol("qty"), ET_node(OP_ADD, ET_symbol("qty"), ET_value(1)));
+  test_assert(RX_register(rx, rejected, errmsg, sizeof(errmsg)) == -1);
+  ET_free(rejected);
+
+  rejected = ET_node(OP_ASSIGN, ET_symbol("subtotal"), ET_value(1));
+  test_assert(RX_register(rx, rejected, errmsg, sizeof(errmsg)) == -1);
+  test_assert(strcmp(errmsg, "subtotal is already assigned by formula 1") == 0);
+  ET_free(rejected);
+  rejected = NULL;
+
+  // the rejected formulas left the engine as it was
+  test_assert(RX_num_formulas(rx) == 5);
+  CD_store(vars, "tax", 0);
+  test_assert(RX_update(rx) == 2);
+  test_assert(RX_value(rx, total) == 8);
+
+  RX_free(rx);
+  CD_free(vars);
+  return 1;
+
+test_error:
+  ET_free(rejected);
+  RX_free(rx);
+  CD_free(vars);
+  return 0;
+}
+
+/*
+ * Tests the memoizing evaluation cache
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_eval_cache()
+{
+  EvalCache cache = EC_new(2);
+  CDict vars = CD_new();
+  CDict other = CD_new();
+  char errmsg[128] = "";
+  EvalCacheStats stats;
+
+  // (x * y) + 1, built twice
+  ExprTree a = ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("y")), ET_value(1));
+  ExprTree a2 = ET_node(OP_ADD, ET_node(OP_MUL, ET_symbol("x"), ET_symbol("y")), ET_value(1));
+  ExprTree b = ET_node(OP_SUB, ET_symbol("x"), ET_value(1));
+  ExprTree c = ET_node(OP_POWER, ET_symbol("y"), ET_value(2));
+  ExprTree assign = ET_node(OP_ASSIGN, ET_symbol("y"), ET_value(10));
+  ExprTree undefined = ET_node(OP_MUL, ET_symbol("z"), ET_value(2));
+
+  CD_store(vars, "x", 2);
+  CD_store(vars, "y", 3);
+  CD_store(other, "x", 1);
+  CD_store(other, "y", 1);
+
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 7);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 7);
+  test_assert(EC_evaluate(cache, a2, vars, errmsg, sizeof(errmsg)) == 7);
+  stats = EC_stats(cache);
+  test_assert(stats.hits == 2 && stats.misses == 1);
+
+  // a change to a variable that a reads makes its result stale
+  CD_store(vars, "y", 4);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 9);
+  test_assert(EC_size(cache) == 1);
+
+  // as does an assignment, which is never cached itself
+  test_assert(EC_evaluate(cache, assign, vars, errmsg, sizeof(errmsg)) == 10);
+  test_assert(EC_evaluate(cache, assign, vars, errmsg, sizeof(errmsg)) == 10);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 21);
+  stats = EC_stats(cache);
+  test_assert(stats.bypasses == 2 && stats.misses == 3 && stats.hits == 2);
+
+  // the same tree against another dictionary
+  test_assert(EC_evaluate(cache, a, other, errmsg, sizeof(errmsg)) == 2);
+  test_assert(EC_stats(cache).misses == 4);
+
+  // failures are reported as by ET_evaluate, and not cached
+  test_assert(isnan(EC_evaluate(cache, undefined, vars, errmsg, sizeof(errmsg))));
+  test_assert(strcmp(errmsg, "Undefined variable: z") == 0);
+  test_assert(EC_size(cache) == 2);
+
+  // a changes, but it does not read z: still current
+  CD_store(vars, "z", 1);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 21);
+  test_assert(EC_stats(cache).hits == 3);
+
+  // with a and (a, other) cached, touching a and adding b evicts (a, other)
+  test_assert(EC_evaluate(cache, b, vars, errmsg, sizeof(errmsg)) == 1);
+  test_assert(EC_stats(cache).evictions == 1);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 21);
+  test_assert(EC_evaluate(cache, c, vars, errmsg, sizeof(errmsg)) == 100);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 21);
+  stats = EC_stats(cache);
+  test_assert(stats.evictions == 2 && stats.hits == 5);
+  test_assert(EC_size(cache) == 2);
+
+  EC_clear(cache);
+  test_assert(EC_size(cache) == 0);
+  test_assert(EC_evaluate(cache, a, vars, errmsg, sizeof(errmsg)) == 21);
+  test_assert(EC_stats(cache).hits == 5);
+
+  ET_free(a);
+  ET_free(a2);
+  ET_free(b);
+  ET_free(c);
+  ET_free(assign);
+  ET_free(undefined);
+  EC_free(cache);
+  CD_free(vars);
+  CD_free(other);
+  return 1;
+
+test_error:
+  ET_free(a);
+  ET_free(a2);
+  ET_free(b);
+  ET_free(c);
+  ET_free(assign);
+  ET_free(undefined);
+  EC_free(cache);
+  CD_free(vars);
+  CD_free(other);
+  return 0;
+}
+
+/*
+ * Write len bytes of data to a new file at path
+ *
+ * Returns: true on success
+ */
+static bool write_file(const char *path, const void *data, size_t len)
+{
+  FILE *f = fopen(path, "wb");
+
+  if (f == NULL)
+    return false;
+
+  bool written = (fwrite(data, 1, len, f) == len);
+  return fclose(f) == 0 && written;
+}
+
+/*
+ * Tests ET_save and ET_load
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_save_load()
+{
+  char dir[] = "/tmp/ew_image_XXXXXX";
+  char path[64], bad_path[64];
+  char errmsg[128], expected[128], actual[128];
+  ExprTree trees[4] = {build_codegen_tree(),
+                       ET_node(OP_POWER, ET_symbol("x"), ET_node(UNARY_NEGATE, ET_value(2), NULL)),
+                       ET_value(-0.0), ET_symbol("a_symbol_of_the_longest_length1")};
+  ExprImage image = NULL;
+  CDict vars = CD_new();
+  CDict loaded_vars = CD_new();
+  unsigned char buf[1024];
+  size_t size = 0;
+
+  test_assert(mkdtemp(dir) != NULL);
+  snprintf(path, sizeof(path), "%s/trees.ewx", dir);
+  snprintf(bad_path, sizeof(bad_path), "%s/bad.ewx", dir);
+
+  test_assert(ET_save(trees, 4, path, errmsg, sizeof(errmsg)));
+  image = ET_load(path, errmsg, sizeof(errmsg));
+  test_assert(image != NULL);
+  test_assert(ET_image_count(image) == 4);
+
+  CD_store(vars, "x", 3);
+  CD_store(loaded_vars, "x", 3);
+  for (int t = 0; t < 4; t++)
+  {
+    ExprTree loaded = ET_image_tree(image, t);
+
+    ET_tree2string(trees[t], expected, sizeof(expected));
+    ET_tree2string(loaded, actual, sizeof(actual));
+    test_assert(strcmp(expected, actual) == 0);
+    test_assert(ET_count(loaded) == ET_count(trees[t]));
+
+    if (t != 3)
+      test_assert(same_double(ET_evaluate(trees[t], vars, errmsg, sizeof(errmsg)),
+                              ET_evaluate(loaded, loaded_vars, errmsg, sizeof(errmsg))));
+  }
+  test_assert(CD_retrieve(loaded_vars, "y") == 1.5);
+
+  // x and y are shared by the first two trees, so the strings are
+  // "y", "x" and the long name
+  FILE *f = fopen(path, "rb");
+  test_assert(f != NULL);
+  size = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  int num_nodes = ET_count(trees[0]) + ET_count(trees[1]) + 2;
+  test_assert(size == 32 + 4 * sizeof(uint32_t) + num_nodes * 16 + 4 + 31 + 1);
+  ET_image_free(image);
+  image = NULL;
+
+  // no trees at all
+  test_assert(ET_save(NULL, 0, bad_path, errmsg, sizeof(errmsg)));
+  image = ET_load(bad_path, errmsg, sizeof(errmsg));
+  test_assert(image != NULL && ET_image_count(image) == 0);
+  ET_image_free(image);
+  image = NULL;
+
+  test_assert(ET_load("/nonexistent/trees.ewx", errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strncmp(errmsg, "Cannot open", 11) == 0);
+
+  test_assert(write_file(bad_path, buf, 0));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "is not an expression file") != NULL);
+
+  test_assert(write_file(bad_path, buf, size - 1));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "is truncated or corrupt") != NULL);
+
+  // the root of the first tree given the same node for both children
+  uint32_t root, *node, right;
+  memcpy(&root, buf + 32, sizeof(root));
+  node = (uint32_t *)(buf + 32 + 4 * sizeof(uint32_t) + 16 * root);
+  right = node[3];
+  node[3] = node[2];
+  test_assert(write_file(bad_path, buf, size));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "is truncated or corrupt") != NULL);
+  node[3] = right;
+
+  // the root of the first tree made its own child
+  node[2] = root;
+  test_assert(write_file(bad_path, buf, size));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "is truncated or corrupt") != NULL);
+
+  // a later version
+  buf[4]++;
+  test_assert(write_file(bad_path, buf, size));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "unsupported version") != NULL);
+
+  buf[0] = 'X';
+  test_assert(write_file(bad_path, buf, size));
+  test_assert(ET_load(bad_path, errmsg, sizeof(errmsg)) == NULL);
+  test_assert(strstr(errmsg, "is not an expression file") != NULL);
+
+  remove_dir(dir);
+  for (int t = 0; t < 4; t++)
+    ET_free(trees[t]);
+  CD_free(vars);
+  CD_free(loaded_vars);
+  return 1;
+
+test_error:
+  remove_dir(dir);
+  ET_image_free(image);
+  for (int t = 0; t < 4; t++)
+    ET_free(trees[t]);
+  CD_free(vars);
+  CD_free(loaded_vars);
+  return 0;
+}
+
+/*
+ * Tokenize and parse an expression
+ *
+ * Returns: The tree, or NULL if the expression is not valid
+ */
+static ExprTree parse_expr(const char *text)
+{
+  char errmsg[128];
+  CList tokens = TOK_tokenize_input(text, errmsg, sizeof(errmsg));
+  ExprTree tree = (tokens == NULL) ? NULL : Parse(tokens, errmsg, sizeof(errmsg));
+
+  CL_free(tokens);
+  return tree;
+}
+
+/*
+ * Returns: true if a and b agree to within a relative error of 1e-12
+ */
+static bool close_to(double a, double b)
+{
+  return fabs(a - b) <= 1e-12 * fmax(1, fmax(fabs(a), fabs(b)));
+}
+
+/*
+ * Tests forward-mode differentiation with ET_derivatives
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_derivatives()
+{
+  const char *xy[] = {"x", "y", "q"};
+  const char *six[] = {"a", "b", "c", "d", "e", "f"};
+  CDict vars = CD_new();
+  ExprTree tree = NULL;
+  ETError err;
+  double value, d[6];
+  double x = 1.5, y = 2.5;
+  char errmsg[128];
+
+  CD_store(vars, "x", x);
+  CD_store(vars, "y", y);
+
+  tree = parse_expr("x*y + x/y - x^3 + y^0.5 + 2^x + x^y");
+  test_assert(tree != NULL);
+  d[2] = -1;
+  test_assert(ET_derivatives(tree, vars, xy, 3, &value, d, &err) == ET_OK);
+  test_assert(same_double(value, ET_evaluate(tree, vars, errmsg, sizeof(errmsg))));
+  test_assert(close_to(d[0], y + 1 / y - 3 * x * x + pow(2, x) * log(2) + y * pow(x, y - 1)));
+  test_assert(close_to(d[1], x - x / (y * y) + 0.5 / sqrt(y) + pow(x, y) * log(x)));
+  test_assert(d[2] == 0);
+  ET_free(tree);
+
+  // a negative integral exponent, and a base of zero
+  tree = parse_expr("x^-2 + (y-y)^2");
+  test_assert(ET_derivatives(tree, vars, xy, 2, &value, d, NULL) == ET_OK);
+  test_assert(close_to(d[0], -2 / (x * x * x)));
+  test_assert(d[1] == 0);
+  ET_free(tree);
+
+  // a NaN power does not spill into a derivative it does not affect
+  tree = parse_expr("(x - 2.5)^2.5 + y");
+  test_assert(ET_derivatives(tree, vars, xy, 2, &value, d, NULL) == ET_OK);
+  test_assert(isnan(value) && isnan(d[0]) && d[1] == 1);
+  ET_free(tree);
+
+  // t carries the derivative of what was assigned to it
+  tree = parse_expr("(t = x*y) + t*t");
+  test_assert(ET_derivatives(tree, vars, xy, 2, &value, d, NULL) == ET_OK);
+  test_assert(value == x * y + x * y * x * y);
+  test_assert(CD_retrieve(vars, "t") == x * y);
+  test_assert(close_to(d[0], y + 2 * x * y * y));
+  test_assert(close_to(d[1], x + 2 * x * y * x));
+  ET_free(tree);
+
+  // more symbols than fit in one block of lanes
+  for (int i = 0; i < 6; i++)
+    CD_store(vars, (char *)six[i], i + 2);
+  tree = parse_expr("a*b*c*d*e*f");
+  test_assert(ET_derivatives(tree, vars, six, 6, &value, d, NULL) == ET_OK);
+  test_assert(value == 5040);
+  for (int i = 0; i < 6; i++)
+    test_assert(d[i] == 5040 / (i + 2));
+  ET_free(tree);
+
+  // errors leave the results untouched
+  value = d[0] = 42;
+  tree = parse_expr("x / (y - y)");
+  test_assert(ET_derivatives(tree, vars, xy, 2, &value, d, &err) == ET_ERR_DIV_BY_ZERO);
+  test_assert(err.node == tree && value == 42 && d[0] == 42);
+  ET_free(tree);
+
+  tree = parse_expr("2 * q");
+  test_assert(ET_derivatives(tree, vars, xy, 2, &value, d, &err) == ET_ERR_UNDEFINED);
+  ET_error_message(&err, errmsg, sizeof(errmsg));
+  test_assert(strcmp(errmsg, "Undefined variable: q") == 0);
+  ET_free(tree);
+
+  test_assert(ET_derivatives(NULL, vars, xy, 2, &value, d, NULL) == ET_OK);
+  test_assert(value == 0 && d[0] == 0 && d[1] == 0);
+
+  CD_free(vars);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  CD_free(vars);
+  return 0;
+}
+
+/*
+ * Tests reverse-mode differentiation with AD_gradient
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_gradient()
+{
+  const int n = 300;
+  const char *xy[] = {"x", "y", "q", "t"};
+  const char *exprs[] = {"x*y + x/y - x^3 + y^0.5 + 2^x + x^y", "x^-2 + (y-y)^2", "(t = x*y) + t*t*x",
+                         "-(x - y) / (x * x)", "y = 3", "x^x", "x^(2*x)", "(x*y)^(x+y)"};
+  const char *names[300];
+  char name_buf[300][8];
+  ADTape tape = AD_tape_new();
+  CDict vars = CD_new();
+  CDict fwd_vars = CD_new();
+  ExprTree tree = NULL;
+  ETError err;
+  double value, fwd_value, d[300], fwd_d[4];
+  char errmsg[128];
+  char *text = NULL;
+
+  // agrees with forward mode, including powers whose base and exponent
+  // share a variable
+  for (int e = 0; e < 8; e++)
+  {
+    CD_store(vars, "x", 1.5);
+    CD_store(vars, "y", 2.5);
+    CD_store(fwd_vars, "x", 1.5);
+    CD_store(fwd_vars, "y", 2.5);
+    tree = parse_expr(exprs[e]);
+    test_assert(tree != NULL);
+    test_assert(AD_gradient(tape, tree, vars, xy, 4, &value, d, NULL) == ET_OK);
+    test_assert(ET_derivatives(tree, fwd_vars, xy, 4, &fwd_value, fwd_d, NULL) == ET_OK);
+    test_assert(same_double(value, fwd_value));
+    for (int k = 0; k < 4; k++)
+      test_assert(close_to(d[k], fwd_d[k]));
+    test_assert(CD_retrieve(vars, "y") == CD_retrieve(fwd_vars, "y"));
+    ET_free(tree);
+    tree = NULL;
+  }
+
+  // d/dx x^x = x^x * (log(x) + 1), from both terms of the power rule
+  CD_store(fwd_vars, "x", 2);
+  tree = parse_expr("x^x");
+  test_assert(tree != NULL);
+  test_assert(ET_derivatives(tree, fwd_vars, xy, 1, &fwd_value, fwd_d, NULL) == ET_OK);
+  test_assert(close_to(fwd_d[0], 4 * (log(2) + 1)));
+  ET_free(tree);
+  tree = NULL;
+
+  // at a base of 0, and where a zero derivative meets an infinite
+  // partial, both modes give the same finite values
+  const char *at_zero[] = {"x^y", "x^(x*y)", "(x*0)^y"};
+  for (int e = 0; e < 3; e++)
+  {
+    CD_store(vars, "x", 0);
+    CD_store(vars, "y", 0.5);
+    CD_store(fwd_vars, "x", 0);
+    CD_store(fwd_vars, "y", 0.5);
+    tree = parse_expr(at_zero[e]);
+    test_assert(tree != NULL);
+    test_assert(AD_gradient(tape, tree, vars, xy, 2, &value, d, NULL) == ET_OK);
+    test_assert(ET_derivatives(tree, fwd_vars, xy, 2, &fwd_value, fwd_d, NULL) == ET_OK);
+    test_assert(same_double(value, fwd_value));
+    test_assert(d[1] == 0 && fwd_d[1] == 0);
+    test_assert(same_double(d[0], fwd_d[0]));
+    ET_free(tree);
+    tree = NULL;
+  }
+
+  // one sweep gives every partial of x0*x1 + x1*x2 + ... + x298*x299
+  text = malloc(16 * n);
+  test_assert(text != NULL);
+  text[0] = '\0';
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(name_buf[i], sizeof(name_buf[i]), "x%d", i);
+    names[i] = name_buf[i];
+    CD_store(vars, name_buf[i], i);
+    if (i > 0)
+      sprintf(text + strlen(text), "%sx%d*x%d", (i > 1) ? "+" : "", i - 1, i);
+  }
+  tree = parse_expr(text);
+  test_assert(tree != NULL);
+  test_assert(AD_gradient(tape, tree, vars, names, n, &value, d, NULL) == ET_OK);
+  test_assert(value == ET_evaluate(tree, vars, errmsg, sizeof(errmsg)));
+  for (int i = 0; i < n; i++)
+    test_assert(d[i] == ((i > 0) ? i - 1 : 0) + ((i < n - 1) ? i + 1 : 0));
+
+  // the tape is reused as is
+  int size = AD_tape_size(tape);
+  test_assert(size == 3 * (n - 1) - 1 + n - 1);
+  CD_store(vars, "x0", 7);
+  test_assert(AD_gradient(tape, tree, vars, names, n, &value, d, NULL) == ET_OK);
+  test_assert(AD_tape_size(tape) == size && d[1] == 7 + 2);
+  ET_free(tree);
+  tree = NULL;
+
+  // errors leave the results untouched
+  value = d[0] = 42;
+  tree = parse_expr("x / (y - y)");
+  test_assert(AD_gradient(tape, tree, vars, xy, 2, &value, d, &err) == ET_ERR_DIV_BY_ZERO);
+  test_assert(err.node == tree && value == 42 && d[0] == 42);
+  ET_free(tree);
+
+  tree = parse_expr("2 * q");
+  test_assert(AD_gradient(tape, tree, vars, xy, 2, &value, d, &err) == ET_ERR_UNDEFINED);
+  ET_error_message(&err, errmsg, sizeof(errmsg));
+  test_assert(strcmp(errmsg, "Undefined variable: q") == 0);
+  ET_free(tree);
+
+  // a constant records nothing
+  tree = parse_expr("2 ^ 3");
+  test_assert(AD_gradient(tape, tree, vars, xy, 2, &value, d, NULL) == ET_OK);
+  test_assert(value == 8 && d[0] == 0 && d[1] == 0 && AD_tape_size(tape) == 0);
+  ET_free(tree);
+
+  free(text);
+  AD_tape_free(tape);
+  CD_free(vars);
+  CD_free(fwd_vars);
+  return 1;
+
+test_error:
+  free(text);
+  ET_free(tree);
+  AD_tape_free(tape);
+  CD_free(vars);
+  CD_free(fwd_vars);
+  return 0;
+}
+
+/*
+ * Build a random tree of at most the given depth, drawing on a small
+ * set of operators, symbols and constants so that many trees repeat
+ *
+ * Parameters:
+ *   state    The state of the random number generator
+ *   depth    The greatest depth of the tree
+ *
+ * Returns: The tree
+ */
+static ExprTree random_tree(uint64_t *state, int depth)
+{
+  static const char *symbols[] = {"a", "b", "c", "x", "y"};
+
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  unsigned int r = *state >> 33;
+
+  if (depth <= 1 || r % 8 < 3)
+  {
+    if (r & 8)
+      return ET_symbol(symbols[(r >> 4) % 5]);
+    return ET_value((double)((r >> 4) % 12) / 4 - 1);
+  }
+
+  ExprNodeType op = OP_ADD + (r >> 4) % 6;
+
+  if ((r >> 8) % 8 == 0)
+    return ET_node(UNARY_NEGATE, random_tree(state, depth - 1), NULL);
+
+  ExprTree left = random_tree(state, depth - 1);
+  return ET_node(op, left, random_tree(state, depth - 1));
+}
+
+/*
+ * qsort comparison for the hashes of trees
+ */
+static int compare_hashed(const void *a, const void *b)
+{
+  uint64_t ha = ET_hash(*(const ExprTree *)a), hb = ET_hash(*(const ExprTree *)b);
+
+  return (ha > hb) - (ha < hb);
+}
+
+/*
+ * Tests ET_hash and ET_equal
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_hash_equal()
+{
+  const int num_trees = 100000;
+  const int num_buckets = 1024;
+  ExprTree *trees = calloc(num_trees, sizeof(ExprTree));
+  ExprTree a = ET_node(OP_ADD, ET_symbol("x"), ET_value(1));
+  ExprTree b = parse_expr("x + 1");
+  ExprTree c = NULL, d = NULL;
+  int low[1024] = {0}, high[1024] = {0};
+  int distinct = 0, collisions = 0;
+  uint64_t state = 17;
+
+  test_assert(trees != NULL && b != NULL);
+
+  // the same structure, however it is built, and in every run
+  test_assert(ET_equal(a, b) && ET_hash(a) == ET_hash(b));
+  test_assert(ET_hash(a) == 0xb3e6198493823241ULL);
+  test_assert(ET_hash(NULL) == 0 && ET_equal(NULL, NULL) && !ET_equal(a, NULL));
+  ET_free(b);
+
+  // near misses
+  const char *pairs[][2] = {{"x + y", "y + x"}, {"x - y", "y - x"}, {"(a + b) + c", "a + (b + c)"},
+                            {"x ^ 2", "x ^ 2.0000000001"}, {"-x", "x"}, {"-(-x)", "x"},
+                            {"x = 1", "x + 1"}, {"x1", "x"}};
+  for (int p = 0; p < 8; p++)
+  {
+    b = parse_expr(pairs[p][0]);
+    c = parse_expr(pairs[p][1]);
+    test_assert(b != NULL && c != NULL);
+    test_assert(!ET_equal(b, c) && ET_hash(b) != ET_hash(c));
+    ET_free(b);
+    ET_free(c);
+    b = c = NULL;
+  }
+
+  c = ET_value(0);
+  d = ET_value(-0.0);
+  test_assert(!ET_equal(c, d) && ET_hash(c) != ET_hash(d));
+
+  // across a large corpus of random trees, trees with the same hash
+  // are equal, and the hashes spread evenly over both ends of the word
+  for (int t = 0; t < num_trees; t++)
+    trees[t] = random_tree(&state, 3 + t % 6);
+  qsort(trees, num_trees, sizeof(ExprTree), compare_hashed);
+
+  for (int t = 0; t < num_trees; t++)
+  {
+    if (t > 0 && ET_hash(trees[t]) == ET_hash(trees[t - 1]))
+    {
+      if (!ET_equal(trees[t], trees[t - 1]))
+        collisions++;
+      continue;
+    }
+    distinct++;
+    low[ET_hash(trees[t]) % num_buckets]++;
+    high[ET_hash(trees[t]) >> 54]++;
+  }
+  test_assert(collisions == 0);
+  test_assert(distinct > num_trees / 2);
+
+  double expected = (double)distinct / num_buckets;
+  for (int k = 0; k < num_buckets; k++)
+  {
+    test_assert(fabs(low[k] - expected) < 6 * sqrt(expected));
+    test_assert(fabs(high[k] - expected) < 6 * sqrt(expected));
+  }
+
+  for (int t = 0; t < num_trees; t++)
+    ET_free(trees[t]);
+  free(trees);
+  ET_free(a);
+  ET_free(c);
+  ET_free(d);
+  return 1;
+
+test_error:
+  for (int t = 0; trees != NULL && t < num_trees; t++)
+    ET_free(trees[t]);
+  free(trees);
+  ET_free(a);
+  ET_free(b);
+  ET_free(c);
+  ET_free(d);
+  return 0;
+}
+
+/*
+ * Tests ET_rebalance
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_rebalance()
+{
+  const char *cases[][2] = {
+      {"a + b + c", "(a + b) + c"},
+      {"a + (b + c)", "a + (b + c)"},
+      {"a + b + c + d", "(a + b) + (c + d)"},
+      {"a * b * c * d * e", "((a * b) * c) * (d * e)"},
+      {"a + (b + c) + (d + e)", "((a + b) + c) + (d + e)"},
+      {"a - b - c - d", "a - b - c - d"},
+      {"(a*b*c*d + 1) ^ (x + y + x + y)", "(((a * b) * (c * d)) + 1) ^ ((x + y) + (x + y))"},
+      {"a * b + c * d + e * f + x * y", "((a * b) + (c * d)) + ((e * f) + (x * y))"},
+      {"(t = 2) * t * t * t * t", "((t = 2) * t) * t * (t * t)"},
+  };
+  CDict vars = CD_new();
+  ExprTree tree = NULL, expected = NULL;
+  char errmsg[128];
+  double before, after;
+
+  CD_store(vars, "a", 3);
+  CD_store(vars, "b", 5);
+  CD_store(vars, "c", 7);
+  CD_store(vars, "d", 11);
+  CD_store(vars, "e", 13);
+  CD_store(vars, "f", 17);
+  CD_store(vars, "x", 1.5);
+  CD_store(vars, "y", 2.5);
+
+  for (int i = 0; i < 9; i++)
+  {
+    tree = parse_expr(cases[i][0]);
+    expected = parse_expr(cases[i][1]);
+    test_assert(tree != NULL && expected != NULL);
+    before = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    tree = ET_rebalance(tree);
+    after = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+    test_assert(ET_equal(tree, expected));
+    test_assert(before == after);
+    ET_free(tree);
+    ET_free(expected);
+    tree = expected = NULL;
+  }
+
+  // a long left-deep sum becomes shallow, and no less accurate
+  const int n = 2000;
+  tree = ET_value(0.1);
+  for (int k = 1; k < n; k++)
+    tree = ET_node(OP_ADD, tree, (k % 100 == 0) ? ET_symbol("x") : ET_value(0.1));
+  test_assert(ET_depth(tree) == n);
+  before = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  tree = ET_rebalance(tree);
+  after = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  test_assert(ET_depth(tree) == 12 && ET_count(tree) == 2 * n - 1);
+  double exact = (n - n / 100 + 1) * 0.1L + (n / 100 - 1) * 1.5L;
+  test_assert(fabs(after - exact) <= fabs(before - exact));
+  test_assert(fabs(after - exact) < 1e-12 * exact);
+  ET_free(tree);
+
+  // a spine whose right children are themselves small sums, so that
+  // the chain has many more nodes than the spine is long
+  tree = ET_symbol("a");
+  for (int k = 0; k < 9; k++)
+    tree = ET_node(OP_ADD, tree,
+                   ET_node(OP_ADD, ET_node(OP_ADD, ET_symbol("a"), ET_symbol("b")),
+                           ET_node(OP_ADD, ET_symbol("c"), ET_symbol("d"))));
+  before = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  tree = ET_rebalance(tree);
+  after = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
+  test_assert(before == after && after == 3 + 9 * 26);
+  test_assert(ET_count(tree) == 73 && ET_depth(tree) == 7);
+  ET_free(tree);
+  tree = NULL;
+
+  test_assert(ET_rebalance(NULL) == NULL);
+
+  CD_free(vars);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  ET_free(expected);
+  CD_free(vars);
+  return 0;
+}
+
+struct cdict_tally
+{
+  int count;
+  double sum;
+};
+
+static void tally_entry(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  struct cdict_tally *t = (struct cdict_tally *)cb_data;
+
+  t->count++;
+  t->sum += value;
+}
+
+/*
+ * Tests CDict with enough keys to fill many groups of control bytes,
+ * interleaving deletes and reinserts so that probes run over deleted
+ * slots
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_cdict()
+{
+  const int n = 20000;
+  CDict dict = CD_new();
+  CDictCell first;
+  char key[32];
+  struct cdict_tally tally = {0, 0};
+
+  test_assert(dict != NULL);
+  CD_store(dict, "", 1);
+  CD_store(dict, "abcdefghijklmnopqrstuvwxyz_0123", 2);
+  test_assert(CD_retrieve(dict, "") == 1);
+  test_assert(CD_retrieve(dict, "abcdefghijklmnopqrstuvwxyz_0123") == 2);
+  test_assert(!CD_contains(dict, "abcdefghijklmnopqrstuvwxyz_012"));
+  CD_delete(dict, "");
+  CD_delete(dict, "abcdefghijklmnopqrstuvwxyz_0123");
+  test_assert(CD_size(dict) == 0);
+
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    CD_store(dict, key, i);
+    if (i == 0)
+      test_assert(CD_find_cell(dict, key, &first));
+  }
+
+  unsigned int capacity = CD_capacity(dict);
+  test_assert(CD_size(dict) == n);
+  test_assert((capacity & (capacity - 1)) == 0);
+  test_assert(CD_load_factor(dict) <= 0.875);
+  test_assert(CD_cell_load(dict, first) == 0);
+
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    test_assert(CD_retrieve(dict, key) == i);
+    snprintf(key, sizeof(key), "w%d", i);
+    test_assert(!CD_contains(dict, key));
+  }
+
+  // delete every third key, then put most of them back with new values
+  for (int i = 0; i < n; i += 3)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    CD_delete(dict, key);
+  }
+  test_assert(CD_size(dict) == n - (n + 2) / 3);
+  test_assert(CD_check_invariants(dict));
+  test_assert(!CD_cell_valid(dict, first));
+
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    test_assert(CD_contains(dict, key) == (i % 3 != 0));
+  }
+
+  for (int i = 0; i < n; i += 3)
+  {
+    if (i % 2 == 0)
+    {
+      snprintf(key, sizeof(key), "v%d", i);
+      CD_store(dict, key, -i);
+    }
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    double value = CD_retrieve(dict, key);
+
+    double expected = (i % 3 != 0) ? i : (i % 2 == 0) ? -i : NAN;
+
+    test_assert(value == expected || (isnan(value) && isnan(expected)));
+  }
+
+  CD_foreach(dict, tally_entry, &tally);
+  test_assert(tally.count == CD_size(dict));
+  test_assert(CD_capacity(dict) == capacity);
+
+  double sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += (i % 3 != 0) ? i : (i % 2 == 0) ? -i : 0;
+  test_assert(tally.sum == sum);
+
+  // deleting another third leaves most of the stored key bytes dead, so
+  // the keys are compacted; every remaining key must survive it
+  for (int i = 1; i < n; i += 3)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    CD_delete(dict, key);
+  }
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "v%d", i);
+    double value = CD_retrieve(dict, key);
+    double expected = (i % 3 == 2) ? i : (i % 3 == 0 && i % 2 == 0) ? -i : NAN;
+
+    test_assert(value == expected || (isnan(value) && isnan(expected)));
+  }
+  tally = (struct cdict_tally){0, 0};
+  CD_foreach(dict, tally_entry, &tally);
+  test_assert(tally.count == CD_size(dict));
+  test_assert(CD_check_invariants(dict));
+  CD_free(dict);
+
+  // under churn, a working set of constant size keeps a constant
+  // capacity, since deleted keys leave nothing behind
+  dict = CD_new();
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "t%d", i);
+    CD_store(dict, key, i);
+  }
+  capacity = CD_capacity(dict);
+  for (int i = 1000; i < 200000; i++)
+  {
+    snprintf(key, sizeof(key), "t%d", i - 1000);
+    CD_delete(dict, key);
+    snprintf(key, sizeof(key), "t%d", i);
+    CD_store(dict, key, i);
+    if (i % 20000 == 0)
+      test_assert(CD_size(dict) == 1000 && CD_check_invariants(dict));
+  }
+  test_assert(CD_capacity(dict) == capacity);
+  test_assert(CD_load_factor(dict) == 1000.0 / capacity);
+  for (int i = 199000; i < 200000; i++)
+  {
+    snprintf(key, sizeof(key), "t%d", i);
+    test_assert(CD_retrieve(dict, key) == i);
+  }
+
+  CD_free(dict);
+  return 1;
+
+test_error:
+  CD_free(dict);
+  return 0;
+}
+
+/*
+ * Returns: The chi-squared statistic of counts in num_buckets buckets
+ *   holding num_keys keys in all
+ */
+static double chi_squared(const int *counts, int num_buckets, int num_keys)
+{
+  double expected = (double)num_keys / num_buckets;
+  double chi2 = 0;
+
+  for (int b = 0; b < num_buckets; b++)
+    chi2 += (counts[b] - expected) * (counts[b] - expected) / expected;
+
+  return chi2;
+}
+
+/*
+ * Tests that CD_hash spreads short identifier-like keys evenly over
+ * both the slot bits and the control-byte bits, and that changing one
+ * character changes about half the bits of the hash
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_cdict_hash()
+{
+  const char *formats[] = {"x%d", "var_%d", "%c", "t%dx"};
+  const int num_keys = 100000;
+  const int slot_buckets = 1024;
+  const int h2_buckets = 128;
+  int slots[1024], h2[128];
+  char key[32];
+
+  test_assert(CD_hash("") != CD_hash("a"));
+  test_assert(CD_hash("abc") != CD_hash("abc_"));
+  test_assert(CD_hash("abcdefgh") != CD_hash("abcdefgh_"));
+
+  for (int f = 0; f < 4; f++)
+  {
+    int n = (f == 2) ? 26 * 26 * 26 : num_keys;
+
+    memset(slots, 0, sizeof(slots));
+    memset(h2, 0, sizeof(h2));
+    for (int i = 0; i < n; i++)
+    {
+      if (f == 2)
+        snprintf(key, sizeof(key), "%c%c%c", 'a' + i % 26, 'a' + i / 26 % 26, 'a' + i / 676);
+      else
+        snprintf(key, sizeof(key), formats[f], i);
+
+      uint64_t hash = CD_hash(key);
+      slots[hash & (slot_buckets - 1)]++;
+      h2[hash >> 57]++;
+    }
+
+    // the statistic has mean df and standard deviation sqrt(2 df)
+    test_assert(chi_squared(slots, slot_buckets, n) < (slot_buckets - 1) + 6 * sqrt(2 * (slot_buckets - 1)));
+    test_assert(chi_squared(h2, h2_buckets, n) < (h2_buckets - 1) + 6 * sqrt(2 * (h2_buckets - 1)));
+  }
+
+  // avalanche: flip each bit of each character of some keys
+  const char *bases[] = {"x", "ab", "var_1", "velocity", "abcdefghijklmnopqrstuvwxyz_0123"};
+  long flipped = 0, trials = 0;
+
+  for (int b = 0; b < 5; b++)
+  {
+    size_t len = strlen(bases[b]);
+    uint64_t base_hash = CD_hash(bases[b]);
+
+    for (size_t c = 0; c < len; c++)
+    {
+      for (int bit = 0; bit < 7; bit++)
+      {
+        strcpy(key, bases[b]);
+        key[c] ^= 1 << bit;
+        flipped += __builtin_popcountll(CD_hash(key) ^ base_hash);
+        trials++;
+      }
+    }
+  }
+  test_assert(fabs((double)flipped / trials - 32) < 2);
+
+  return 1;
+
+test_error:
+  return 0;
+}
+
+/*
+ * Tests CD_reserve, CD_store_many and CD_shrink_to_fit
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_cdict_capacity()
+{
+  const int n = 10000;
+  CDict dict = CD_new();
+  CDict many = CD_new();
+  char (*names)[16] = malloc(sizeof(*names) * n);
+  CDictKeyType *keys = malloc(sizeof(CDictKeyType) * n);
+  CDictValueType *values = malloc(sizeof(CDictValueType) * n);
+  CDictCell cell;
+
+  test_assert(names != NULL && keys != NULL && values != NULL);
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(names[i], sizeof(names[i]), "k%d", i);
+    keys[i] = names[i];
+    values[i] = i * 0.5;
+  }
+
+  // a reserved dictionary does not grow while it fills
+  CD_reserve(dict, n);
+  unsigned int capacity = CD_capacity(dict);
+  test_assert(capacity == 16384);
+  for (int i = 0; i < n; i++)
+    CD_store(dict, keys[i], values[i]);
+  test_assert(CD_capacity(dict) == capacity && CD_size(dict) == n);
+  CD_reserve(dict, 10);
+  test_assert(CD_capacity(dict) == capacity);
+
+  // CD_store_many gives the same contents, and overwrites as CD_store does
+  CD_store(many, "k5", -1);
+  CD_store_many(many, keys, values, n);
+  CD_store_many(many, keys, values, 0);
+  test_assert(CD_capacity(many) == capacity && CD_size(many) == n);
+  test_assert(CD_check_invariants(many));
+  for (int i = 0; i < n; i++)
+    test_assert(CD_retrieve(many, keys[i]) == values[i]);
+
+  // after a mass delete, shrinking keeps the remaining keys and cells
+  test_assert(CD_find_cell(dict, "k9999", &cell));
+  for (int i = 0; i < n - 100; i++)
+    CD_delete(dict, keys[i]);
+  CD_shrink_to_fit(dict);
+  test_assert(CD_capacity(dict) == 128 && CD_size(dict) == 100);
+  test_assert(CD_check_invariants(dict));
+  for (int i = 0; i < n; i++)
+  {
+    double value = CD_retrieve(dict, keys[i]);
+    test_assert((i < n - 100) ? isnan(value) : value == values[i]);
+  }
+  test_assert(CD_cell_load(dict, cell) == values[n - 1]);
+
+  // and the dictionary grows again as it fills
+  CD_store_many(dict, keys, values, n);
+  test_assert(CD_capacity(dict) == capacity && CD_size(dict) == n);
+
+  for (int i = 0; i < n; i++)
+    CD_delete(dict, keys[i]);
+  CD_shrink_to_fit(dict);
+  test_assert(CD_capacity(dict) == 8 && CD_size(dict) == 0);
+
+  free(names);
+  free(keys);
+  free(values);
+  CD_free(dict);
+  CD_free(many);
+  return 1;
+
+test_error:
+  free(names);
+  free(keys);
+  free(values);
+  CD_free(dict);
+  CD_free(many);
+  return 0;
+}
+
+// Shared state for the threads of test_ccdict
+struct ccdict_race
+{
+  CCDict dict;
+  int id;
+  int rounds;
+  bool failed;
+};
+
+// A writer: counts its own key up, and churns keys that force growth and shifts
+static void *ccdict_writer(void *arg)
+{
+  struct ccdict_race *race = arg;
+  char key[CC_MAX_KEY + 1];
+  char own[CC_MAX_KEY + 1];
+
+  snprintf(own, sizeof(own), "w%d", race->id);
+  for (int i = 0; i < race->rounds; i++)
+  {
+    CC_store(race->dict, own, i);
+    snprintf(key, sizeof(key), "c%d_%d", race->id, i);
+    CC_store(race->dict, key, i);
+    if (i >= 64)
+    {
+      snprintf(key, sizeof(key), "c%d_%d", race->id, i - 64);
+      CC_delete(race->dict, key);
+    }
+  }
+
+  return NULL;
+}
+
+// A reader: the fixed keys never change, and each writer's count never goes back
+static void *ccdict_reader(void *arg)
+{
+  struct ccdict_race *race = arg;
+  char key[CC_MAX_KEY + 1];
+  double last[4] = {-1, -1, -1, -1};
+
+  for (int i = 0; i < race->rounds; i++)
+  {
+    snprintf(key, sizeof(key), "s%d", i % 500);
+    if (CC_retrieve(race->dict, key) != i % 500)
+      race->failed = true;
+
+    int w = i % 4;
+    snprintf(key, sizeof(key), "w%d", w);
+    double value = CC_retrieve(race->dict, key);
+    if (!isnan(value))
+    {
+      if (value < last[w])
+        race->failed = true;
+      last[w] = value;
+    }
+  }
+
+  return NULL;
+}
+
+// Adds the values it is called back with
+static void ccdict_sum(CDictKeyType key, CDictValueType value, void *cb_data)
+{
+  *(double *)cb_data += value;
+}
+
+/*
+ * Tests the CCDict functions, from one thread and then from several
+ * at once
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_ccdict()
+{
+  CCDict dict = CC_new();
+  char key[CC_MAX_KEY + 1];
+  double sum = 0;
+
+  test_assert(CC_size(dict) == 0);
+  test_assert(!CC_contains(dict, "x"));
+  test_assert(isnan(CC_retrieve(dict, "x")));
+
+  CC_store(dict, "x", 1);
+  CC_store(dict, "x", 2);
+  test_assert(CC_size(dict) == 1 && CC_retrieve(dict, "x") == 2);
+  CC_store(dict, "x", NAN);
+  test_assert(CC_retrieve(dict, "x") == 2);
+  CC_delete(dict, "x");
+  CC_delete(dict, "x");
+  test_assert(CC_size(dict) == 0 && !CC_contains(dict, "x"));
+
+  // keys up to the longest symbol are kept; longer ones are not
+  CC_store(dict, "abcdefghijklmnopqrstuvwxyz01234", 31);
+  CC_store(dict, "abcdefghijklmnopqrstuvwxyz012345", 32);
+  test_assert(CC_retrieve(dict, "abcdefghijklmnopqrstuvwxyz01234") == 31);
+  test_assert(!CC_contains(dict, "abcdefghijklmnopqrstuvwxyz012345"));
+  CC_delete(dict, "abcdefghijklmnopqrstuvwxyz01234");
+
+  // enough keys to grow every stripe, then delete every other one
+  for (int i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    CC_store(dict, key, i);
+  }
+  test_assert(CC_size(dict) == 5000);
+  for (int i = 0; i < 5000; i += 2)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    CC_delete(dict, key);
+  }
+  test_assert(CC_size(dict) == 2500);
+  for (int i = 0; i < 5000; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    test_assert(CC_contains(dict, key) == (i % 2 == 1));
+    test_assert((i % 2 == 1) ? CC_retrieve(dict, key) == i : isnan(CC_retrieve(dict, key)));
+  }
+
+  CC_foreach(dict, ccdict_sum, &sum);
+  test_assert(sum == 2500.0 * 2500.0);
+  CC_free(dict);
+
+  // readers racing with writers see only whole values
+  dict = CC_new();
+  for (int i = 0; i < 500; i++)
+  {
+    snprintf(key, sizeof(key), "s%d", i);
+    CC_store(dict, key, i);
+  }
+
+  pthread_t thread[8];
+  struct ccdict_race race[8];
+
+  for (int t = 0; t < 8; t++)
+  {
+    race[t] = (struct ccdict_race){dict, t % 4, 20000, false};
+    pthread_create(&thread[t], NULL, t < 4 ? ccdict_writer : ccdict_reader, &race[t]);
+  }
+  for (int t = 0; t < 8; t++)
+    pthread_join(thread[t], NULL);
+  for (int t = 0; t < 8; t++)
+    test_assert(!race[t].failed);
+
+  test_assert(CC_size(dict) == 500 + 4 + 4 * 64);
+  for (int t = 0; t < 4; t++)
+  {
+    snprintf(key, sizeof(key), "w%d", t);
+    test_assert(CC_retrieve(dict, key) == 19999);
+  }
+
+  CC_free(dict);
+  return 1;
+
+test_error:
+  CC_free(dict);
+  return 0;
+}
+
+// A writer for test_penv: keeps a and b equal, updating them together
+static void *penv_writer(void *arg)
+{
+  PEnv env = arg;
+  const char *const keys[] = {"a", "b"};
+
+  for (int i = 1; i <= 20000; i++)
+  {
+    double values[] = {i, i};
+
+    PE_env_store_many(env, keys, values, 2);
+  }
+
+  return NULL;
+}
+
+/*
+ * Tests the PEMap and PEnv functions and ET_evaluate_persistent
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_penv()
+{
+  const int n = 5000;
+  PEMap empty = PE_new();
+  PEMap map = PE_retain(empty);
+  PEMap old = NULL;
+  PEMap vars = NULL;
+  ExprTree tree = NULL;
+  PEnv env = NULL;
+  char key[32];
+  double result;
+  ETError err;
+
+  test_assert(PE_size(empty) == 0 && !PE_contains(empty, "x") && isnan(PE_retrieve(empty, "x")));
+
+  // every version keeps its own contents
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    PEMap next = PE_store(map, key, i);
+    PE_release(map);
+    map = next;
+    if (i == n / 2)
+      old = PE_retain(map);
+  }
+  test_assert(PE_size(map) == n && PE_size(old) == n / 2 + 1 && PE_size(empty) == 0);
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    test_assert(PE_retrieve(map, key) == i);
+    test_assert(PE_contains(old, key) == (i <= n / 2));
+  }
+
+  // storing the same value or NaN, or deleting a missing key, gives the same map
+  PEMap same = PE_store(map, "k7", 7);
+  test_assert(same == map);
+  PE_release(same);
+  same = PE_store(map, "k7", NAN);
+  test_assert(same == map);
+  PE_release(same);
+  same = PE_delete(map, "missing");
+  test_assert(same == map);
+  PE_release(same);
+
+  // delete every other key from the newer version only
+  for (int i = 0; i < n; i += 2)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    PEMap next = PE_delete(map, key);
+    PE_release(map);
+    map = next;
+  }
+  test_assert(PE_size(map) == n / 2 && PE_size(old) == n / 2 + 1);
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    test_assert(PE_contains(map, key) == (i % 2 == 1));
+    test_assert(PE_contains(old, key) == (i <= n / 2));
+  }
+  PE_release(old);
+  old = NULL;
+
+  // the evaluator reads the map and assigns by making new versions
+  vars = PE_store(empty, "x", 4);
+  old = PE_retain(vars);
+  tree = ET_node(OP_ASSIGN, ET_symbol("y"), ET_node(OP_MUL, ET_symbol("x"), ET_value(2)));
+  test_assert(ET_evaluate_persistent(tree, &vars, &result, &err) == ET_OK);
+  test_assert(result == 8 && PE_retrieve(vars, "y") == 8 && !PE_contains(old, "y"));
+  ET_free(tree);
+
+  ExprTree failing = ET_symbol("z");
+  tree = ET_node(OP_ADD, ET_symbol("x"), failing);
+  result = -1;
+  test_assert(ET_evaluate_persistent(tree, &vars, &result, &err) == ET_ERR_UNDEFINED);
+  test_assert(err.node == failing && result == -1);
+  ET_free(tree);
+  tree = NULL;
+
+  // a snapshot sees each batch of stores whole
+  env = PE_env_new();
+  PE_env_store(env, "a", 0);
+  PE_env_store(env, "b", 0);
+  PE_env_store(env, "c", 1);
+  PE_env_delete(env, "c");
+
+  pthread_t writer;
+  bool consistent = true;
+
+  pthread_create(&writer, NULL, penv_writer, env);
+  for (int i = 0; i < 20000; i++)
+  {
+    PEMap snapshot = PE_env_snapshot(env);
+
+    if (PE_retrieve(snapshot, "a") != PE_retrieve(snapshot, "b") || PE_size(snapshot) != 2)
+      consistent = false;
+    PE_release(snapshot);
+  }
+  pthread_join(writer, NULL);
+  test_assert(consistent);
+
+  // and outlives the environment
+  PEMap snapshot = PE_env_snapshot(env);
+  PE_env_free(env);
+  env = NULL;
+  test_assert(PE_retrieve(snapshot, "a") == 20000 && PE_retrieve(snapshot, "b") == 20000);
+  PE_release(snapshot);
+
+  PE_release(empty);
+  PE_release(map);
+  PE_release(old);
+  PE_release(vars);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  PE_env_free(env);
+  PE_release(empty);
+  PE_release(map);
+  PE_release(old);
+  PE_release(vars);
+  return 0;
+}
+
+/*
+ * Tests scopes from CD_push_scope: lookups fall through to the parent,
+ * assignments stay in the scope, and popping it leaves the parent as
+ * it was
+ *
+ * Returns: 1 if all tests pass, 0 otherwise
+ */
+int test_scope()
+{
+  CDict globals = CD_new();
+  CDict scope = NULL;
+  CDict inner = NULL;
+  ExprTree tree = NULL;
+  CDictCell cell;
+  char errmsg[128] = "";
+  char key[16];
+
+  for (int i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "c%d", i);
+    CD_store(globals, key, i);
+  }
+  CD_store(globals, "x", 10);
+
+  scope = CD_push_scope(globals);
+  test_assert(CD_size(scope) == 0 && CD_contains(scope, "c5") && CD_retrieve(scope, "x") == 10);
+
+  // x = x + c7: reads through to the parent, assigns in the scope
+  tree = ET_node(OP_ASSIGN, ET_symbol("x"), ET_node(OP_ADD, ET_symbol("x"), ET_symbol("c7")));
+  test_assert(ET_bind(tree, scope) == 0);
+  unsigned long clock = CD_clock(scope);
+  test_assert(ET_evaluate(tree, scope, errmsg, sizeof(errmsg)) == 17);
+  test_assert(CD_retrieve(scope, "x") == 17 && CD_retrieve(globals, "x") == 10);
+  test_assert(CD_size(scope) == 1 && CD_clock(scope) != clock);
+  test_assert(ET_evaluate(tree, scope, errmsg, sizeof(errmsg)) == 24);
+  test_assert(CD_retrieve(globals, "x") == 10);
+
+  // a parent's cell is valid in the scope until the scope shadows it
+  test_assert(CD_find_cell(scope, "c3", &cell));
+  test_assert(CD_cell_valid(scope, cell) && CD_cell_load(scope, cell) == 3);
+  CD_cell_store(scope, cell, 30);
+  test_assert(!CD_cell_valid(scope, cell) && CD_cell_valid(globals, cell));
+  test_assert(CD_retrieve(scope, "c3") == 30 && CD_retrieve(globals, "c3") == 3);
+  cell = CD_find_or_add(scope, "c4", 0);
+  test_assert(CD_cell_load(scope, cell) == 4 && !CD_contains(scope, "nope"));
+
+  // changes to the parent show through
+  CD_store(globals, "c9", -9);
+  test_assert(CD_retrieve(scope, "c9") == -9);
+
+  // scopes nest, and popping one restores the view below
+  inner = CD_push_scope(scope);
+  CD_store(inner, "c3", 300);
+  test_assert(CD_retrieve(inner, "c3") == 300 && CD_retrieve(inner, "x") == 24 && CD_retrieve(inner, "c1") == 1);
+  test_assert(CD_version(inner, "c1") == CD_version(globals, "c1"));
+  test_assert(CD_pop_scope(inner) == scope);
+  inner = NULL;
+  test_assert(CD_retrieve(scope, "c3") == 30);
+
+  test_assert(CD_pop_scope(scope) == globals);
+  scope = NULL;
+  test_assert(CD_retrieve(globals, "x") == 10 && CD_retrieve(globals, "c3") == 3 && CD_size(globals) == 1001);
+
+  // the tree is still bound to the popped scope's cells, which are the
+  // parent's, and looks x up by name
+  test_assert(ET_evaluate(tree, globals, errmsg, sizeof(errmsg)) == 17);
+  test_assert(CD_retrieve(globals, "x") == 17);
+
+  ET_free(tree);
+  CD_free(globals);
+  return 1;
+
+test_error:
+  ET_free(tree);
+  CD_free(inner);
+  CD_free(scope);
+  CD_free(globals);
+  return 0;
+}
+
 /*
  * Tests the TOK_next_type and TOK_consume functions
  *
@@ -688,6 +3109,48 @@ int main()
   num_tests++;
   passed += test_expr_tree();
   num_tests++;
+  passed += test_tree2string();
+  num_tests++;
+  passed += test_tree2stream();
+  num_tests++;
+  passed += test_batch();
+  num_tests++;
+  passed += test_batch_parallel();
+  num_tests++;
+  passed += test_bind();
+  num_tests++;
+  passed += test_evaluate_checked();
+  num_tests++;
+  passed += test_codegen();
+  num_tests++;
+  passed += test_pow_constant();
+  num_tests++;
+  passed += test_reactive();
+  num_tests++;
+  passed += test_eval_cache();
+  num_tests++;
+  passed += test_save_load();
+  num_tests++;
+  passed += test_derivatives();
+  num_tests++;
+  passed += test_gradient();
+  num_tests++;
+  passed += test_hash_equal();
+  num_tests++;
+  passed += test_rebalance();
+  num_tests++;
+  passed += test_cdict();
+  num_tests++;
+  passed += test_cdict_hash();
+  num_tests++;
+  passed += test_cdict_capacity();
+  num_tests++;
+  passed += test_scope();
+  num_tests++;
+  passed += test_ccdict();
+  num_tests++;
+  passed += test_penv();
+  num_tests++;
   passed += test_tok_next_consume();
   num_tests++;
   passed += test_tokenize_input();
@@ -0,0 +1,796 @@
+/*
+ * expr_batch.c
+ *
+ * Evaluation of one ExprTree over many rows of variable values at
+ * once. See expr_batch.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <math.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define EB_HAVE_X86_KERNELS
+#endif
+
+#include "expr_batch.h"
+#include "expr_tree_internal.h"
+
+// Rows processed per pass through the program. Each live value takes
+// EB_CHUNK doubles, so a program with a dozen live values at once
+// still keeps its working set within a 32 KB L1 data cache.
+#define EB_CHUNK 256
+
+#define EB_ERR_WORDS (EB_CHUNK / 64)
+
+// Tasks per thread that EB_run_parallel aims for when it picks the
+// chunk size, so that work stealing has something to balance
+#define EB_TASKS_PER_THREAD 8
+
+typedef enum
+{
+  EB_LOAD_COLUMN,
+  EB_LOAD_CONST,
+  EB_LOAD_SLOT,
+  EB_ASSIGN, // store into slot arg, see _EB_compile_node
+  EB_ADD,
+  EB_SUB,
+  EB_MUL,
+  EB_DIV,
+  EB_POW,
+  EB_POWI, // raise to the constant integral power arg, see ET_powi
+  EB_SQRT, // raise to the power 0.5, see ET_pow_sqrt
+  EB_NEG
+} EBOpcode;
+
+struct _eb_insn
+{
+  EBOpcode op;
+  int arg;      // column or slot number for loads and stores, exponent for EB_POWI
+  double value; // value for EB_LOAD_CONST
+};
+
+/*
+ * The kernels for one instruction set. Each computes n results into r;
+ * r may be the same array as a or b. div also sets the bit in err for
+ * each row whose divisor is zero.
+ */
+struct _eb_kernels
+{
+  const char *isa;
+  void (*add)(double *r, const double *a, const double *b, size_t n);
+  void (*sub)(double *r, const double *a, const double *b, size_t n);
+  void (*mul)(double *r, const double *a, const double *b, size_t n);
+  void (*div)(double *r, const double *a, const double *b, size_t n, uint64_t *err);
+  void (*neg)(double *r, const double *a, size_t n);
+};
+
+struct _expr_batch
+{
+  struct _eb_insn *insn;
+  int num_insns;
+  int insn_cap;
+  int num_columns;
+  int depth;     // current stack depth, used while compiling
+  int max_depth; // deepest the value stack gets while running
+  int num_slots; // one per assignment in the tree
+  const struct _eb_kernels *kernels;
+};
+
+/*
+ * Scalar kernels, used when no vector instruction set is available and
+ * for the tail of each chunk by the vector kernels
+ */
+static void _EB_add_scalar(double *r, const double *a, const double *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    r[i] = a[i] + b[i];
+}
+
+static void _EB_sub_scalar(double *r, const double *a, const double *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    r[i] = a[i] - b[i];
+}
+
+static void _EB_mul_scalar(double *r, const double *a, const double *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    r[i] = a[i] * b[i];
+}
+
+static void _EB_div_scalar(double *r, const double *a, const double *b, size_t n, uint64_t *err)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    if (b[i] == 0)
+      err[i / 64] |= (uint64_t)1 << (i % 64);
+    r[i] = a[i] / b[i];
+  }
+}
+
+static void _EB_neg_scalar(double *r, const double *a, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    r[i] = -a[i];
+}
+
+static const struct _eb_kernels _eb_scalar = {
+    "scalar", _EB_add_scalar, _EB_sub_scalar, _EB_mul_scalar, _EB_div_scalar, _EB_neg_scalar};
+
+#ifdef EB_HAVE_X86_KERNELS
+
+/*
+ * AVX2 kernels, four rows per instruction
+ */
+#define EB_AVX2_BINARY(name, intrinsic, scalar)                                        \
+  __attribute__((target("avx2"))) static void name(double *r, const double *a,         \
+                                                   const double *b, size_t n)          \
+  {                                                                                    \
+    size_t i = 0;                                                                      \
+    for (; i + 4 <= n; i += 4)                                                         \
+      _mm256_storeu_pd(r + i, intrinsic(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+    scalar(r + i, a + i, b + i, n - i);                                                \
+  }
+
+EB_AVX2_BINARY(_EB_add_avx2, _mm256_add_pd, _EB_add_scalar)
+EB_AVX2_BINARY(_EB_sub_avx2, _mm256_sub_pd, _EB_sub_scalar)
+EB_AVX2_BINARY(_EB_mul_avx2, _mm256_mul_pd, _EB_mul_scalar)
+
+__attribute__((target("avx2"))) static void _EB_div_avx2(double *r, const double *a, const double *b,
+                                                         size_t n, uint64_t *err)
+{
+  const __m256d zero = _mm256_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d vb = _mm256_loadu_pd(b + i);
+    uint64_t zeros = (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(vb, zero, _CMP_EQ_OQ));
+
+    err[i / 64] |= zeros << (i % 64);
+    _mm256_storeu_pd(r + i, _mm256_div_pd(_mm256_loadu_pd(a + i), vb));
+  }
+
+  for (; i < n; i++)
+  {
+    if (b[i] == 0)
+      err[i / 64] |= (uint64_t)1 << (i % 64);
+    r[i] = a[i] / b[i];
+  }
+}
+
+__attribute__((target("avx2"))) static void _EB_neg_avx2(double *r, const double *a, size_t n)
+{
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4)
+    _mm256_storeu_pd(r + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), sign));
+  _EB_neg_scalar(r + i, a + i, n - i);
+}
+
+static const struct _eb_kernels _eb_avx2 = {
+    "avx2", _EB_add_avx2, _EB_sub_avx2, _EB_mul_avx2, _EB_div_avx2, _EB_neg_avx2};
+
+/*
+ * AVX-512 kernels, eight rows per instruction
+ */
+#define EB_AVX512_BINARY(name, intrinsic, scalar)                                      \
+  __attribute__((target("avx512f"))) static void name(double *r, const double *a,      \
+                                                      const double *b, size_t n)       \
+  {                                                                                    \
+    size_t i = 0;                                                                      \
+    for (; i + 8 <= n; i += 8)                                                         \
+      _mm512_storeu_pd(r + i, intrinsic(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i))); \
+    scalar(r + i, a + i, b + i, n - i);                                                \
+  }
+
+EB_AVX512_BINARY(_EB_add_avx512, _mm512_add_pd, _EB_add_scalar)
+EB_AVX512_BINARY(_EB_sub_avx512, _mm512_sub_pd, _EB_sub_scalar)
+EB_AVX512_BINARY(_EB_mul_avx512, _mm512_mul_pd, _EB_mul_scalar)
+
+__attribute__((target("avx512f"))) static void _EB_div_avx512(double *r, const double *a,
+                                                              const double *b, size_t n, uint64_t *err)
+{
+  const __m512d zero = _mm512_setzero_pd();
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512d vb = _mm512_loadu_pd(b + i);
+    uint64_t zeros = (uint64_t)_mm512_cmp_pd_mask(vb, zero, _CMP_EQ_OQ);
+
+    err[i / 64] |= zeros << (i % 64);
+    _mm512_storeu_pd(r + i, _mm512_div_pd(_mm512_loadu_pd(a + i), vb));
+  }
+
+  for (; i < n; i++)
+  {
+    if (b[i] == 0)
+      err[i / 64] |= (uint64_t)1 << (i % 64);
+    r[i] = a[i] / b[i];
+  }
+}
+
+__attribute__((target("avx512f"))) static void _EB_neg_avx512(double *r, const double *a, size_t n)
+{
+  const __m512i sign = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+  size_t i = 0;
+
+  // flip the sign bit, so that -(0) is -0 as it is for scalar code
+  for (; i + 8 <= n; i += 8)
+    _mm512_storeu_pd(r + i, _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(_mm512_loadu_pd(a + i)), sign)));
+  _EB_neg_scalar(r + i, a + i, n - i);
+}
+
+static const struct _eb_kernels _eb_avx512 = {
+    "avx512f", _EB_add_avx512, _EB_sub_avx512, _EB_mul_avx512, _EB_div_avx512, _EB_neg_avx512};
+
+#endif /* EB_HAVE_X86_KERNELS */
+
+/*
+ * Look up the kernels for an instruction set
+ *
+ * Parameters:
+ *   isa      The name of the instruction set, or NULL for the best one
+ *            that this CPU supports
+ *
+ * Returns: The kernels, or NULL if isa is unknown or not supported
+ */
+static const struct _eb_kernels *_EB_kernels(const char *isa)
+{
+#ifdef EB_HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if ((isa == NULL || strcmp(isa, "avx512f") == 0) && __builtin_cpu_supports("avx512f"))
+    return &_eb_avx512;
+
+  if ((isa == NULL || strcmp(isa, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    return &_eb_avx2;
+#endif
+
+  if (isa == NULL || strcmp(isa, "scalar") == 0)
+    return &_eb_scalar;
+
+  return NULL;
+}
+
+/*
+ * Append an instruction to the program, tracking the depth of the
+ * value stack that it leaves behind
+ *
+ * Parameters:
+ *   batch    The program
+ *   op       The opcode
+ *   arg      The column or slot number, if op uses one
+ *   value    The constant, if op uses one
+ *
+ * Returns: None
+ */
+static void _EB_emit(ExprBatch batch, EBOpcode op, int arg, double value)
+{
+  if (batch->num_insns == batch->insn_cap)
+  {
+    batch->insn_cap *= 2;
+    batch->insn = realloc(batch->insn, sizeof(struct _eb_insn) * batch->insn_cap);
+    assert(batch->insn != NULL);
+  }
+
+  batch->insn[batch->num_insns++] = (struct _eb_insn){op, arg, value};
+
+  if (op == EB_LOAD_COLUMN || op == EB_LOAD_CONST || op == EB_LOAD_SLOT)
+    batch->depth++;
+  else if (op != EB_NEG && op != EB_POWI && op != EB_SQRT)
+    batch->depth--;
+
+  if (batch->depth > batch->max_depth)
+    batch->max_depth = batch->depth;
+}
+
+// A symbol that has been assigned to earlier in the row
+struct _eb_binding
+{
+  const char *symbol;
+  int slot;
+};
+
+// State carried through the compilation of one tree
+struct _eb_compiler
+{
+  ExprBatch batch;
+  CDict vars;
+  const char *const *symbols;
+  struct _eb_binding *assigned;
+  char *errmsg;
+  size_t errmsg_sz;
+};
+
+/*
+ * Emit a load of the value that a symbol is bound to, as described
+ * for EB_compile
+ *
+ * Parameters:
+ *   c        The compiler state
+ *   symbol   The name of the symbol
+ *
+ * Returns: true if the symbol is bound, false if it is not, in which
+ *   case nothing is emitted
+ */
+static bool _EB_load_symbol(struct _eb_compiler *c, char *symbol)
+{
+  ExprBatch batch = c->batch;
+
+  for (int i = batch->num_slots - 1; i >= 0; i--)
+    if (strcmp(c->assigned[i].symbol, symbol) == 0)
+    {
+      _EB_emit(batch, EB_LOAD_SLOT, c->assigned[i].slot, 0);
+      return true;
+    }
+
+  for (int i = 0; i < batch->num_columns; i++)
+    if (strcmp(c->symbols[i], symbol) == 0)
+    {
+      _EB_emit(batch, EB_LOAD_COLUMN, i, 0);
+      return true;
+    }
+
+  if (CD_contains(c->vars, symbol))
+  {
+    _EB_emit(batch, EB_LOAD_CONST, 0, CD_retrieve(c->vars, symbol));
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Compile tree onto the end of the program, in the same order in
+ * which ET_evaluate visits the nodes
+ *
+ * Parameters:
+ *   c        The compiler state
+ *   tree     The subtree to compile
+ *
+ * Returns: true on success. On error, copies an error message into
+ *   c->errmsg and returns false.
+ */
+static bool _EB_compile_node(struct _eb_compiler *c, ExprTree tree)
+{
+  ExprBatch batch = c->batch;
+
+  if (tree == NULL)
+  {
+    _EB_emit(batch, EB_LOAD_CONST, 0, 0);
+    return true;
+  }
+
+  switch (tree->type)
+  {
+  case VALUE:
+    _EB_emit(batch, EB_LOAD_CONST, 0, tree->n.value);
+    return true;
+
+  case SYMBOL:
+    if (_EB_load_symbol(c, tree->n.symbol))
+      return true;
+
+    snprintf(c->errmsg, c->errmsg_sz, "Undefined variable: %s", tree->n.symbol);
+    return false;
+
+  case UNARY_NEGATE:
+    if (!_EB_compile_node(c, tree->n.child[LEFT]))
+      return false;
+    _EB_emit(batch, EB_NEG, 0, 0);
+    return true;
+
+  case OP_ASSIGN:
+    if (tree->n.child[LEFT]->type != SYMBOL)
+    {
+      snprintf(c->errmsg, c->errmsg_sz, "Syntax error on token EQUAL");
+      return false;
+    }
+
+    if (!_EB_compile_node(c, tree->n.child[RIGHT]))
+      return false;
+
+    // like CD_store, an assignment of NaN leaves the variable as it
+    // was, so EB_ASSIGN also takes the variable's previous value, or
+    // NaN if it has none
+    if (!_EB_load_symbol(c, tree->n.child[LEFT]->n.symbol))
+      _EB_emit(batch, EB_LOAD_CONST, 0, NAN);
+
+    // each assignment gets a slot of its own, so that an earlier value
+    // is still intact for any reads of it that are waiting on the stack
+    c->assigned = realloc(c->assigned, sizeof(struct _eb_binding) * (batch->num_slots + 1));
+    assert(c->assigned != NULL);
+    c->assigned[batch->num_slots] = (struct _eb_binding){tree->n.child[LEFT]->n.symbol, batch->num_slots};
+    _EB_emit(batch, EB_ASSIGN, batch->num_slots, 0);
+    batch->num_slots++;
+    return true;
+
+  case OP_POWER:
+    if (tree->n.pow_kind == POW_GENERAL)
+      break;
+
+    // the exponent is a constant, so only the base needs computing
+    if (!_EB_compile_node(c, tree->n.child[LEFT]))
+      return false;
+    if (tree->n.pow_kind == POW_INTEGER)
+      _EB_emit(batch, EB_POWI, tree->n.pow_exp, 0);
+    else
+      _EB_emit(batch, EB_SQRT, 0, 0);
+    return true;
+
+  default:
+    break;
+  }
+
+  if (!_EB_compile_node(c, tree->n.child[LEFT]) || !_EB_compile_node(c, tree->n.child[RIGHT]))
+    return false;
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    _EB_emit(batch, EB_ADD, 0, 0);
+    break;
+  case OP_SUB:
+    _EB_emit(batch, EB_SUB, 0, 0);
+    break;
+  case OP_MUL:
+    _EB_emit(batch, EB_MUL, 0, 0);
+    break;
+  case OP_DIV:
+    _EB_emit(batch, EB_DIV, 0, 0);
+    break;
+  case OP_POWER:
+    _EB_emit(batch, EB_POW, 0, 0);
+    break;
+  default:
+    assert(0);
+  }
+
+  return true;
+}
+
+// Documented in .h file
+ExprBatch EB_compile(ExprTree tree, CDict vars, const char *const symbols[], int num_columns,
+                     char *errmsg, size_t errmsg_sz)
+{
+  ExprBatch batch = malloc(sizeof(struct _expr_batch));
+  assert(batch != NULL);
+
+  batch->insn_cap = 16;
+  batch->insn = malloc(sizeof(struct _eb_insn) * batch->insn_cap);
+  assert(batch->insn != NULL);
+  batch->num_insns = 0;
+  batch->num_columns = num_columns;
+  batch->depth = 0;
+  batch->max_depth = 0;
+  batch->num_slots = 0;
+  batch->kernels = _EB_kernels(NULL);
+
+  struct _eb_compiler c = {batch, vars, symbols, NULL, errmsg, errmsg_sz};
+  bool ok = _EB_compile_node(&c, tree);
+
+  free(c.assigned);
+
+  if (!ok)
+  {
+    EB_free(batch);
+    return NULL;
+  }
+
+  assert(batch->depth == 1);
+  return batch;
+}
+
+// Documented in .h file
+void EB_free(ExprBatch batch)
+{
+  if (batch == NULL)
+    return;
+
+  free(batch->insn);
+  free(batch);
+}
+
+// Documented in .h file
+const char *EB_isa(ExprBatch batch)
+{
+  return batch->kernels->isa;
+}
+
+// Documented in .h file
+bool EB_use_isa(ExprBatch batch, const char *isa)
+{
+  const struct _eb_kernels *kernels = (isa == NULL) ? NULL : _EB_kernels(isa);
+
+  if (kernels == NULL)
+    return false;
+
+  batch->kernels = kernels;
+  return true;
+}
+
+/*
+ * Raise each of n values to a constant integral power, performing the
+ * same multiplications as ET_powi so that the results are identical,
+ * but one whole column at a time with the vector kernels
+ *
+ * Parameters:
+ *   k        The kernels
+ *   r        Return space for the results; may be the same array as a
+ *   a        The bases
+ *   exp      The exponent
+ *   n        The number of values, at most EB_CHUNK
+ *
+ * Returns: None
+ */
+static void _EB_powi(const struct _eb_kernels *k, double *r, const double *a, int exp, size_t n)
+{
+  unsigned int m = (exp < 0) ? -(unsigned int)exp : (unsigned int)exp;
+  double base[EB_CHUNK];
+
+  memcpy(base, a, sizeof(double) * n);
+  for (size_t i = 0; i < n; i++)
+    r[i] = 1;
+
+  while (m != 0)
+  {
+    if (m & 1)
+      k->mul(r, r, base, n);
+    m >>= 1;
+    if (m != 0)
+      k->mul(base, base, base, n);
+  }
+
+  if (exp < 0)
+    for (size_t i = 0; i < n; i++)
+      r[i] = 1 / r[i];
+}
+
+/*
+ * Run the program over one chunk of at most EB_CHUNK rows
+ *
+ * Parameters:
+ *   batch    The program
+ *   columns  The input columns, already offset to the first row of the chunk
+ *   n        The number of rows in the chunk
+ *   out      Return space for n results
+ *   err      Return space for the error bits of the chunk, which must
+ *            be cleared by the caller
+ *   work     Scratch space of (max_depth + num_slots) * EB_CHUNK doubles
+ *
+ * Returns: None
+ */
+static void _EB_run_chunk(ExprBatch batch, const double *const columns[], size_t n,
+                          double *out, uint64_t *err, double *work)
+{
+  const struct _eb_kernels *k = batch->kernels;
+  const double *stack[batch->max_depth];
+  double *slots = work + (size_t)batch->max_depth * EB_CHUNK;
+  int top = 0;
+
+  for (int pc = 0; pc < batch->num_insns; pc++)
+  {
+    const struct _eb_insn *insn = &batch->insn[pc];
+    double *dst;
+
+    // the value at stack depth d is computed into row d of work
+    switch (insn->op)
+    {
+    case EB_LOAD_COLUMN:
+      stack[top++] = columns[insn->arg];
+      break;
+
+    case EB_LOAD_CONST:
+      dst = work + (size_t)top * EB_CHUNK;
+      for (size_t i = 0; i < n; i++)
+        dst[i] = insn->value;
+      stack[top++] = dst;
+      break;
+
+    case EB_LOAD_SLOT:
+      stack[top++] = slots + (size_t)insn->arg * EB_CHUNK;
+      break;
+
+    case EB_ASSIGN:
+      // the top two entries are the assigned value and the variable's
+      // previous value; the assigned value is left as the result
+      top--;
+      dst = slots + (size_t)insn->arg * EB_CHUNK;
+      for (size_t i = 0; i < n; i++)
+        dst[i] = isnan(stack[top - 1][i]) ? stack[top][i] : stack[top - 1][i];
+      break;
+
+    case EB_NEG:
+      dst = work + (size_t)(top - 1) * EB_CHUNK;
+      k->neg(dst, stack[top - 1], n);
+      stack[top - 1] = dst;
+      break;
+
+    case EB_POWI:
+      dst = work + (size_t)(top - 1) * EB_CHUNK;
+      _EB_powi(k, dst, stack[top - 1], insn->arg, n);
+      stack[top - 1] = dst;
+      break;
+
+    case EB_SQRT:
+      dst = work + (size_t)(top - 1) * EB_CHUNK;
+      for (size_t i = 0; i < n; i++)
+        dst[i] = ET_pow_sqrt(stack[top - 1][i]);
+      stack[top - 1] = dst;
+      break;
+
+    default:
+      // binary operators replace the top two entries with their result
+      top--;
+      dst = work + (size_t)(top - 1) * EB_CHUNK;
+
+      if (insn->op == EB_ADD)
+        k->add(dst, stack[top - 1], stack[top], n);
+      else if (insn->op == EB_SUB)
+        k->sub(dst, stack[top - 1], stack[top], n);
+      else if (insn->op == EB_MUL)
+        k->mul(dst, stack[top - 1], stack[top], n);
+      else if (insn->op == EB_DIV)
+        k->div(dst, stack[top - 1], stack[top], n, err);
+      else
+        for (size_t i = 0; i < n; i++)
+          dst[i] = pow(stack[top - 1][i], stack[top][i]);
+
+      stack[top - 1] = dst;
+      break;
+    }
+  }
+
+  memcpy(out, stack[0], sizeof(double) * n);
+}
+
+/*
+ * Run the program over a range of rows, which must start on a multiple
+ * of EB_CHUNK so that each chunk's error bits fill whole bytes of
+ * errmask
+ *
+ * Parameters:
+ *   batch      The program
+ *   columns    The input columns
+ *   row        The first row to compute
+ *   end        One past the last row to compute
+ *   out        Return space for the results of all rows
+ *   errmask    Return space for the error bits of all rows; may be NULL
+ *   work       Scratch space, as for _EB_run_chunk
+ *
+ * Returns: The number of rows in the range that failed
+ */
+static size_t _EB_run_rows(ExprBatch batch, const double *const columns[], size_t row, size_t end,
+                           double *out, unsigned char *errmask, double *work)
+{
+  const double *chunk_columns[batch->num_columns + 1];
+  size_t failed = 0;
+
+  assert(row % EB_CHUNK == 0);
+
+  for (; row < end; row += EB_CHUNK)
+  {
+    size_t n = (end - row < EB_CHUNK) ? end - row : EB_CHUNK;
+    uint64_t err[EB_ERR_WORDS] = {0};
+
+    for (int i = 0; i < batch->num_columns; i++)
+      chunk_columns[i] = columns[i] + row;
+
+    _EB_run_chunk(batch, chunk_columns, n, out + row, err, work);
+
+    for (int w = 0; w < EB_ERR_WORDS; w++)
+    {
+      for (uint64_t bits = err[w]; bits != 0; bits &= bits - 1)
+        out[row + w * 64 + __builtin_ctzll(bits)] = NAN;
+      failed += __builtin_popcountll(err[w]);
+    }
+
+    if (errmask != NULL)
+      for (size_t b = 0; b < (n + 7) / 8; b++)
+        errmask[row / 8 + b] = (unsigned char)(err[b / 8] >> (b % 8 * 8));
+  }
+
+  return failed;
+}
+
+/*
+ * Allocate scratch space for one thread running the program
+ *
+ * Returns: The scratch space, to be released with free()
+ */
+static double *_EB_new_work(ExprBatch batch)
+{
+  size_t bytes = sizeof(double) * EB_CHUNK * (batch->max_depth + batch->num_slots);
+  double *work = aligned_alloc(64, bytes);
+  assert(work != NULL);
+
+  return work;
+}
+
+// Documented in .h file
+size_t EB_run(ExprBatch batch, const double *const columns[], size_t num_rows,
+              double *out, unsigned char *errmask)
+{
+  if (batch == NULL || num_rows == 0)
+    return 0;
+
+  double *work = _EB_new_work(batch);
+  size_t failed = _EB_run_rows(batch, columns, 0, num_rows, out, errmask, work);
+
+  free(work);
+  return failed;
+}
+
+// State shared by the tasks of one EB_run_parallel
+struct _eb_parallel_run
+{
+  ExprBatch batch;
+  const double *const *columns;
+  size_t num_rows;
+  size_t chunk_rows;
+  double *out;
+  unsigned char *errmask;
+  double **work;  // scratch space for each worker
+  size_t *failed; // failed rows counted by each worker
+};
+
+/*
+ * TP_task_fn that runs one chunk of rows of an EB_run_parallel
+ */
+static void _EB_parallel_task(size_t task, int worker, void *cb_data)
+{
+  struct _eb_parallel_run *run = (struct _eb_parallel_run *)cb_data;
+  size_t row = task * run->chunk_rows;
+  size_t end = (run->num_rows - row < run->chunk_rows) ? run->num_rows : row + run->chunk_rows;
+
+  run->failed[worker] += _EB_run_rows(run->batch, run->columns, row, end, run->out, run->errmask,
+                                      run->work[worker]);
+}
+
+// Documented in .h file
+size_t EB_run_parallel(ExprBatch batch, ThreadPool pool, const double *const columns[],
+                       size_t num_rows, size_t chunk_rows, double *out, unsigned char *errmask)
+{
+  if (batch == NULL || num_rows == 0)
+    return 0;
+
+  int num_threads = TP_num_threads(pool);
+
+  if (chunk_rows == 0)
+    chunk_rows = num_rows / (num_threads * EB_TASKS_PER_THREAD);
+
+  // whole chunks per task keep each task's errmask bytes to itself
+  chunk_rows = (chunk_rows + EB_CHUNK - 1) / EB_CHUNK * EB_CHUNK;
+  if (chunk_rows == 0)
+    chunk_rows = EB_CHUNK;
+
+  double *work[num_threads];
+  size_t failed[num_threads];
+  struct _eb_parallel_run run = {batch, columns, num_rows, chunk_rows, out, errmask, work, failed};
+
+  for (int i = 0; i < num_threads; i++)
+  {
+    work[i] = _EB_new_work(batch);
+    failed[i] = 0;
+  }
+
+  TP_run(pool, (num_rows + chunk_rows - 1) / chunk_rows, _EB_parallel_task, &run);
+
+  size_t total_failed = 0;
+  for (int i = 0; i < num_threads; i++)
+  {
+    total_failed += failed[i];
+    free(work[i]);
+  }
+
+  return total_failed;
+}
@@ -0,0 +1,127 @@
+/*
+ * expr_batch.h
+ *
+ * Evaluation of one ExprTree over many rows of variable values at
+ * once. The tree is compiled into a short program of column
+ * operations, which is then run over the rows in cache-sized chunks
+ * using SIMD kernels chosen for the CPU at runtime.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_BATCH_H_
+#define _EXPR_BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "cdict.h"
+#include "thread_pool.h"
+
+typedef struct _expr_batch *ExprBatch;
+
+/*
+ * Compile an ExprTree for batch evaluation.
+ *
+ * Each symbol read by the tree is bound, in order of preference, to
+ * the value most recently assigned to it earlier in the same row, to
+ * the column of the same name, or to its value in vars. Values taken
+ * from vars are read once, here, and are the same on every row.
+ * Assignments made by the tree are visible to later reads within the
+ * same row but are never stored into vars. As with ET_evaluate, an
+ * assignment of NaN leaves the variable's value as it was.
+ *
+ * Parameters:
+ *   tree         The tree
+ *   vars         Variables that are not supplied as columns; may be NULL
+ *   symbols      The names of the columns that will be passed to EB_run
+ *   num_columns  The number of entries in symbols
+ *   errmsg       Return space for an error message, filled in in case of error
+ *   errmsg_sz    The size of errmsg
+ *
+ * Returns: The compiled program. If a symbol is not bound to anything
+ *   or an assignment does not have a symbol on its left, copies an
+ *   error message into errmsg and returns NULL.
+ *
+ * It is the responsibility of the caller to call EB_free on the
+ * returned program. The tree may be freed as soon as this returns.
+ */
+ExprBatch EB_compile(ExprTree tree, CDict vars, const char *const symbols[], int num_columns,
+                     char *errmsg, size_t errmsg_sz);
+
+/*
+ * Destroy a compiled program
+ *
+ * Parameters:
+ *   batch    The program
+ *
+ * Returns: None
+ */
+void EB_free(ExprBatch batch);
+
+/*
+ * Evaluate a compiled program once per row.
+ *
+ * Rows on which an operation fails, which can only be a division by
+ * zero, have out set to NaN and their bit set in errmask. Other rows
+ * compute exactly the value that ET_evaluate would.
+ *
+ * Parameters:
+ *   batch      The program
+ *   columns    columns[i] holds num_rows values for the i'th symbol
+ *              that was passed to EB_compile
+ *   num_rows   The number of rows
+ *   out        Return space for num_rows results
+ *   errmask    Return space for (num_rows + 7) / 8 bytes, in which bit
+ *              (r % 8) of byte (r / 8) is set if row r failed and
+ *              cleared otherwise; may be NULL
+ *
+ * Returns: The number of rows that failed
+ */
+size_t EB_run(ExprBatch batch, const double *const columns[], size_t num_rows,
+              double *out, unsigned char *errmask);
+
+/*
+ * Evaluate a compiled program once per row, like EB_run, but with the
+ * rows split into chunks that are run in parallel on the threads of
+ * pool. Every row is computed by the same code whichever thread runs
+ * it, so out, errmask and the return value are identical to those of
+ * EB_run for any number of threads and any chunk size.
+ *
+ * Parameters:
+ *   batch       The program
+ *   pool        The threads to run on
+ *   columns     As for EB_run
+ *   num_rows    The number of rows
+ *   chunk_rows  The number of rows per parallel task; rounded up to a
+ *               multiple of 256, and 0 picks a size that gives each
+ *               thread several tasks
+ *   out         As for EB_run
+ *   errmask     As for EB_run; may be NULL
+ *
+ * Returns: The number of rows that failed
+ */
+size_t EB_run_parallel(ExprBatch batch, ThreadPool pool, const double *const columns[],
+                       size_t num_rows, size_t chunk_rows, double *out, unsigned char *errmask);
+
+/*
+ * Returns: The name of the instruction set used by batch's kernels:
+ *   "avx512f", "avx2" or "scalar"
+ */
+const char *EB_isa(ExprBatch batch);
+
+/*
+ * Select the instruction set used by batch's kernels, overriding the
+ * choice made by EB_compile. Intended for testing and benchmarking.
+ *
+ * Parameters:
+ *   batch    The program
+ *   isa      "avx512f", "avx2" or "scalar"
+ *
+ * Returns: true on success, false if isa is unknown or not supported
+ *   by this CPU
+ */
+bool EB_use_isa(ExprBatch batch, const char *isa);
+
+#endif /* _EXPR_BATCH_H_ */
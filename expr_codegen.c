@@ -0,0 +1,580 @@
+/*
+ * expr_codegen.c
+ *
+ * Ahead-of-time compilation of an ExprTree to native code. See
+ * expr_codegen.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "expr_codegen.h"
+#include "expr_tree_internal.h"
+
+// the name given to the function in cached objects
+#define CACHE_FN_NAME "ew_expr"
+
+extern char **environ;
+
+typedef double (*CE_fn)(double *vars);
+
+struct _compiled_expr
+{
+  void *handle;
+  CE_fn fn;
+  int num_vars;
+  const char *const *var_names;
+  uint64_t hash;
+};
+
+struct _cg_emitter
+{
+  FILE *out;
+  char (*names)[SYMBOL_MAX_SIZE + 1];
+  int num_names;
+  int num_temps;
+};
+
+/*
+ * Find the variable number of a symbol, adding it to the emitter's
+ * list if it has not been seen before
+ *
+ * Parameters:
+ *   e        The emitter
+ *   symbol   The symbol
+ *
+ * Returns: The index of symbol in vars
+ */
+static int _CG_var_index(struct _cg_emitter *e, const char *symbol)
+{
+  for (int i = 0; i < e->num_names; i++)
+    if (strcmp(e->names[i], symbol) == 0)
+      return i;
+
+  e->names = realloc(e->names, sizeof(e->names[0]) * (e->num_names + 1));
+  assert(e->names != NULL);
+  strcpy(e->names[e->num_names], symbol);
+  return e->num_names++;
+}
+
+/*
+ * Number the symbols of a subtree in evaluation order, and check that
+ * every assignment is to a symbol
+ *
+ * Parameters:
+ *   e        The emitter
+ *   tree     The subtree
+ *
+ * Returns: true on success, false if an assignment is to something
+ *   other than a symbol
+ */
+static bool _CG_collect(struct _cg_emitter *e, ExprTree tree)
+{
+  if (tree == NULL || tree->type == VALUE)
+    return true;
+
+  if (tree->type == SYMBOL)
+  {
+    _CG_var_index(e, tree->n.symbol);
+    return true;
+  }
+
+  if (tree->type == OP_ASSIGN && tree->n.child[LEFT]->type != SYMBOL)
+    return false;
+
+  return _CG_collect(e, tree->n.child[LEFT]) && _CG_collect(e, tree->n.child[RIGHT]);
+}
+
+/*
+ * Write a double as a C expression that reproduces it exactly
+ *
+ * Parameters:
+ *   out      The stream
+ *   value    The value
+ *
+ * Returns: None
+ */
+static void _CG_write_double(FILE *out, double value)
+{
+  if (isnan(value))
+    fprintf(out, "NAN");
+  else if (isinf(value))
+    fprintf(out, "%sINFINITY", value < 0 ? "-" : "");
+  else
+    fprintf(out, "%a", value);
+}
+
+/*
+ * Write a string as a C string literal
+ *
+ * Parameters:
+ *   out      The stream
+ *   str      The string
+ *
+ * Returns: None
+ */
+static void _CG_write_string(FILE *out, const char *str)
+{
+  fputc('"', out);
+  for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++)
+  {
+    if (*p == '"' || *p == '\\' || *p < ' ' || *p > '~')
+      fprintf(out, "\\%03o", *p);
+    else
+      fputc(*p, out);
+  }
+  fputc('"', out);
+}
+
+static int _CG_emit_node(struct _cg_emitter *e, ExprTree tree);
+
+/*
+ * Write the statements for an OP_POWER node with a constant exponent.
+ * An integral power is unrolled into the same multiplications as
+ * ET_powi, so the compiled code agrees with ET_evaluate bit for bit.
+ *
+ * Parameters:
+ *   e        The emitter
+ *   tree     The OP_POWER node, which must not be POW_GENERAL
+ *
+ * Returns: The number of the temporary holding the node's value
+ */
+static int _CG_emit_power(struct _cg_emitter *e, ExprTree tree)
+{
+  int base = _CG_emit_node(e, tree->n.child[LEFT]);
+  int t = e->num_temps++;
+
+  if (tree->n.pow_kind == POW_SQRT)
+  {
+    fprintf(e->out, "  const double t%d = (t%d == 0 || isinf(t%d)) ? fabs(t%d) : sqrt(t%d);\n",
+            t, base, base, base, base);
+    return t;
+  }
+
+  int exp = tree->n.pow_exp;
+  unsigned int m = (exp < 0) ? -(unsigned int)exp : (unsigned int)exp;
+  int result = t;
+
+  fprintf(e->out, "  const double t%d = 1;\n", result);
+  while (m != 0)
+  {
+    if (m & 1)
+    {
+      t = e->num_temps++;
+      fprintf(e->out, "  const double t%d = t%d * t%d;\n", t, result, base);
+      result = t;
+    }
+    m >>= 1;
+    if (m != 0)
+    {
+      t = e->num_temps++;
+      fprintf(e->out, "  const double t%d = t%d * t%d;\n", t, base, base);
+      base = t;
+    }
+  }
+
+  if (exp < 0)
+  {
+    t = e->num_temps++;
+    fprintf(e->out, "  const double t%d = 1 / t%d;\n", t, result);
+    result = t;
+  }
+
+  return result;
+}
+
+/*
+ * Write the statements that compute a subtree. Each node's value is
+ * held in a temporary of its own, computed in the same order as
+ * ET_evaluate visits the nodes, so that reads and assignments of a
+ * variable interleave exactly as they do there.
+ *
+ * Parameters:
+ *   e        The emitter
+ *   tree     The subtree
+ *
+ * Returns: The number of the temporary holding the subtree's value
+ */
+static int _CG_emit_node(struct _cg_emitter *e, ExprTree tree)
+{
+  if (tree == NULL || tree->type == VALUE)
+  {
+    int t = e->num_temps++;
+
+    fprintf(e->out, "  const double t%d = ", t);
+    _CG_write_double(e->out, (tree == NULL) ? 0 : tree->n.value);
+    fprintf(e->out, ";\n");
+    return t;
+  }
+
+  if (tree->type == SYMBOL)
+  {
+    int t = e->num_temps++;
+
+    fprintf(e->out, "  const double t%d = vars[%d];\n", t, _CG_var_index(e, tree->n.symbol));
+    return t;
+  }
+
+  if (tree->type == OP_POWER && tree->n.pow_kind != POW_GENERAL)
+    return _CG_emit_power(e, tree);
+
+  int left = _CG_emit_node(e, tree->n.child[LEFT]);
+  int right = _CG_emit_node(e, tree->n.child[RIGHT]);
+  int t = e->num_temps++;
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    fprintf(e->out, "  const double t%d = t%d + t%d;\n", t, left, right);
+    break;
+  case OP_SUB:
+    fprintf(e->out, "  const double t%d = t%d - t%d;\n", t, left, right);
+    break;
+  case OP_MUL:
+    fprintf(e->out, "  const double t%d = t%d * t%d;\n", t, left, right);
+    break;
+  case OP_DIV:
+    fprintf(e->out, "  const double t%d = (t%d == 0) ? NAN : t%d / t%d;\n", t, right, left, right);
+    break;
+  case OP_POWER:
+    fprintf(e->out, "  const double t%d = pow(t%d, t%d);\n", t, left, right);
+    break;
+  case UNARY_NEGATE:
+    fprintf(e->out, "  const double t%d = -t%d;\n", t, left);
+    break;
+  case OP_ASSIGN:
+    // like CD_store, an assignment of NaN leaves the variable unchanged
+    fprintf(e->out, "  if (!isnan(t%d))\n    vars[%d] = t%d;\n", right,
+            _CG_var_index(e, tree->n.child[LEFT]->n.symbol), right);
+    fprintf(e->out, "  const double t%d = t%d;\n", t, right);
+    break;
+  default:
+    assert(0);
+  }
+
+  return t;
+}
+
+// Documented in .h file
+int ET_emit_c(ExprTree tree, const char *fn_name, FILE *out, char *errmsg, size_t errmsg_sz)
+{
+  struct _cg_emitter e = {out, NULL, 0, 0};
+
+  if (!_CG_collect(&e, tree))
+  {
+    free(e.names);
+    snprintf(errmsg, errmsg_sz, "Syntax error on token EQUAL");
+    return -1;
+  }
+
+  fprintf(out, "/* Generated by ET_emit_c */\n");
+  fprintf(out, "#include <math.h>\n\n");
+  fprintf(out, "const int %s_num_vars = %d;\n", fn_name, e.num_names);
+  fprintf(out, "const char *const %s_var_names[] = {", fn_name);
+  for (int i = 0; i < e.num_names; i++)
+  {
+    _CG_write_string(out, e.names[i]);
+    fprintf(out, ", ");
+  }
+  fprintf(out, "0};\n\n");
+
+  fprintf(out, "double %s(double *vars)\n{\n", fn_name);
+  int result = _CG_emit_node(&e, tree);
+  fprintf(out, "  return t%d;\n}\n", result);
+
+  int num_vars = e.num_names;
+  free(e.names);
+  return num_vars;
+}
+
+/*
+ * Compute the 64-bit FNV-1a hash of a buffer
+ *
+ * Parameters:
+ *   buf      The buffer
+ *   len      The number of bytes in buf
+ *
+ * Returns: The hash
+ */
+static uint64_t _CG_hash(const char *buf, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)buf[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/*
+ * Run the C compiler to build a shared object from a source file
+ *
+ * Parameters:
+ *   src      The path of the source file
+ *   obj      The path of the shared object to create
+ *   errmsg   Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: true on success, false on error
+ */
+static bool _CG_run_compiler(const char *src, const char *obj, char *errmsg, size_t errmsg_sz)
+{
+  const char *cc = getenv("CC");
+
+  if (cc == NULL || *cc == '\0')
+    cc = "gcc";
+
+  char *argv[] = {(char *)cc, "-O2", "-shared", "-fPIC", "-o", (char *)obj, (char *)src, "-lm", NULL};
+  pid_t pid;
+  int status;
+
+  int rc = posix_spawnp(&pid, cc, NULL, NULL, argv, environ);
+  if (rc != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot run %s: %s", cc, strerror(rc));
+    return false;
+  }
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "%s failed to compile %s", cc, src);
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Write the generated source into the cache and compile it. Both
+ * files are built under temporary names and renamed into place, so a
+ * concurrent ET_compile never sees a partial file.
+ *
+ * Parameters:
+ *   source     The generated source
+ *   len        The length of source
+ *   src_path   The path of the cached source file
+ *   obj_path   The path of the cached shared object
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: true on success, false on error
+ */
+static bool _CG_build(const char *source, size_t len, const char *src_path, const char *obj_path,
+                      char *errmsg, size_t errmsg_sz)
+{
+  char tmp_src[FILENAME_MAX + 16], tmp_obj[FILENAME_MAX + 16];
+  bool ok = false;
+
+  snprintf(tmp_src, sizeof(tmp_src), "%s.%d.c", obj_path, (int)getpid());
+  snprintf(tmp_obj, sizeof(tmp_obj), "%s.%d.tmp", obj_path, (int)getpid());
+
+  FILE *f = fopen(tmp_src, "w");
+  if (f == NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot write %s: %s", tmp_src, strerror(errno));
+    return false;
+  }
+  bool written = (fwrite(source, 1, len, f) == len);
+  if (fclose(f) != 0 || !written)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot write %s", tmp_src);
+    goto build_end;
+  }
+
+  if (!_CG_run_compiler(tmp_src, tmp_obj, errmsg, errmsg_sz))
+    goto build_end;
+
+  if (rename(tmp_obj, obj_path) != 0 || rename(tmp_src, src_path) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot rename into %s: %s", obj_path, strerror(errno));
+    goto build_end;
+  }
+  ok = true;
+
+build_end:
+  unlink(tmp_src);
+  unlink(tmp_obj);
+  return ok;
+}
+
+/*
+ * Is the source cached at a path exactly the given source?
+ *
+ * Parameters:
+ *   src_path   The path of the cached source file
+ *   source     The generated source
+ *   len        The length of source
+ *
+ * Returns: true if the file holds source byte for byte, false if it
+ *   differs or cannot be read
+ */
+static bool _CG_source_matches(const char *src_path, const char *source, size_t len)
+{
+  FILE *f = fopen(src_path, "r");
+  if (f == NULL)
+    return false;
+
+  char buf[4096];
+  size_t pos = 0, n;
+  bool same = true;
+
+  while (same && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+  {
+    same = (pos + n <= len && memcmp(buf, source + pos, n) == 0);
+    pos += n;
+  }
+  fclose(f);
+
+  return same && pos == len;
+}
+
+/*
+ * Load a cached shared object and check that it was compiled from the
+ * expected source
+ *
+ * Parameters:
+ *   obj_path     The path of the shared object
+ *   num_vars     The number of variables the expression reads
+ *   source_hash  The FNV-1a hash of the emitted source, which the
+ *                object records in CACHE_FN_NAME "_source_hash"
+ *   errmsg       Return space for an error message, filled in in case of error
+ *   errmsg_sz    The size of errmsg
+ *
+ * Returns: The compiled expression, or NULL on error
+ */
+static CompiledExpr _CG_load(const char *obj_path, int num_vars, uint64_t source_hash,
+                             char *errmsg, size_t errmsg_sz)
+{
+  void *handle = dlopen(obj_path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot load %s: %s", obj_path, dlerror());
+    return NULL;
+  }
+
+  CompiledExpr ce = malloc(sizeof(struct _compiled_expr));
+  assert(ce != NULL);
+
+  ce->handle = handle;
+  ce->fn = (CE_fn)dlsym(handle, CACHE_FN_NAME);
+  const int *num_vars_sym = dlsym(handle, CACHE_FN_NAME "_num_vars");
+  const unsigned long long *source_hash_sym = dlsym(handle, CACHE_FN_NAME "_source_hash");
+  ce->var_names = dlsym(handle, CACHE_FN_NAME "_var_names");
+
+  if (ce->fn == NULL || num_vars_sym == NULL || ce->var_names == NULL || source_hash_sym == NULL
+      || *num_vars_sym != num_vars || *source_hash_sym != source_hash)
+  {
+    snprintf(errmsg, errmsg_sz, "%s is not the compiled expression", obj_path);
+    CE_free(ce);
+    return NULL;
+  }
+  ce->num_vars = num_vars;
+
+  return ce;
+}
+
+// Documented in .h file
+CompiledExpr ET_compile(ExprTree tree, const char *cache_dir, char *errmsg, size_t errmsg_sz)
+{
+  char *source = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&source, &len);
+  assert(out != NULL);
+
+  int num_vars = ET_emit_c(tree, CACHE_FN_NAME, out, errmsg, errmsg_sz);
+
+  if (num_vars < 0)
+  {
+    fclose(out);
+    free(source);
+    return NULL;
+  }
+
+  // stamp the object with the hash of the text it was compiled from,
+  // so that one left under the same name by another source is caught
+  fflush(out);
+  uint64_t source_hash = _CG_hash(source, len);
+  fprintf(out, "\nconst unsigned long long %s_source_hash = 0x%016llxULL;\n",
+          CACHE_FN_NAME, (unsigned long long)source_hash);
+  fclose(out);
+
+  // the cache is keyed on the tree's structure; the source is compared
+  // in full before a cached object is trusted
+  uint64_t hash = ET_hash(tree);
+  char src_path[FILENAME_MAX], obj_path[FILENAME_MAX];
+
+  snprintf(src_path, sizeof(src_path), "%s/ew_%016llx.c", cache_dir, (unsigned long long)hash);
+  if (snprintf(obj_path, sizeof(obj_path), "%s/ew_%016llx.so", cache_dir, (unsigned long long)hash) >= sizeof(obj_path))
+  {
+    free(source);
+    snprintf(errmsg, errmsg_sz, "Cache directory name too long");
+    return NULL;
+  }
+
+  bool cached = _CG_source_matches(src_path, source, len) && access(obj_path, R_OK) == 0;
+  CompiledExpr ce = NULL;
+
+  if (cached)
+    ce = _CG_load(obj_path, num_vars, source_hash, errmsg, errmsg_sz);
+
+  // a missing, stale or foreign entry is rebuilt over
+  if (ce == NULL && _CG_build(source, len, src_path, obj_path, errmsg, errmsg_sz))
+    ce = _CG_load(obj_path, num_vars, source_hash, errmsg, errmsg_sz);
+  free(source);
+
+  if (ce != NULL)
+    ce->hash = hash;
+
+  return ce;
+}
+
+// Documented in .h file
+void CE_free(CompiledExpr ce)
+{
+  if (ce == NULL)
+    return;
+
+  dlclose(ce->handle);
+  free(ce);
+}
+
+// Documented in .h file
+double CE_evaluate(CompiledExpr ce, double *vars)
+{
+  return ce->fn(vars);
+}
+
+// Documented in .h file
+int CE_num_vars(CompiledExpr ce)
+{
+  return ce->num_vars;
+}
+
+// Documented in .h file
+const char *CE_var_name(CompiledExpr ce, int i)
+{
+  if (i < 0 || i >= ce->num_vars)
+    return NULL;
+
+  return ce->var_names[i];
+}
+
+// Documented in .h file
+uint64_t CE_hash(CompiledExpr ce)
+{
+  return ce->hash;
+}
@@ -0,0 +1,113 @@
+/*
+ * expr_codegen.h
+ *
+ * Ahead-of-time compilation of an ExprTree to native code. The tree is
+ * emitted as C source, compiled into a shared object by the system C
+ * compiler, and loaded with dlopen. Compiled objects are cached on
+ * disk, keyed by a hash of the tree's structure, so each distinct
+ * formula is only compiled once.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_CODEGEN_H_
+#define _EXPR_CODEGEN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "expr_tree.h"
+
+typedef struct _compiled_expr *CompiledExpr;
+
+/*
+ * Write C source for a function that evaluates tree, of the form
+ *
+ *   double <fn_name>(double *vars);
+ *
+ * The i'th entry of vars holds the value of the i'th distinct symbol
+ * in the tree, numbering the symbols in the order in which ET_evaluate
+ * first meets them. The source also defines
+ *
+ *   const int <fn_name>_num_vars;
+ *   const char *const <fn_name>_var_names[];
+ *
+ * which give the number of variables and their names. Assignments in
+ * the tree are stored back into vars. The function returns the same
+ * value as ET_evaluate, including NaN where a division by zero occurs.
+ *
+ * Parameters:
+ *   tree       The tree
+ *   fn_name    The name of the function, which must be a C identifier
+ *   out        The stream to write the source to
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The number of variables, or -1 if the tree cannot be
+ *   compiled (an assignment to something other than a symbol), in
+ *   which case an error message is copied into errmsg
+ */
+int ET_emit_c(ExprTree tree, const char *fn_name, FILE *out, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Compile tree to native code and load it. The cache in cache_dir is
+ * keyed on ET_hash(tree). If it already holds a shared object under
+ * that key whose source is the same as tree's, byte for byte, and
+ * which records the hash of that source, the object is loaded without
+ * running the compiler. Otherwise the source and the shared object are
+ * compiled and written over the entry for next time. The compiler is
+ * taken from the CC environment variable, defaulting to gcc.
+ *
+ * Parameters:
+ *   tree       The tree
+ *   cache_dir  An existing, writable directory for the compiled objects
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The compiled expression, or NULL on error, in which case an
+ *   error message is copied into errmsg
+ *
+ * It is the responsibility of the caller to call CE_free on the
+ * returned expression. The tree may be freed as soon as this returns.
+ */
+CompiledExpr ET_compile(ExprTree tree, const char *cache_dir, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Unload a compiled expression
+ *
+ * Parameters:
+ *   ce       The compiled expression
+ *
+ * Returns: None
+ */
+void CE_free(CompiledExpr ce);
+
+/*
+ * Evaluate a compiled expression
+ *
+ * Parameters:
+ *   ce       The compiled expression
+ *   vars     The variables, as described for ET_emit_c; assignments
+ *            made by the expression are stored back into vars
+ *
+ * Returns: The computed value
+ */
+double CE_evaluate(CompiledExpr ce, double *vars);
+
+/*
+ * Returns: The number of entries that CE_evaluate expects in vars
+ */
+int CE_num_vars(CompiledExpr ce);
+
+/*
+ * Returns: The name of the symbol held in vars[i], or NULL if i is out
+ *   of range
+ */
+const char *CE_var_name(CompiledExpr ce, int i);
+
+/*
+ * Returns: The structural hash under which ce is cached
+ */
+uint64_t CE_hash(CompiledExpr ce);
+
+#endif /* _EXPR_CODEGEN_H_ */
@@ -0,0 +1,596 @@
+/*
+ * expr_diff.c
+ *
+ * Automatic differentiation of ExprTrees. See expr_diff.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "expr_diff.h"
+#include "expr_tree_internal.h"
+
+// Tangents are processed in blocks of this many lanes, each held in a
+// GCC vector, so that the arithmetic on a block compiles to vector
+// instructions
+#define AD_LANES 4
+
+typedef double ADLanes __attribute__((vector_size(AD_LANES * sizeof(double))));
+typedef long long ADMask __attribute__((vector_size(AD_LANES * sizeof(double))));
+
+// The tangent of a symbol assigned earlier in the same evaluation
+struct _ad_assigned
+{
+  const char *name;
+  ADLanes *tangent;
+};
+
+// One operation recorded on a tape: the tape positions of its
+// arguments, and the derivative of its result with respect to each
+struct _ad_entry
+{
+  int arg[2]; // or -1 for a constant or missing argument
+  double partial[2];
+  double adjoint; // derivative of the tree's value with respect to the result
+  int slot;       // for a variable that is read, its place in grad
+};
+
+// The tape position of the value assigned to a symbol earlier in the
+// same evaluation
+struct _ad_assign
+{
+  const char *name;
+  int entry;
+};
+
+struct _ad_tape
+{
+  struct _ad_entry *entry;
+  int num_entries;
+  int entry_cap;
+  CDict slots;   // maps each symbol name that the tape has seen to a slot
+  double *grad;  // for each slot, the derivative with respect to that symbol
+  int num_slots;
+  int slot_cap;
+  struct _ad_assign *assigned;
+  int num_assigned;
+  int assigned_cap;
+  CDict vars;
+  ETError *err;
+};
+
+struct _ad_forward
+{
+  CDict vars;
+  const char *const *wrt;
+  int num_wrt;
+  int width;      // blocks of lanes in each tangent, enough for num_wrt lanes
+  ADLanes *stack; // room for the tangents of the children of each level of the tree
+  int top;        // blocks of stack in use
+  struct _ad_assigned *assigned;
+  int num_assigned;
+  ETError *err;
+};
+
+/*
+ * Set the tangent of a symbol node as it is read: the tangent of what
+ * was assigned to it earlier in the evaluation, if anything, and
+ * otherwise the unit seed of each lane that differentiates with
+ * respect to it
+ *
+ * Parameters:
+ *   ad       The evaluation
+ *   name     The symbol
+ *   tangent  Return space for the tangent
+ *
+ * Returns: None
+ */
+static void _AD_seed(struct _ad_forward *ad, const char *name, ADLanes *tangent)
+{
+  for (int a = ad->num_assigned - 1; a >= 0; a--)
+    if (strcmp(ad->assigned[a].name, name) == 0)
+    {
+      memcpy(tangent, ad->assigned[a].tangent, sizeof(ADLanes) * ad->width);
+      return;
+    }
+
+  memset(tangent, 0, sizeof(ADLanes) * ad->width);
+  for (int k = 0; k < ad->num_wrt; k++)
+    if (strcmp(ad->wrt[k], name) == 0)
+      tangent[k / AD_LANES][k % AD_LANES] = 1;
+}
+
+/*
+ * Remember the tangent of a symbol that has just been assigned, for
+ * later reads of it
+ *
+ * Parameters:
+ *   ad       The evaluation
+ *   name     The symbol
+ *   tangent  Its tangent
+ *
+ * Returns: None
+ */
+static void _AD_assign(struct _ad_forward *ad, const char *name, const ADLanes *tangent)
+{
+  int a;
+
+  for (a = 0; a < ad->num_assigned; a++)
+    if (strcmp(ad->assigned[a].name, name) == 0)
+      break;
+
+  if (a == ad->num_assigned)
+  {
+    ad->assigned = realloc(ad->assigned, sizeof(struct _ad_assigned) * (a + 1));
+    assert(ad->assigned != NULL);
+    ad->assigned[a].name = name;
+    ad->assigned[a].tangent = aligned_alloc(sizeof(ADLanes), sizeof(ADLanes) * (ad->width + 1));
+    assert(ad->assigned[a].tangent != NULL);
+    ad->num_assigned++;
+  }
+
+  memcpy(ad->assigned[a].tangent, tangent, sizeof(ADLanes) * ad->width);
+}
+
+/*
+ * Evaluate a subtree and its tangent, stopping at the first error
+ *
+ * Parameters:
+ *   ad       The evaluation
+ *   tree     The subtree
+ *   value    Return space for its value
+ *   tangent  Return space for its tangent, of ad->width blocks
+ *
+ * Returns: true on success, false if an error was recorded in ad->err
+ */
+static bool _AD_forward(struct _ad_forward *ad, ExprTree tree, double *value, ADLanes *tangent)
+{
+  int w = ad->width;
+
+  if (tree == NULL)
+  {
+    *value = 0;
+    memset(tangent, 0, sizeof(ADLanes) * w);
+    return true;
+  }
+
+  if (tree->type == VALUE)
+  {
+    *value = tree->n.value;
+    memset(tangent, 0, sizeof(ADLanes) * w);
+    return true;
+  }
+
+  if (tree->type == SYMBOL)
+  {
+    if (!ET_load_symbol(tree, ad->vars, value))
+    {
+      *ad->err = (ETError){ET_ERR_UNDEFINED, tree};
+      return false;
+    }
+    _AD_seed(ad, tree->n.symbol, tangent);
+    return true;
+  }
+
+  if (tree->type == OP_ASSIGN)
+  {
+    if (tree->n.child[LEFT]->type != SYMBOL)
+    {
+      *ad->err = (ETError){ET_ERR_BAD_ASSIGN, tree};
+      return false;
+    }
+    if (!_AD_forward(ad, tree->n.child[RIGHT], value, tangent))
+      return false;
+    ET_store_symbol(tree->n.child[LEFT], ad->vars, *value);
+    _AD_assign(ad, tree->n.child[LEFT]->n.symbol, tangent);
+    return true;
+  }
+
+  // the children's tangents live on the stack while this node uses them
+  double a, b, v;
+  ADLanes *da = ad->stack + ad->top;
+  ADLanes *db = da + w;
+  bool ok = false;
+
+  ad->top += 2 * w;
+
+  if (!_AD_forward(ad, tree->n.child[LEFT], &a, da))
+    goto forward_end;
+
+  if (tree->type == UNARY_NEGATE)
+  {
+    *value = -a;
+    for (int j = 0; j < w; j++)
+      tangent[j] = -da[j];
+    ok = true;
+    goto forward_end;
+  }
+
+  if (!_AD_forward(ad, tree->n.child[RIGHT], &b, db))
+    goto forward_end;
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    *value = a + b;
+    for (int j = 0; j < w; j++)
+      tangent[j] = da[j] + db[j];
+    break;
+
+  case OP_SUB:
+    *value = a - b;
+    for (int j = 0; j < w; j++)
+      tangent[j] = da[j] - db[j];
+    break;
+
+  case OP_MUL:
+    *value = a * b;
+    for (int j = 0; j < w; j++)
+      tangent[j] = da[j] * b + a * db[j];
+    break;
+
+  case OP_DIV:
+    if (b == 0)
+    {
+      *ad->err = (ETError){ET_ERR_DIV_BY_ZERO, tree};
+      goto forward_end;
+    }
+    // (a / b)' = (a' - (a / b) * b') / b
+    v = a / b;
+    *value = v;
+    for (int j = 0; j < w; j++)
+      tangent[j] = (da[j] - v * db[j]) / b;
+    break;
+
+  case OP_POWER:
+  {
+    double d_base, d_exp = 0;
+
+    v = ET_power(tree, a, b);
+    *value = v;
+
+    // the derivatives of v with respect to the base and the exponent;
+    // a specialized power has a constant exponent
+    switch (tree->n.pow_kind)
+    {
+    case POW_INTEGER:
+      d_base = (tree->n.pow_exp == 0) ? 0 : tree->n.pow_exp * ET_powi(a, tree->n.pow_exp - 1);
+      break;
+    case POW_SQRT:
+      d_base = 0.5 / v;
+      break;
+    default:
+      // where v is 0 the base is 0, and v * log(a) tends to 0
+      d_base = b * pow(a, b - 1);
+      d_exp = (v == 0) ? 0 : v * log(a);
+    }
+
+    // each term is masked to zero where its tangent is zero, so that
+    // 0 * inf gives no NaN, and then the two are added
+    for (int j = 0; j < w; j++)
+      tangent[j] = (ADLanes)((ADMask)(da[j] * d_base) & (da[j] != 0)) +
+                   (ADLanes)((ADMask)(db[j] * d_exp) & (db[j] != 0));
+    break;
+  }
+
+  default:
+    assert(0);
+  }
+  ok = true;
+
+forward_end:
+  ad->top -= 2 * w;
+  return ok;
+}
+
+// Documented in .h file
+ETErrorCode ET_derivatives(ExprTree tree, CDict vars, const char *const wrt[], int num_wrt, double *value,
+                           double partials[], ETError *err)
+{
+  ETError local;
+  int width = (num_wrt + AD_LANES - 1) / AD_LANES;
+  int depth = ET_depth(tree);
+  struct _ad_forward ad = {vars, wrt, num_wrt, width, NULL, 0, NULL, 0, (err == NULL) ? &local : err};
+  ADLanes *tangent = aligned_alloc(sizeof(ADLanes), sizeof(ADLanes) * (width * (2 * depth + 1) + 1));
+  double result;
+  bool ok;
+
+  assert(num_wrt >= 0 && tangent != NULL);
+  ad.stack = tangent + width;
+
+  ok = _AD_forward(&ad, tree, &result, tangent);
+  if (ok)
+  {
+    *value = result;
+    memcpy(partials, tangent, sizeof(double) * num_wrt);
+  }
+
+  for (int a = 0; a < ad.num_assigned; a++)
+    free(ad.assigned[a].tangent);
+  free(ad.assigned);
+  free(tangent);
+
+  return ok ? ET_OK : ad.err->code;
+}
+
+/*
+ * Append an operation to a tape
+ *
+ * Parameters:
+ *   tape     The tape
+ *   arg0     The tape position of the first argument, or -1
+ *   p0       The derivative with respect to the first argument
+ *   arg1     The tape position of the second argument, or -1
+ *   p1       The derivative with respect to the second argument
+ *   slot     The slot of a variable that is read, or -1
+ *
+ * Returns: The tape position of the operation
+ */
+static int _AD_push(ADTape tape, int arg0, double p0, int arg1, double p1, int slot)
+{
+  if (tape->num_entries == tape->entry_cap)
+  {
+    tape->entry_cap *= 2;
+    tape->entry = realloc(tape->entry, sizeof(struct _ad_entry) * tape->entry_cap);
+    assert(tape->entry != NULL);
+  }
+
+  tape->entry[tape->num_entries] = (struct _ad_entry){{arg0, arg1}, {p0, p1}, 0, slot};
+  return tape->num_entries++;
+}
+
+/*
+ * Returns: The slot in which a tape accumulates the derivative with
+ *   respect to a symbol, allocating one if it has not seen the symbol
+ */
+static int _AD_slot(ADTape tape, char *name)
+{
+  CDictCell cell = CD_find_or_add(tape->slots, name, tape->num_slots);
+  int slot = (int)CD_cell_load(tape->slots, cell);
+
+  if (slot < tape->num_slots)
+    return slot;
+
+  if (tape->num_slots == tape->slot_cap)
+  {
+    tape->slot_cap *= 2;
+    tape->grad = realloc(tape->grad, sizeof(double) * tape->slot_cap);
+    assert(tape->grad != NULL);
+  }
+
+  return tape->num_slots++;
+}
+
+/*
+ * Evaluate a subtree, recording its operations on a tape, and stopping
+ * at the first error
+ *
+ * Parameters:
+ *   tape     The tape
+ *   tree     The subtree
+ *   value    Return space for its value
+ *   pos      Return space for the tape position of its result, or -1
+ *            if the subtree is constant
+ *
+ * Returns: true on success, false if an error was recorded in tape->err
+ */
+static bool _AD_record(ADTape tape, ExprTree tree, double *value, int *pos)
+{
+  double a, b, v;
+  int pa, pb;
+
+  *pos = -1;
+
+  if (tree == NULL)
+  {
+    *value = 0;
+    return true;
+  }
+
+  switch (tree->type)
+  {
+  case VALUE:
+    *value = tree->n.value;
+    return true;
+
+  case SYMBOL:
+    if (!ET_load_symbol(tree, tape->vars, value))
+    {
+      *tape->err = (ETError){ET_ERR_UNDEFINED, tree};
+      return false;
+    }
+    // a symbol assigned earlier passes its adjoint on to what was assigned
+    for (int s = tape->num_assigned - 1; s >= 0; s--)
+      if (strcmp(tape->assigned[s].name, tree->n.symbol) == 0)
+      {
+        *pos = tape->assigned[s].entry;
+        return true;
+      }
+    *pos = _AD_push(tape, -1, 0, -1, 0, _AD_slot(tape, tree->n.symbol));
+    return true;
+
+  case OP_ASSIGN:
+    if (tree->n.child[LEFT]->type != SYMBOL)
+    {
+      *tape->err = (ETError){ET_ERR_BAD_ASSIGN, tree};
+      return false;
+    }
+    if (!_AD_record(tape, tree->n.child[RIGHT], value, pos))
+      return false;
+    ET_store_symbol(tree->n.child[LEFT], tape->vars, *value);
+
+    if (tape->num_assigned == tape->assigned_cap)
+    {
+      tape->assigned_cap *= 2;
+      tape->assigned = realloc(tape->assigned, sizeof(struct _ad_assign) * tape->assigned_cap);
+      assert(tape->assigned != NULL);
+    }
+    tape->assigned[tape->num_assigned++] = (struct _ad_assign){tree->n.child[LEFT]->n.symbol, *pos};
+    return true;
+
+  case UNARY_NEGATE:
+    if (!_AD_record(tape, tree->n.child[LEFT], &a, &pa))
+      return false;
+    *value = -a;
+    if (pa >= 0)
+      *pos = _AD_push(tape, pa, -1, -1, 0, -1);
+    return true;
+
+  default:
+    if (!_AD_record(tape, tree->n.child[LEFT], &a, &pa) || !_AD_record(tape, tree->n.child[RIGHT], &b, &pb))
+      return false;
+  }
+
+  double p0, p1;
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    v = a + b;
+    p0 = 1;
+    p1 = 1;
+    break;
+
+  case OP_SUB:
+    v = a - b;
+    p0 = 1;
+    p1 = -1;
+    break;
+
+  case OP_MUL:
+    v = a * b;
+    p0 = b;
+    p1 = a;
+    break;
+
+  case OP_DIV:
+    if (b == 0)
+    {
+      *tape->err = (ETError){ET_ERR_DIV_BY_ZERO, tree};
+      return false;
+    }
+    v = a / b;
+    p0 = 1 / b;
+    p1 = -v / b;
+    break;
+
+  case OP_POWER:
+    v = ET_power(tree, a, b);
+    p1 = 0;
+    switch (tree->n.pow_kind)
+    {
+    case POW_INTEGER:
+      p0 = (tree->n.pow_exp == 0) ? 0 : tree->n.pow_exp * ET_powi(a, tree->n.pow_exp - 1);
+      break;
+    case POW_SQRT:
+      p0 = 0.5 / v;
+      break;
+    default:
+      p0 = b * pow(a, b - 1);
+      p1 = (v == 0) ? 0 : v * log(a);
+    }
+    break;
+
+  default:
+    assert(0);
+    return false;
+  }
+
+  *value = v;
+  if (pa >= 0 || pb >= 0)
+    *pos = _AD_push(tape, pa, p0, pb, p1, -1);
+  return true;
+}
+
+// Documented in .h file
+ADTape AD_tape_new()
+{
+  ADTape tape = malloc(sizeof(struct _ad_tape));
+  assert(tape != NULL);
+
+  tape->entry_cap = 64;
+  tape->entry = malloc(sizeof(struct _ad_entry) * tape->entry_cap);
+  tape->num_entries = 0;
+  tape->slots = CD_new();
+  tape->slot_cap = 16;
+  tape->grad = malloc(sizeof(double) * tape->slot_cap);
+  tape->num_slots = 0;
+  tape->assigned_cap = 4;
+  tape->assigned = malloc(sizeof(struct _ad_assign) * tape->assigned_cap);
+  tape->num_assigned = 0;
+  assert(tape->entry != NULL && tape->slots != NULL && tape->grad != NULL && tape->assigned != NULL);
+
+  return tape;
+}
+
+// Documented in .h file
+void AD_tape_free(ADTape tape)
+{
+  if (tape == NULL)
+    return;
+
+  CD_free(tape->slots);
+  free(tape->entry);
+  free(tape->grad);
+  free(tape->assigned);
+  free(tape);
+}
+
+// Documented in .h file
+ETErrorCode AD_gradient(ADTape tape, ExprTree tree, CDict vars, const char *const wrt[], int num_wrt,
+                        double *value, double partials[], ETError *err)
+{
+  ETError local;
+  double result;
+  int root;
+
+  tape->vars = vars;
+  tape->err = (err == NULL) ? &local : err;
+  tape->num_entries = 0;
+  tape->num_assigned = 0;
+
+  if (!_AD_record(tape, tree, &result, &root))
+    return tape->err->code;
+
+  // the backward sweep: each operation comes after its arguments
+  for (int s = 0; s < tape->num_slots; s++)
+    tape->grad[s] = 0;
+  if (root >= 0)
+    tape->entry[root].adjoint = 1;
+
+  for (int i = tape->num_entries - 1; i >= 0; i--)
+  {
+    struct _ad_entry *e = &tape->entry[i];
+
+    // as in forward mode, a zero factor of the chain rule contributes
+    // nothing, so that 0 * inf gives no NaN
+    if (e->adjoint == 0)
+      continue;
+    if (e->slot >= 0)
+      tape->grad[e->slot] += e->adjoint;
+    for (int c = 0; c < 2; c++)
+      if (e->arg[c] >= 0 && e->partial[c] != 0)
+        tape->entry[e->arg[c]].adjoint += e->adjoint * e->partial[c];
+  }
+
+  *value = result;
+  for (int k = 0; k < num_wrt; k++)
+  {
+    char *name = (char *)wrt[k];
+
+    partials[k] = CD_contains(tape->slots, name) ? tape->grad[(int)CD_retrieve(tape->slots, name)] : 0;
+  }
+
+  return ET_OK;
+}
+
+// Documented in .h file
+int AD_tape_size(ADTape tape)
+{
+  return tape->num_entries;
+}
@@ -0,0 +1,116 @@
+/*
+ * expr_diff.h
+ *
+ * Automatic differentiation of ExprTrees. The partial derivatives of a
+ * tree with respect to a chosen set of its symbols are computed
+ * exactly, alongside its value, rather than by finite differences.
+ * Forward mode, ET_derivatives, suits a few symbols; reverse mode,
+ * AD_gradient, costs the same however many symbols there are.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_DIFF_H_
+#define _EXPR_DIFF_H_
+
+#include "expr_tree.h"
+#include "cdict.h"
+
+/*
+ * Evaluate a tree and its partial derivatives by forward-mode
+ * automatic differentiation. Each node is evaluated to its value
+ * together with one tangent per symbol in wrt, and the tangents are
+ * carried through the tree in blocks of lanes that the compiler
+ * vectorizes, so every partial derivative comes out of one pass.
+ *
+ * The value, the errors and the assignments made are exactly those of
+ * ET_evaluate_checked. A symbol that the tree assigns and then reads
+ * again carries the derivative of what was assigned to it. The
+ * derivative of x ^ y is y * x ^ (y - 1) with respect to x and
+ * x ^ y * log(x) with respect to y; a term whose tangent is zero
+ * contributes nothing, so that, for instance, x ^ 2.5 at x = -1 has a
+ * NaN value but a zero derivative with respect to a symbol it does
+ * not depend on.
+ *
+ * Parameters:
+ *   tree      The tree
+ *   vars      The variables, as for ET_evaluate_checked
+ *   wrt       The names of the symbols to differentiate with respect to
+ *   num_wrt   The number of names in wrt
+ *   value     Return space for the value of the tree
+ *   partials  Return space for num_wrt partial derivatives, in the
+ *             order of wrt; a symbol that the tree does not read has
+ *             a partial derivative of 0
+ *   err       Return space for a description of the error, or NULL
+ *
+ * Returns: ET_OK on success, otherwise the error, in which case value
+ *   and partials are left unchanged
+ */
+ETErrorCode ET_derivatives(ExprTree tree, CDict vars, const char *const wrt[], int num_wrt, double *value,
+                           double partials[], ETError *err);
+
+typedef struct _ad_tape *ADTape;
+
+/*
+ * Create an empty tape for AD_gradient
+ *
+ * Returns: The new tape
+ *
+ * It is the responsibility of the caller to call AD_tape_free on the
+ * tape.
+ */
+ADTape AD_tape_new();
+
+/*
+ * Destroy a tape
+ *
+ * Parameters:
+ *   tape     The tape
+ *
+ * Returns: None
+ */
+void AD_tape_free(ADTape tape);
+
+/*
+ * Evaluate a tree and its partial derivatives by reverse-mode
+ * automatic differentiation. A forward sweep evaluates the tree,
+ * recording each operation and the local derivatives of its result on
+ * tape; a backward sweep over the tape then accumulates the derivative
+ * of the result with respect to every symbol at once. The cost is a
+ * small multiple of one evaluation, whatever the number of symbols.
+ *
+ * The tape keeps its memory between calls, so evaluating the same
+ * tree again allocates nothing.
+ *
+ * The value, the errors and the assignments made are exactly those of
+ * ET_evaluate_checked. The derivatives are those that ET_derivatives
+ * gives, up to rounding, except where an infinite or undefined partial
+ * meets an argument whose derivative cancels to exactly zero, as in
+ * x^(y - y) at x = 0: forward mode sees the zero and gives 0, while
+ * this gives NaN.
+ *
+ * Parameters:
+ *   tape      The tape, whose previous contents are discarded
+ *   tree      The tree
+ *   vars      The variables, as for ET_evaluate_checked
+ *   wrt       The names of the symbols to report derivatives for
+ *   num_wrt   The number of names in wrt
+ *   value     Return space for the value of the tree
+ *   partials  Return space for num_wrt partial derivatives, in the
+ *             order of wrt; a symbol that the tree does not read has
+ *             a partial derivative of 0
+ *   err       Return space for a description of the error, or NULL
+ *
+ * Returns: ET_OK on success, otherwise the error, in which case value
+ *   and partials are left unchanged
+ */
+ETErrorCode AD_gradient(ADTape tape, ExprTree tree, CDict vars, const char *const wrt[], int num_wrt,
+                        double *value, double partials[], ETError *err);
+
+/*
+ * Returns: The number of operations that the last call to AD_gradient
+ *   recorded on tape
+ */
+int AD_tape_size(ADTape tape);
+
+#endif /* _EXPR_DIFF_H_ */
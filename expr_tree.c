@@ -9,23 +9,73 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "expr_tree.h"
+#include "expr_tree_internal.h"
 
-#define LEFT 0
-#define RIGHT 1
-#define SYMBOL_MAX_SIZE 31
+// Frames kept on the C stack by the tree printer before it spills to the heap
+#define WRITE_STACK_INLINE 64
 
-struct _expr_tree_node
+// Size of the buffer the streaming printers fill before each flush
+#define STREAM_CHUNK_SIZE 256
+
+// Identifies a file written by ET_save, and the version of its layout
+#define ET_FILE_MAGIC "EWXT"
+#define ET_FILE_VERSION 1
+
+// Written as a native uint32_t, to reject files from a machine of the
+// other byte order
+#define ET_FILE_BYTE_ORDER 0x01020304
+
+// Stands for a missing child in a file node
+#define ET_FILE_NONE ((uint32_t)-1)
+
+/*
+ * A file written by ET_save is laid out as
+ *
+ *   header
+ *   roots    num_trees uint32_t node indices, padded to 8 bytes
+ *   nodes    num_nodes file nodes, each after its children
+ *   strings  strings_size bytes of \0-terminated symbol names, each
+ *            distinct name stored once
+ *
+ * All fields are in the byte order of the machine that wrote the file.
+ */
+struct _et_file_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t num_trees;
+  uint32_t num_nodes;
+  uint32_t strings_size;
+  uint64_t reserved; // zero
+};
+
+struct _et_file_node
 {
-  ExprNodeType type;
+  uint32_t type; // an ExprNodeType
+  uint32_t name; // for SYMBOL, offset of the name in the strings
   union
   {
-    struct _expr_tree_node *child[2];
-    double value;
-    char symbol[SYMBOL_MAX_SIZE + 1];
-  } n;
+    double value;      // for VALUE
+    uint32_t child[2]; // for the rest, node indices or ET_FILE_NONE
+  };
+};
+
+struct _expr_image
+{
+  int num_trees;
+  ExprTree *root;
+  struct _expr_tree_node *node; // every node of every tree, in one block
 };
 
 /*
@@ -58,14 +108,106 @@ static char ExprNodeType_to_char(ExprNodeType ent)
   }
 }
 
+/*
+ * Scramble the bits of a 64-bit value (the finalizer of MurmurHash3)
+ *
+ * Parameters:
+ *   x        The value
+ *
+ * Returns: The scrambled value
+ */
+static uint64_t _ET_fmix(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  return x ^ (x >> 33);
+}
+
+/*
+ * Compute the structural hash of a new node from its own contents and
+ * the hashes already stored in its children, so that hashing a whole
+ * tree costs one step per node, spread over its construction
+ *
+ * Parameters:
+ *   tree     The node, with everything but its hash filled in
+ *
+ * Returns: The hash
+ */
+static uint64_t _ET_hash_node(ExprTree tree)
+{
+  switch (tree->type)
+  {
+  case VALUE:
+  {
+    uint64_t bits;
+
+    memcpy(&bits, &tree->n.value, sizeof(bits));
+    return _ET_fmix(bits ^ 0x6a09e667f3bcc909ULL);
+  }
+
+  case SYMBOL:
+  {
+    uint64_t fnv = 0xcbf29ce484222325ULL;
+
+    for (const char *p = tree->n.symbol; *p != '\0'; p++)
+      fnv = (fnv ^ (unsigned char)*p) * 0x100000001b3ULL;
+    return _ET_fmix(fnv);
+  }
+
+  default:
+  {
+    uint64_t left = (tree->n.child[LEFT] == NULL) ? 0 : tree->n.child[LEFT]->hash;
+    uint64_t right = (tree->n.child[RIGHT] == NULL) ? 0 : tree->n.child[RIGHT]->hash;
+
+    return _ET_fmix((left * 0x9e3779b97f4a7c15ULL + right) * 0xbf58476d1ce4e5b9ULL + tree->type);
+  }
+  }
+}
+
+/*
+ * Fill in a value node
+ *
+ * Parameters:
+ *   tree     The node
+ *   value    The value for the node
+ *
+ * Returns: None
+ */
+static void _ET_init_value(ExprTree tree, double value)
+{
+  tree->type = VALUE;
+  tree->has_assign = false;
+  tree->n.value = value;
+  tree->hash = _ET_hash_node(tree);
+}
+
+/*
+ * Fill in a symbol node
+ *
+ * Parameters:
+ *   tree     The node
+ *   symbol   The symbol for the node, truncated to SYMBOL_MAX_SIZE
+ *
+ * Returns: None
+ */
+static void _ET_init_symbol(ExprTree tree, const char *symbol)
+{
+  tree->type = SYMBOL;
+  tree->has_assign = false;
+  snprintf(tree->n.symbol, SYMBOL_MAX_SIZE + 1, "%s", symbol);
+  tree->n.cell = INVALID_CELL;
+  tree->hash = _ET_hash_node(tree);
+}
+
 // Documented in .h file
 ExprTree ET_value(double value)
 {
   ExprTree tree = malloc(sizeof(struct _expr_tree_node));
   assert(tree != NULL);
 
-  tree->type = VALUE;
-  tree->n.value = value;
+  _ET_init_value(tree, value);
   return tree;
 }
 
@@ -80,12 +222,75 @@ ExprTree ET_symbol(const char *symbol)
   ExprTree tree = malloc(sizeof(struct _expr_tree_node));
   assert(tree != NULL);
 
-  tree->type = SYMBOL;
-  snprintf(tree->n.symbol, SYMBOL_MAX_SIZE + 1, "%s", symbol);
+  _ET_init_symbol(tree, symbol);
 
   return tree;
 }
 
+/*
+ * Decide how an OP_POWER node with a given exponent is evaluated
+ *
+ * Parameters:
+ *   exponent The exponent subtree
+ *   n        Return space for the exponent, for POW_INTEGER
+ *
+ * Returns: The kind of power
+ */
+static PowKind _ET_pow_kind(ExprTree exponent, int *n)
+{
+  double value;
+  bool negate = false;
+
+  // the parser writes x^-2 as x ^ (-(2))
+  while (exponent->type == UNARY_NEGATE)
+  {
+    negate = !negate;
+    exponent = exponent->n.child[LEFT];
+  }
+
+  if (exponent->type != VALUE)
+    return POW_GENERAL;
+
+  value = negate ? -exponent->n.value : exponent->n.value;
+
+  if (value == 0.5)
+    return POW_SQRT;
+
+  if (fabs(value) <= POW_MAX_INTEGER && value == (int)value)
+  {
+    *n = (int)value;
+    return POW_INTEGER;
+  }
+
+  return POW_GENERAL;
+}
+
+/*
+ * Fill in an interior node
+ *
+ * Parameters:
+ *   tree     The node
+ *   op       The operator
+ *   left     Left side of the operator
+ *   right    Right side of the operator, NULL for UNARY_NEGATE
+ *
+ * Returns: None
+ */
+static void _ET_init_node(ExprTree tree, ExprNodeType op, ExprTree left, ExprTree right)
+{
+  tree->type = op;
+  tree->n.child[LEFT] = left;
+  tree->n.child[RIGHT] = right;
+  tree->n.pow_kind = POW_GENERAL;
+  tree->n.pow_exp = 0;
+
+  if (op == OP_POWER)
+    tree->n.pow_kind = _ET_pow_kind(right, &tree->n.pow_exp);
+
+  tree->has_assign = (op == OP_ASSIGN) || left->has_assign || (right != NULL && right->has_assign);
+  tree->hash = _ET_hash_node(tree);
+}
+
 // Documented in .h file
 ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
 {
@@ -97,9 +302,7 @@ ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right)
   ExprTree tree = malloc(sizeof(struct _expr_tree_node));
   assert(tree != NULL);
 
-  tree->type = op;
-  tree->n.child[LEFT] = left;
-  tree->n.child[RIGHT] = right;
+  _ET_init_node(tree, op, left, right);
 
   return tree;
 }
@@ -119,6 +322,30 @@ void ET_free(ExprTree tree)
   free(tree);
 }
 
+// Documented in .h file
+uint64_t ET_hash(ExprTree tree)
+{
+  return (tree == NULL) ? 0 : tree->hash;
+}
+
+// Documented in .h file
+bool ET_equal(ExprTree a, ExprTree b)
+{
+  if (a == b)
+    return true;
+
+  if (a == NULL || b == NULL || a->hash != b->hash || a->type != b->type)
+    return false;
+
+  if (a->type == VALUE)
+    return memcmp(&a->n.value, &b->n.value, sizeof(double)) == 0;
+
+  if (a->type == SYMBOL)
+    return strcmp(a->n.symbol, b->n.symbol) == 0;
+
+  return ET_equal(a->n.child[LEFT], b->n.child[LEFT]) && ET_equal(a->n.child[RIGHT], b->n.child[RIGHT]);
+}
+
 // Documented in .h file
 int ET_count(ExprTree tree)
 {
@@ -147,18 +374,138 @@ int ET_depth(ExprTree tree)
 }
 
 /*
- * Evaluate an ExprTree and return the resulting value
+ * Build a balanced chain of one operator over a run of operands,
+ * splitting it so that the left half has the extra operand
+ *
+ * Parameters:
+ *   op         OP_ADD or OP_MUL
+ *   operand    The operands, in order
+ *   n          The number of operands, at least 1
+ *   node       Spare interior nodes, n - 1 of which are used up
+ *
+ * Returns: The root of the chain
+ */
+static ExprTree _ET_build_balanced(ExprNodeType op, ExprTree *operand, int n, ExprTree **node)
+{
+  if (n == 1)
+    return operand[0];
+
+  int half = (n + 1) / 2;
+  ExprTree left = _ET_build_balanced(op, operand, half, node);
+  ExprTree right = _ET_build_balanced(op, operand + half, n - half, node);
+  ExprTree tree = *(*node)++;
+
+  _ET_init_node(tree, op, left, right);
+  return tree;
+}
+
+/*
+ * Gather the operands of the chain of one operator rooted at a node,
+ * in order, and the chain's own nodes, without recursing down the
+ * chain
  *
  * Parameters:
- * tree The tree to compute
- * vars A dictionary containing the variables known so far, which
- * may be modified by this function
- * errmsg Return space for an error message, filled in in case of error
- * errmsg_sz The size of errmsg
- *
- * Returns: The computed value on success. If a syntax error is
- * encountered, copies an error message into errmsg and returns NaN.
+ *   tree         The root of the chain
+ *   operand      Return space for the operands, which is allocated
+ *   node         Return space for the nodes of the chain, which is allocated
+ *
+ * Returns: The number of operands, which is one more than the number
+ *   of nodes
  */
+static int _ET_gather_chain(ExprTree tree, ExprTree **operand, ExprTree **node)
+{
+  int num_operands = 0, num_nodes = 0, top = 0, cap = 16;
+  ExprTree *stack = malloc(sizeof(ExprTree) * cap);
+
+  *operand = malloc(sizeof(ExprTree) * cap);
+  *node = malloc(sizeof(ExprTree) * cap);
+  assert(stack != NULL && *operand != NULL && *node != NULL);
+  stack[top++] = tree;
+
+  while (top > 0)
+  {
+    ExprTree t = stack[--top];
+
+    // each step adds one node or one operand, and pushes at most two
+    if (num_operands + 1 > cap || num_nodes + 1 > cap || top + 2 > cap)
+    {
+      cap *= 2;
+      stack = realloc(stack, sizeof(ExprTree) * cap);
+      *operand = realloc(*operand, sizeof(ExprTree) * cap);
+      *node = realloc(*node, sizeof(ExprTree) * cap);
+      assert(stack != NULL && *operand != NULL && *node != NULL);
+    }
+
+    if (t->type == tree->type)
+    {
+      (*node)[num_nodes++] = t;
+      stack[top++] = t->n.child[RIGHT];
+      stack[top++] = t->n.child[LEFT];
+    }
+    else
+      (*operand)[num_operands++] = t;
+  }
+
+  free(stack);
+  return num_operands;
+}
+
+// Documented in .h file
+ExprTree ET_rebalance(ExprTree tree)
+{
+  ExprTree *operand = NULL, *node = NULL;
+  int num_operands = 0;
+
+  if (tree == NULL || tree->type == VALUE || tree->type == SYMBOL)
+    return tree;
+
+  if (tree->type == OP_ADD || tree->type == OP_MUL)
+    num_operands = _ET_gather_chain(tree, &operand, &node);
+
+  if (num_operands <= 3)
+  {
+    // not a chain worth rebalancing: keep this node, and look below it
+    ExprTree left = ET_rebalance(tree->n.child[LEFT]);
+    ExprTree right = ET_rebalance(tree->n.child[RIGHT]);
+
+    _ET_init_node(tree, tree->type, left, right);
+  }
+  else
+  {
+    ExprTree *spare = node;
+
+    for (int i = 0; i < num_operands; i++)
+      operand[i] = ET_rebalance(operand[i]);
+    tree = _ET_build_balanced(tree->type, operand, num_operands, &spare);
+  }
+
+  free(operand);
+  free(node);
+  return tree;
+}
+
+// Documented in .h file
+int ET_bind(ExprTree tree, CDict vars)
+{
+  if (tree == NULL)
+    return 0;
+
+  if (tree->type == VALUE)
+    return 0;
+
+  if (tree->type == SYMBOL)
+  {
+    if (CD_find_cell(vars, tree->n.symbol, &tree->n.cell))
+      return 0;
+
+    tree->n.cell = INVALID_CELL;
+    return 1;
+  }
+
+  return ET_bind(tree->n.child[LEFT], vars) + ET_bind(tree->n.child[RIGHT], vars);
+}
+
+// Documented in .h file
 double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
 {
   if (tree == NULL)
@@ -169,12 +516,14 @@ double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
 
   if (tree->type == SYMBOL)
   {
-    if (CD_contains(vars, tree->n.symbol) == 0)
+    double value;
+
+    if (!ET_load_symbol(tree, vars, &value))
     {
       snprintf(errmsg, errmsg_sz, "Undefined variable: %s", tree->n.symbol);
       goto eval_end;
     }
-    return CD_retrieve(vars, tree->n.symbol);
+    return value;
   }
 
   double left = ET_evaluate(tree->n.child[LEFT], vars, errmsg, errmsg_sz);
@@ -196,7 +545,7 @@ double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
     }
     return left / right;
   case OP_POWER:
-    return pow(left, right);
+    return ET_power(tree, left, right);
   case UNARY_NEGATE:
     return -left;
   case OP_ASSIGN:
@@ -206,7 +555,7 @@ double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
       snprintf(errmsg, errmsg_sz, "Syntax error on token EQUAL");
       goto eval_end;
     }
-    CD_store(vars, tree->n.child[LEFT]->n.symbol, right);
+    ET_store_symbol(tree->n.child[LEFT], vars, right);
     return right;
 
   default:
@@ -217,75 +566,672 @@ double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz)
     return NAN;
 }
 
+/*
+ * Evaluate a subtree for ET_evaluate_checked, stopping at the first
+ * error
+ *
+ * Parameters:
+ *   tree     The subtree
+ *   vars     The variables
+ *   result   Return space for the value of the subtree
+ *   err      Return space for the error
+ *
+ * Returns: true on success, false if an error was recorded in err
+ */
+static bool _ET_eval_checked(ExprTree tree, CDict vars, double *result, ETError *err)
+{
+  double left = 0, right = 0;
+
+  if (tree == NULL)
+  {
+    *result = 0;
+    return true;
+  }
+
+  switch (tree->type)
+  {
+  case VALUE:
+    *result = tree->n.value;
+    return true;
+
+  case SYMBOL:
+    if (ET_load_symbol(tree, vars, result))
+      return true;
+    *err = (ETError){ET_ERR_UNDEFINED, tree};
+    return false;
+
+  case OP_ASSIGN:
+    if (tree->n.child[LEFT]->type != SYMBOL)
+    {
+      *err = (ETError){ET_ERR_BAD_ASSIGN, tree};
+      return false;
+    }
+    if (!_ET_eval_checked(tree->n.child[RIGHT], vars, &right, err))
+      return false;
+    ET_store_symbol(tree->n.child[LEFT], vars, right);
+    *result = right;
+    return true;
+
+  case UNARY_NEGATE:
+    if (!_ET_eval_checked(tree->n.child[LEFT], vars, &left, err))
+      return false;
+    *result = -left;
+    return true;
+
+  default:
+    if (!_ET_eval_checked(tree->n.child[LEFT], vars, &left, err) ||
+        !_ET_eval_checked(tree->n.child[RIGHT], vars, &right, err))
+      return false;
+  }
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    *result = left + right;
+    return true;
+  case OP_SUB:
+    *result = left - right;
+    return true;
+  case OP_MUL:
+    *result = left * right;
+    return true;
+  case OP_DIV:
+    if (right == 0)
+    {
+      *err = (ETError){ET_ERR_DIV_BY_ZERO, tree};
+      return false;
+    }
+    *result = left / right;
+    return true;
+  case OP_POWER:
+    *result = ET_power(tree, left, right);
+    return true;
+  default:
+    assert(0);
+    return false;
+  }
+}
+
 // Documented in .h file
-size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+ETErrorCode ET_evaluate_checked(ExprTree tree, CDict vars, double *result, ETError *err)
 {
-  if (tree == NULL || buf == NULL || buf_sz == 0)
-    return 0;
+  ETError local;
+  double value;
 
-  size_t length = 0;
-  char leftBuffer[buf_sz];
-  char rightBuffer[buf_sz];
+  if (err == NULL)
+    err = &local;
 
-  // write to buffer if it is a value
-  if (tree->type == VALUE)
-    length = snprintf(buf, buf_sz, "%g", tree->n.value);
+  if (!_ET_eval_checked(tree, vars, &value, err))
+    return err->code;
 
-  // write to buffer if it is a symbol
-  else if (tree->type == SYMBOL)
+  *result = value;
+  return ET_OK;
+}
+
+// Documented in .h file
+size_t ET_error_message(const ETError *err, char *buf, size_t buf_sz)
+{
+  int len = 0;
+
+  if (err == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  switch (err->code)
   {
-    length = snprintf(buf, buf_sz, "%s", tree->n.symbol);
+  case ET_OK:
+    len = snprintf(buf, buf_sz, "No error");
+    break;
+  case ET_ERR_UNDEFINED:
+    len = snprintf(buf, buf_sz, "Undefined variable: %s", err->node->n.symbol);
+    break;
+  case ET_ERR_DIV_BY_ZERO:
+    len = snprintf(buf, buf_sz, "Division by zero");
+    break;
+  case ET_ERR_BAD_ASSIGN:
+    len = snprintf(buf, buf_sz, "Syntax error on token EQUAL");
+    break;
   }
+
+  return ((size_t)len < buf_sz) ? (size_t)len : buf_sz - 1;
+}
+
+/*
+ * Output cursor used by the tree printers. Characters are appended at
+ * pos. A writer without a flush callback owns a fixed buffer: once it
+ * is full the writer stops and the output counts as truncated. A
+ * writer with a flush callback hands each full buffer to the callback
+ * and carries on, so only buf_sz bytes are ever held at once.
+ */
+struct _tree_writer
+{
+  char *buf;
+  size_t buf_sz;
+  size_t pos;
+  bool stopped;
+  ET_write_callback flush;
+  void *cb_data;
+  size_t flushed;
+};
+
+/*
+ * Hand the buffered characters to the writer's flush callback
+ *
+ * Parameters:
+ *   w        The writer
+ *
+ * Returns: None
+ */
+static void _TW_flush(struct _tree_writer *w)
+{
+  if (w->pos == 0 || w->stopped)
+    return;
+
+  if (w->flush(w->buf, w->pos, w->cb_data) != 0)
+    w->stopped = true;
   else
+    w->flushed += w->pos;
+
+  w->pos = 0;
+}
+
+/*
+ * Append len characters from str to the writer. A fixed buffer stores
+ * as many as fit while leaving room for the \0 terminator; a streaming
+ * writer flushes whenever its buffer fills.
+ *
+ * Parameters:
+ *   w        The writer
+ *   str      The characters to append
+ *   len      The number of characters in str
+ *
+ * Returns: None
+ */
+static void _TW_write(struct _tree_writer *w, const char *str, size_t len)
+{
+  while (len > 0 && !w->stopped)
   {
-    // process the left child
-    size_t leftLength = 0;
+    size_t room = w->buf_sz - w->pos - (w->flush == NULL ? 1 : 0);
 
-    if (tree->n.child[LEFT] != NULL)
-      leftLength = ET_tree2string(tree->n.child[LEFT], leftBuffer, buf_sz);
+    if (room == 0)
+    {
+      if (w->flush == NULL)
+        w->stopped = true;
+      else
+        _TW_flush(w);
+      continue;
+    }
 
-    // print to the buffer if unary negate
-    if (tree->type == UNARY_NEGATE)
-      length = snprintf(buf, buf_sz, "(-%s)", leftBuffer);
+    size_t n = (len < room) ? len : room;
+    memcpy(w->buf + w->pos, str, n);
+    w->pos += n;
+    str += n;
+    len -= n;
+  }
+}
 
-    else
+// One pending node in the printer's explicit traversal stack
+struct _write_frame
+{
+  ExprTree node;
+  int stage;
+};
+
+/*
+ * Print tree into the writer in a single left-to-right pass. The
+ * traversal keeps its own stack of pending nodes so that the C stack
+ * use does not depend on the depth of the tree, and it stops as soon
+ * as the writer stops accepting characters.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   w        The writer
+ *
+ * Returns: None
+ */
+static void _ET_write_tree(ExprTree tree, struct _tree_writer *w)
+{
+  struct _write_frame inline_stack[WRITE_STACK_INLINE];
+  struct _write_frame *stack = inline_stack;
+  size_t stack_cap = WRITE_STACK_INLINE;
+  size_t top = 0;
+  char text[32];
+
+  stack[top++] = (struct _write_frame){tree, 0};
+
+  while (top > 0 && !w->stopped)
+  {
+    ExprTree node = stack[top - 1].node;
+    ExprTree next = NULL;
+
+    if (node == NULL)
+    {
+      top--;
+      continue;
+    }
+
+    if (node->type == VALUE || node->type == SYMBOL)
     {
-      // process the right child
-      size_t rightLength = 0;
+      int len = (node->type == VALUE) ? snprintf(text, sizeof(text), "%g", node->n.value)
+                                      : snprintf(text, sizeof(text), "%s", node->n.symbol);
+      _TW_write(w, text, len);
+      top--;
+      continue;
+    }
 
-      if (tree->n.child[RIGHT] != NULL)
-        rightLength = ET_tree2string(tree->n.child[RIGHT], rightBuffer, buf_sz);
+    switch (stack[top - 1].stage++)
+    {
+    case 0:
+      _TW_write(w, node->type == UNARY_NEGATE ? "(-" : "(", node->type == UNARY_NEGATE ? 2 : 1);
+      next = node->n.child[LEFT];
+      break;
 
-      // print to the buffer both children
-      if (tree->n.child[LEFT]->type != VALUE && tree->n.child[LEFT]->type != SYMBOL)
+    case 1:
+      if (node->type == UNARY_NEGATE)
       {
-        char tempBuffer[buf_sz];
-        snprintf(tempBuffer, buf_sz, "%s", leftBuffer);
-        strcpy(leftBuffer, tempBuffer);
-        leftLength += 2;
+        _TW_write(w, ")", 1);
+        top--;
+        break;
       }
+      snprintf(text, sizeof(text), " %c ", ExprNodeType_to_char(node->type));
+      _TW_write(w, text, 3);
+      next = node->n.child[RIGHT];
+      break;
 
-      if (tree->n.child[RIGHT]->type != VALUE && tree->n.child[RIGHT]->type != SYMBOL)
-      {
-        char tempBuffer[buf_sz];
-        snprintf(tempBuffer, buf_sz, "%s", rightBuffer);
-        strcpy(rightBuffer, tempBuffer);
-        rightLength += 2;
-      }
+    default:
+      _TW_write(w, ")", 1);
+      top--;
+      break;
+    }
+
+    if (next == NULL)
+      continue;
 
-      // finally print to the buffer the whole expression
-      length = snprintf(buf, buf_sz, "(%s %c %s)", leftBuffer, ExprNodeType_to_char(tree->type), rightBuffer);
+    if (top == stack_cap)
+    {
+      struct _write_frame *bigger = malloc(sizeof(struct _write_frame) * stack_cap * 2);
+      assert(bigger != NULL);
+
+      memcpy(bigger, stack, sizeof(struct _write_frame) * top);
+      if (stack != inline_stack)
+        free(stack);
+
+      stack = bigger;
+      stack_cap *= 2;
     }
+
+    stack[top++] = (struct _write_frame){next, 0};
   }
 
-  // truncate the string if it is too long for the buffer
-  if (length >= buf_sz)
+  if (stack != inline_stack)
+    free(stack);
+}
+
+// Documented in .h file
+size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz)
+{
+  if (tree == NULL || buf == NULL || buf_sz == 0)
+    return 0;
+
+  struct _tree_writer w = {buf, buf_sz, 0, false, NULL, NULL, 0};
+
+  _ET_write_tree(tree, &w);
+
+  // mark a truncated result, if there is room for the marker
+  if (w.stopped && buf_sz >= 2)
   {
     buf[buf_sz - 2] = '$';
     buf[buf_sz - 1] = '\0';
     return buf_sz - 1;
   }
 
-  buf[length] = '\0';
-  return length;
-}
\ No newline at end of file
+  buf[w.pos] = '\0';
+  return w.pos;
+}
+
+// Documented in .h file
+size_t ET_tree2callback(ExprTree tree, ET_write_callback callback, void *cb_data)
+{
+  if (tree == NULL || callback == NULL)
+    return 0;
+
+  char chunk[STREAM_CHUNK_SIZE];
+  struct _tree_writer w = {chunk, sizeof(chunk), 0, false, callback, cb_data, 0};
+
+  _ET_write_tree(tree, &w);
+  _TW_flush(&w);
+
+  return w.flushed;
+}
+
+/*
+ * ET_write_callback that sends each chunk to the FILE * in cb_data
+ */
+static int _ET_file_callback(const char *chunk, size_t len, void *cb_data)
+{
+  return fwrite(chunk, 1, len, (FILE *)cb_data) == len ? 0 : -1;
+}
+
+// Documented in .h file
+size_t ET_tree2file(ExprTree tree, FILE *stream)
+{
+  if (stream == NULL)
+    return 0;
+
+  return ET_tree2callback(tree, _ET_file_callback, stream);
+}
+
+/*
+ * Append the nodes of a tree to the file nodes being built by ET_save,
+ * children first
+ *
+ * Parameters:
+ *   tree       The tree
+ *   node       The file nodes, with room for every node being saved
+ *   num_nodes  The number of file nodes so far, which is incremented
+ *   names      Maps each symbol name already in the strings to its offset
+ *   strings    The strings, which are reallocated as they grow
+ *   str_size   The size of strings, which is updated
+ *
+ * Returns: The index of the tree's root in node
+ */
+static uint32_t _ET_save_node(ExprTree tree, struct _et_file_node *node, uint32_t *num_nodes,
+                              CDict names, char **strings, uint32_t *str_size)
+{
+  struct _et_file_node fn;
+
+  memset(&fn, 0, sizeof(fn));
+  fn.type = tree->type;
+
+  if (tree->type == VALUE)
+    fn.value = tree->n.value;
+  else if (tree->type == SYMBOL)
+  {
+    if (!CD_contains(names, tree->n.symbol))
+    {
+      size_t len = strlen(tree->n.symbol) + 1;
+
+      *strings = realloc(*strings, *str_size + len);
+      assert(*strings != NULL);
+      memcpy(*strings + *str_size, tree->n.symbol, len);
+      CD_store(names, tree->n.symbol, *str_size);
+      *str_size += len;
+    }
+    fn.name = (uint32_t)CD_retrieve(names, tree->n.symbol);
+  }
+  else
+  {
+    fn.child[LEFT] = _ET_save_node(tree->n.child[LEFT], node, num_nodes, names, strings, str_size);
+    fn.child[RIGHT] = (tree->n.child[RIGHT] == NULL)
+                          ? ET_FILE_NONE
+                          : _ET_save_node(tree->n.child[RIGHT], node, num_nodes, names, strings, str_size);
+  }
+
+  node[*num_nodes] = fn;
+  return (*num_nodes)++;
+}
+
+// Documented in .h file
+bool ET_save(const ExprTree *trees, int num_trees, const char *path, char *errmsg, size_t errmsg_sz)
+{
+  struct _et_file_header header = {ET_FILE_MAGIC, ET_FILE_VERSION, ET_FILE_BYTE_ORDER, num_trees, 0, 0, 0};
+  uint32_t total = 0, *root;
+  struct _et_file_node *node;
+  char *strings = NULL;
+  CDict names = CD_new();
+  bool ok = false;
+
+  assert(num_trees >= 0 && names != NULL);
+
+  for (int t = 0; t < num_trees; t++)
+  {
+    assert(trees[t] != NULL);
+    total += ET_count(trees[t]);
+  }
+
+  root = malloc(sizeof(uint32_t) * (num_trees + 2));
+  node = malloc(sizeof(struct _et_file_node) * (total + 1));
+  assert(root != NULL && node != NULL);
+
+  for (int t = 0; t < num_trees; t++)
+    root[t] = _ET_save_node(trees[t], node, &header.num_nodes, names, &strings, &header.strings_size);
+
+  // pad the roots so that the nodes stay aligned
+  size_t roots_size = sizeof(uint32_t) * num_trees;
+
+  if (num_trees % 2 != 0)
+  {
+    root[num_trees] = ET_FILE_NONE;
+    roots_size += sizeof(uint32_t);
+  }
+
+  // write under a temporary name, so that a reader never sees a
+  // partial file
+  char tmp_path[FILENAME_MAX + 16];
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot write %s: %s", tmp_path, strerror(errno));
+    goto save_done;
+  }
+
+  bool written = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(root, 1, roots_size, f) == roots_size &&
+                 fwrite(node, sizeof(struct _et_file_node), header.num_nodes, f) == header.num_nodes &&
+                 fwrite(strings, 1, header.strings_size, f) == header.strings_size;
+
+  if (fclose(f) != 0 || !written)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot write %s", tmp_path);
+    remove(tmp_path);
+    goto save_done;
+  }
+
+  if (rename(tmp_path, path) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot rename into %s: %s", path, strerror(errno));
+    remove(tmp_path);
+    goto save_done;
+  }
+
+  ok = true;
+
+save_done:
+  CD_free(names);
+  free(strings);
+  free(node);
+  free(root);
+  return ok;
+}
+
+/*
+ * Mark a node as having a parent, for _ET_check_nodes
+ *
+ * Parameters:
+ *   seen     One bit per node, set for the nodes claimed so far
+ *   i        The index of the node
+ *
+ * Returns: true if the node had no parent yet, false otherwise
+ */
+static inline bool _ET_claim_node(uint8_t *seen, uint32_t i)
+{
+  if (seen[i / 8] & (1 << (i % 8)))
+    return false;
+
+  seen[i / 8] |= 1 << (i % 8);
+  return true;
+}
+
+/*
+ * Check that the file nodes of a mapped file describe valid trees:
+ * every type is known, every child comes before its parent, no node is
+ * the child of two parents or both a child and a root, and every name
+ * is a \0-terminated symbol inside the strings
+ *
+ * Parameters:
+ *   header   The header of the file
+ *   root     The indexes of the roots of the trees
+ *   node     The file nodes
+ *   strings  The strings
+ *
+ * Returns: true if the nodes are valid
+ */
+static bool _ET_check_nodes(const struct _et_file_header *header, const uint32_t *root,
+                            const struct _et_file_node *node, const char *strings)
+{
+  uint8_t *seen = calloc(header->num_nodes / 8 + 1, 1);
+  bool valid = true;
+
+  assert(seen != NULL);
+
+  for (uint32_t i = 0; valid && i < header->num_nodes; i++)
+  {
+    const struct _et_file_node *fn = &node[i];
+
+    switch (fn->type)
+    {
+    case VALUE:
+      break;
+
+    case SYMBOL:
+      if (fn->name >= header->strings_size)
+      {
+        valid = false;
+        break;
+      }
+      size_t room = header->strings_size - fn->name;
+      valid = memchr(strings + fn->name, '\0', room < SYMBOL_MAX_SIZE + 1 ? room : SYMBOL_MAX_SIZE + 1) != NULL;
+      break;
+
+    case UNARY_NEGATE:
+      valid = fn->child[LEFT] < i && fn->child[RIGHT] == ET_FILE_NONE && _ET_claim_node(seen, fn->child[LEFT]);
+      break;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POWER:
+    case OP_ASSIGN:
+      // a node shared by two parents would make the image a DAG, which
+      // in-place passes such as ET_rebalance would corrupt
+      valid = fn->child[LEFT] < i && fn->child[RIGHT] < i && _ET_claim_node(seen, fn->child[LEFT]) &&
+              _ET_claim_node(seen, fn->child[RIGHT]);
+      break;
+
+    default:
+      valid = false;
+    }
+  }
+
+  for (uint32_t t = 0; valid && t < header->num_trees; t++)
+    valid = root[t] < header->num_nodes && _ET_claim_node(seen, root[t]);
+
+  free(seen);
+  return valid;
+}
+
+// Documented in .h file
+ExprImage ET_load(const char *path, char *errmsg, size_t errmsg_sz)
+{
+  ExprImage image = NULL;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "Cannot open %s: %s", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  const char *map = (size == 0) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  const struct _et_file_header *header = (const struct _et_file_header *)map;
+
+  if (map == MAP_FAILED || size < sizeof(*header) || memcmp(header->magic, ET_FILE_MAGIC, 4) != 0)
+  {
+    snprintf(errmsg, errmsg_sz, "%s is not an expression file", path);
+    goto load_done;
+  }
+
+  if (header->version != ET_FILE_VERSION || header->byte_order != ET_FILE_BYTE_ORDER)
+  {
+    snprintf(errmsg, errmsg_sz, "%s has unsupported version or byte order", path);
+    goto load_done;
+  }
+
+  uint64_t roots_size = (uint64_t)sizeof(uint32_t) * (header->num_trees + header->num_trees % 2);
+  uint64_t nodes_offset = sizeof(*header) + roots_size;
+  uint64_t strings_offset = nodes_offset + (uint64_t)sizeof(struct _et_file_node) * header->num_nodes;
+  const uint32_t *root = (const uint32_t *)(map + sizeof(*header));
+  const struct _et_file_node *node = (const struct _et_file_node *)(map + nodes_offset);
+  const char *strings = map + strings_offset;
+  bool valid = (strings_offset + header->strings_size == size) && _ET_check_nodes(header, root, node, strings);
+
+  if (!valid)
+  {
+    snprintf(errmsg, errmsg_sz, "%s is truncated or corrupt", path);
+    goto load_done;
+  }
+
+  // the nodes are built in one block, straight from the mapped file;
+  // children come first, so each parent finds its children complete
+  image = malloc(sizeof(struct _expr_image));
+  assert(image != NULL);
+  image->num_trees = header->num_trees;
+  image->root = malloc(sizeof(ExprTree) * (header->num_trees + 1));
+  image->node = malloc(sizeof(struct _expr_tree_node) * (header->num_nodes + 1));
+  assert(image->root != NULL && image->node != NULL);
+
+  for (uint32_t i = 0; i < header->num_nodes; i++)
+  {
+    const struct _et_file_node *fn = &node[i];
+    ExprTree tree = &image->node[i];
+
+    if (fn->type == VALUE)
+      _ET_init_value(tree, fn->value);
+    else if (fn->type == SYMBOL)
+      _ET_init_symbol(tree, strings + fn->name);
+    else
+      _ET_init_node(tree, fn->type, &image->node[fn->child[LEFT]],
+                    (fn->child[RIGHT] == ET_FILE_NONE) ? NULL : &image->node[fn->child[RIGHT]]);
+  }
+
+  for (uint32_t t = 0; t < header->num_trees; t++)
+    image->root[t] = &image->node[root[t]];
+
+load_done:
+  if (map != MAP_FAILED)
+    munmap((void *)map, size);
+  return image;
+}
+
+// Documented in .h file
+void ET_image_free(ExprImage image)
+{
+  if (image == NULL)
+    return;
+
+  free(image->root);
+  free(image->node);
+  free(image);
+}
+
+// Documented in .h file
+int ET_image_count(ExprImage image)
+{
+  return image->num_trees;
+}
+
+// Documented in .h file
+ExprTree ET_image_tree(ExprImage image, int n)
+{
+  assert(n >= 0 && n < image->num_trees);
+  return image->root[n];
+}
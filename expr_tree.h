@@ -12,6 +12,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
@@ -64,6 +66,11 @@ ExprTree ET_symbol(const char *symbol);
  * Create an interior node on tree. An interior node always represents
  * an arithmetic operation.
  *
+ * An OP_POWER node whose exponent is a constant integer of magnitude
+ * up to 16, or the constant 0.5, is evaluated without calling pow():
+ * by repeated squaring or by sqrt() respectively. Such results may
+ * differ from pow() in the last few bits, by at most |exponent| ulp.
+ *
  * Parameters:
  *   op       The operator
  *   left     Left side of the operator
@@ -87,6 +94,35 @@ ExprTree ET_node(ExprNodeType op, ExprTree left, ExprTree right);
  */
 void ET_free(ExprTree tree);
 
+/*
+ * Return a 64-bit hash of the structure of a tree: its operators, its
+ * symbol names and the bits of its constants. The hash of each node is
+ * computed from those of its children when the node is made, so this
+ * takes constant time. Trees that are ET_equal have the same hash, and
+ * the hash of a given tree is the same in every run of the program.
+ *
+ * Parameters:
+ *   tree     The tree
+ *
+ * Returns: The hash, or 0 for an empty tree
+ */
+uint64_t ET_hash(ExprTree tree);
+
+/*
+ * Compare the structure of two trees. The trees are equal if they have
+ * the same shape, the same operators and the same symbol names in the
+ * same places, and constants that are identical bit for bit, so that 0
+ * and -0 differ. Bindings made by ET_bind are not compared. Subtrees
+ * whose hashes differ are rejected without being walked.
+ *
+ * Parameters:
+ *   a        A tree
+ *   b        Another tree
+ *
+ * Returns: true if the trees are equal
+ */
+bool ET_equal(ExprTree a, ExprTree b);
+
 /*
  * Return the number of nodes in the tree, including both leaf and
  * interior nodes in the count.
@@ -109,9 +145,60 @@ int ET_count(ExprTree tree);
  */
 int ET_depth(ExprTree tree);
 
+/*
+ * Rebalance the long chains of OP_ADD and of OP_MUL in a tree. The
+ * parser builds a + b + c + d as the left-deep ((a + b) + c) + d, whose
+ * evaluation is a chain of dependent operations as long as the sum,
+ * recursing as deep. Each maximal chain of one operator is rebuilt as
+ * a balanced tree over the same operands in the same order, here
+ * (a + b) + (c + d), so that a chain of n operands has depth about
+ * log2(n) and a sum is computed by pairwise summation. Chains of
+ * three operands or fewer are left as they are. The tree's nodes are
+ * reused, so nothing is allocated for them.
+ *
+ * This reassociates floating-point arithmetic, so results may differ
+ * from those of the original tree in the last bits. For sums the
+ * difference is usually an improvement: the rounding error of
+ * pairwise summation grows with log(n) rather than n. A chain whose
+ * partial results overflow or mix infinities of both signs may give
+ * an infinity or NaN in one form and not the other. The operands are
+ * still evaluated from left to right, so assignments and errors
+ * happen as before.
+ *
+ * Parameters:
+ *   tree     The tree, which is rebuilt in place
+ *
+ * Returns: The root of the rebalanced tree, which replaces tree
+ */
+ExprTree ET_rebalance(ExprTree tree);
+
+/*
+ * Bind every symbol in an ExprTree to the cell that holds its value in
+ * vars, so that evaluating the tree against vars reads and writes
+ * variables directly instead of looking them up by name. Binding is
+ * optional: ET_evaluate falls back to a lookup by name for any symbol
+ * whose binding is missing, belongs to another dictionary, or was
+ * invalidated by CD_delete. Evaluation only reads the bindings, so it
+ * never binds a symbol itself; call this again once variables that
+ * were missing have been defined. This must not run while another
+ * thread evaluates the same tree.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   vars     The variables to bind to
+ *
+ * Returns: The number of symbol nodes that could not be bound because
+ *   they are not yet defined in vars
+ */
+int ET_bind(ExprTree tree, CDict vars);
+
 /*
  * Evaluate an ExprTree and return the resulting value
  *
+ * Symbols are read and assigned through the bindings made by ET_bind,
+ * if any. The tree itself is not changed, so several threads may
+ * evaluate it at once, each against its own dictionary.
+ *
  * Parameters:
  * tree The tree to compute
  * vars A dictionary containing the variables known so far, which
@@ -124,10 +211,60 @@ int ET_depth(ExprTree tree);
  */
 double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz);
 
+typedef enum
+{
+  ET_OK = 0,
+  ET_ERR_UNDEFINED,    // a symbol was read that is not defined
+  ET_ERR_DIV_BY_ZERO,  // the right side of a division was zero
+  ET_ERR_BAD_ASSIGN    // the left side of an assignment is not a symbol
+} ETErrorCode;
+
+typedef struct
+{
+  ETErrorCode code;
+  ExprTree node; // the node at which evaluation stopped
+} ETError;
+
+/*
+ * Evaluate an ExprTree, stopping at the first error.
+ *
+ * Unlike ET_evaluate, no part of the tree is evaluated once an error
+ * has been found. Any assignment that would have run after the error
+ * does not take place, and no message is formatted. The left side of
+ * an assignment is never read. Otherwise the result, and the
+ * assignments made, are the same as for ET_evaluate.
+ *
+ * Parameters:
+ *   tree     The tree to compute
+ *   vars     A dictionary containing the variables known so far, which
+ *            may be modified by this function
+ *   result   Return space for the computed value, filled in on success
+ *   err      Return space for the error, filled in on failure; may be NULL
+ *
+ * Returns: ET_OK on success, otherwise the code of the error, which is
+ *   also copied into err along with the node that failed
+ */
+ETErrorCode ET_evaluate_checked(ExprTree tree, CDict vars, double *result, ETError *err);
+
+/*
+ * Format the message for an error returned by ET_evaluate_checked. The
+ * message is the same one that ET_evaluate would have produced.
+ *
+ * Parameters:
+ *   err      The error
+ *   buf      The buffer
+ *   buf_sz   Size of buffer, in bytes
+ *
+ * Returns: The number of characters written to buf, not counting the
+ *   \0 terminator
+ */
+size_t ET_error_message(const ETError *err, char *buf, size_t buf_sz);
+
 /*
  * Convert an ExprTree into a printable ASCII string stored in buf
- * Uses a recursive approach, converting the child nodes to strings first
- * and then formatting the parent node.
+ * The tree is written in a single pass directly into buf, so the
+ * stack use does not grow with buf_sz and the work done is bounded by
+ * the smaller of the tree size and buf_sz.
  *
  * Parameters:
  *   tree     The tree
@@ -145,4 +282,107 @@ double ET_evaluate(ExprTree tree, CDict vars, char *errmsg, size_t errmsg_sz);
  */
 size_t ET_tree2string(ExprTree tree, char *buf, size_t buf_sz);
 
+typedef int (*ET_write_callback)(const char *chunk, size_t len, void *cb_data);
+
+/*
+ * Stream the printable form of an ExprTree to a callback. The text is
+ * identical to what ET_tree2string produces given a large enough
+ * buffer, but it is never truncated: it is built in a small internal
+ * buffer which is handed to callback each time it fills, so memory use
+ * does not depend on the length of the output. Each call to callback
+ * will be of the form
+ *
+ *   callback( <chunk>, <chunk length>, <cb_data> )
+ *
+ * where chunk is not \0-terminated. If callback returns nonzero, no
+ * further output is produced.
+ *
+ * Parameters:
+ *   tree       The tree
+ *   callback   The function to call with each chunk of output
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: The number of characters accepted by callback
+ */
+size_t ET_tree2callback(ExprTree tree, ET_write_callback callback, void *cb_data);
+
+/*
+ * Write the printable form of an ExprTree to stream, in the same way
+ * as ET_tree2callback. No newline is added.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   stream   The stream to write to
+ *
+ * Returns: The number of characters written. If this is short, the
+ *   caller can check ferror(stream) for the cause.
+ */
+size_t ET_tree2file(ExprTree tree, FILE *stream);
+
+typedef struct _expr_image *ExprImage;
+
+/*
+ * Save a list of trees to a binary file, from which ET_load can
+ * restore them without tokenizing or parsing. Each distinct symbol
+ * name is stored once, however many trees use it. The file is written
+ * under a temporary name and renamed into place.
+ *
+ * The file holds the structure of the trees and nothing else; symbol
+ * bindings made by ET_bind are not saved. It can only be read on a
+ * machine of the same byte order.
+ *
+ * Parameters:
+ *   trees      The trees
+ *   num_trees  The number of trees
+ *   path       The file to write
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: true on success, false if the file could not be written
+ */
+bool ET_save(const ExprTree *trees, int num_trees, const char *path, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Load the trees saved by ET_save. The file is mapped into memory and
+ * checked, and the nodes of every tree are then built directly from
+ * the mapping into a single allocation, rather than one per node.
+ *
+ * Parameters:
+ *   path       The file to read
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The loaded trees, or NULL if the file cannot be read or is
+ *   not a valid file of this version, in which case an error message
+ *   is copied into errmsg
+ *
+ * It is the responsibility of the caller to call ET_image_free on the
+ * result.
+ */
+ExprImage ET_load(const char *path, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Destroy loaded trees, freeing every tree in image
+ *
+ * Parameters:
+ *   image    The loaded trees
+ *
+ * Returns: None
+ */
+void ET_image_free(ExprImage image);
+
+/*
+ * Returns: The number of trees in image
+ */
+int ET_image_count(ExprImage image);
+
+/*
+ * Returns: Tree number n of image, counting from 0 in the order they
+ *   were saved. The tree belongs to image and must not be passed to
+ *   ET_free, nor to anything that takes ownership of it; it can be
+ *   evaluated, bound and printed like any other tree until image is
+ *   freed.
+ */
+ExprTree ET_image_tree(ExprImage image, int n);
+
 #endif /* _EXPR_TREE_H_ */
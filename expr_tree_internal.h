@@ -0,0 +1,185 @@
+/*
+ * expr_tree_internal.h
+ *
+ * Node layout for ExprTree. This header is shared by the modules
+ * that need to walk a tree directly; it is not part of the public
+ * interface and callers outside this project should use expr_tree.h.
+ *
+ * Author: Howdy Pierce <howdy@sleepymoose.net>
+ * Contributor: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _EXPR_TREE_INTERNAL_H_
+#define _EXPR_TREE_INTERNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "expr_tree.h"
+
+#define LEFT 0
+#define RIGHT 1
+#define SYMBOL_MAX_SIZE 31
+
+// Constant integral exponents up to this magnitude are evaluated by
+// repeated squaring rather than by pow(), see ET_powi
+#define POW_MAX_INTEGER 16
+
+// How an OP_POWER node is evaluated, decided by ET_node from its
+// exponent
+typedef enum
+{
+  POW_GENERAL, // pow()
+  POW_INTEGER, // ET_powi, for a constant integral exponent
+  POW_SQRT     // ET_pow_sqrt, for a constant exponent of 0.5
+} PowKind;
+
+struct _expr_tree_node
+{
+  ExprNodeType type;
+  bool has_assign; // the tree contains OP_ASSIGN
+  uint64_t hash;   // hash of the tree's structure, computed when the node is made
+  union
+  {
+    struct
+    {
+      struct _expr_tree_node *child[2];
+      PowKind pow_kind; // for OP_POWER
+      int pow_exp;      // for POW_INTEGER, the exponent
+    };
+    double value;
+    struct
+    {
+      char symbol[SYMBOL_MAX_SIZE + 1];
+      CDictCell cell; // where the symbol was last found, see ET_bind
+    };
+  } n;
+};
+
+/*
+ * Raise x to an integral power by repeated squaring. Every evaluator
+ * uses this same sequence of operations for POW_INTEGER nodes, so they
+ * all agree bit for bit.
+ *
+ * The result agrees with pow(x, n) on zeros, infinities and NaNs. For
+ * other x it is within max(|n|, 1) ulp of pow(x, n), provided that
+ * x^|n| is a normal number; otherwise it may overflow or underflow
+ * where pow() would return a subnormal. Each multiplication rounds
+ * once and squaring doubles the error carried into it, for at most
+ * |n| - 1 ulp in x^|n|; the reciprocal for negative n and pow()'s own
+ * error account for the rest.
+ *
+ * Parameters:
+ *   x        The base
+ *   n        The exponent
+ *
+ * Returns: x raised to the power n
+ */
+static inline double ET_powi(double x, int n)
+{
+  unsigned int m = (n < 0) ? -(unsigned int)n : (unsigned int)n;
+  double result = 1;
+
+  while (m != 0)
+  {
+    if (m & 1)
+      result *= x;
+    m >>= 1;
+    if (m != 0)
+      x *= x;
+  }
+
+  return (n < 0) ? 1 / result : result;
+}
+
+/*
+ * Raise x to the power 0.5. Unlike sqrt(), and like pow(), this gives
+ * +0 for -0 and +inf for -inf. Other results are correctly rounded,
+ * so they differ from pow(x, 0.5) by no more than pow()'s own error.
+ *
+ * Parameters:
+ *   x        The base
+ *
+ * Returns: x raised to the power 0.5
+ */
+static inline double ET_pow_sqrt(double x)
+{
+  if (x == 0 || isinf(x))
+    return fabs(x);
+
+  return sqrt(x);
+}
+
+/*
+ * Compute the value of an OP_POWER node from the values of its
+ * children
+ *
+ * Parameters:
+ *   node     The node
+ *   base     The value of its left child
+ *   exponent The value of its right child
+ *
+ * Returns: base raised to the power exponent
+ */
+static inline double ET_power(ExprTree node, double base, double exponent)
+{
+  switch (node->n.pow_kind)
+  {
+  case POW_INTEGER:
+    return ET_powi(base, node->n.pow_exp);
+  case POW_SQRT:
+    return ET_pow_sqrt(base);
+  default:
+    return pow(base, exponent);
+  }
+}
+
+/*
+ * Read the value of a symbol node, through its bound cell if that is
+ * still valid for vars, and otherwise by name. The node is not changed,
+ * so a tree may be read by several threads at once.
+ *
+ * Parameters:
+ *   node     The SYMBOL node
+ *   vars     The variables
+ *   value    Return space for the value
+ *
+ * Returns: true if the symbol is defined in vars, false otherwise
+ */
+static inline bool ET_load_symbol(ExprTree node, CDict vars, double *value)
+{
+  // a CDict never holds NaN, so a NaN load means the cell is not valid
+  double v = CD_cell_load(vars, node->n.cell);
+
+  if (isnan(v))
+  {
+    v = CD_retrieve(vars, node->n.symbol);
+    if (isnan(v))
+      return false;
+  }
+
+  *value = v;
+  return true;
+}
+
+/*
+ * Assign a value to a symbol node, through its bound cell if that is
+ * still valid for vars, and otherwise by name. The node is not changed.
+ *
+ * Parameters:
+ *   node     The SYMBOL node
+ *   vars     The variables
+ *   value    The value to assign
+ *
+ * Returns: None
+ */
+static inline void ET_store_symbol(ExprTree node, CDict vars, double value)
+{
+  if (CD_cell_valid(vars, node->n.cell))
+    CD_cell_store(vars, node->n.cell, value);
+  else
+    CD_store(vars, node->n.symbol, value);
+}
+
+#endif /* _EXPR_TREE_INTERNAL_H_ */
@@ -26,7 +26,6 @@ int main(int argc, char *argv[])
   char *input = NULL;
   char errmsg[128];
   bool time_to_quit = false;
-  char expr_buf[1024];
   CList tokens = NULL;
   ExprTree tree = NULL;
   CDict vars = CD_new();
@@ -69,20 +68,31 @@ int main(int argc, char *argv[])
       goto loop_end;
     }
 
-    ET_tree2string(tree, expr_buf, sizeof(expr_buf));
-    double result = ET_evaluate(tree, vars, errmsg, sizeof(errmsg));
-    isnan(result) ? printf("%s\n", errmsg) : printf("%s  ==> %g\n", expr_buf, result);
+    double result;
+    ETError err;
+
+    if (ET_evaluate_checked(tree, vars, &result, &err) != ET_OK)
+    {
+      ET_error_message(&err, errmsg, sizeof(errmsg));
+      printf("%s\n", errmsg);
+    }
+    else
+    {
+      // streamed, so that long expressions are not truncated
+      ET_tree2file(tree, stdout);
+      printf("  ==> %g\n", result);
+    }
 
   loop_end:
     free(input);
     input = NULL;
     CL_free(tokens);
     tokens = NULL;
-  }
-
     ET_free(tree);
     tree = NULL;
-    CD_free(vars);
-    vars = NULL;
+  }
+
+  CD_free(vars);
+  vars = NULL;
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,772 @@
+/*
+ * penv.c
+ *
+ * Persistent variable environments, as hash array mapped tries with
+ * path copying. See penv.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "penv.h"
+#include "expr_tree_internal.h"
+
+// Each level of the trie consumes this many bits of the key's hash
+#define PE_BITS 5
+#define PE_FANOUT (1 << PE_BITS)
+
+typedef enum
+{
+  PE_LEAF,     // one key and its value
+  PE_BRANCH,   // up to PE_FANOUT children, one per set bit of the bitmap
+  PE_COLLISION // two or more leaves whose keys have the same full hash
+} PENodeKind;
+
+/*
+ * The header shared by every node. Nodes are never changed once they
+ * are published, only shared between versions, so each keeps a count
+ * of the references to it, from maps and from other nodes.
+ */
+struct _pe_node
+{
+  unsigned int refs;
+  PENodeKind kind;
+  unsigned int count; // children of a branch or collision node
+  uint32_t bitmap;    // for a branch, which hash digits have a child
+  uint64_t hash;      // for a leaf or collision node, the keys' hash
+};
+
+struct _pe_leaf
+{
+  struct _pe_node node;
+  CDictValueType value;
+  char key[];
+};
+
+// A branch or a collision node
+struct _pe_branch
+{
+  struct _pe_node node;
+  struct _pe_node *child[];
+};
+
+struct _pe_map
+{
+  unsigned int refs;
+  unsigned int size;
+  struct _pe_node *root; // NULL when empty
+};
+
+/*
+ * Writers are serialized on write_lock, and build each new version
+ * without blocking readers. lock guards only the swap of current, so
+ * that a snapshot takes it for no longer than an increment.
+ */
+struct _p_env
+{
+  pthread_mutex_t write_lock;
+  pthread_mutex_t lock;
+  PEMap current;
+};
+
+/*
+ * Returns: The hash digit that picks a child at the given shift
+ */
+static inline unsigned int _PE_digit(uint64_t hash, unsigned int shift)
+{
+  return (hash >> shift) & (PE_FANOUT - 1);
+}
+
+/*
+ * Returns: The position, among a branch's children, of the child for a
+ *   digit
+ */
+static inline unsigned int _PE_index(uint32_t bitmap, unsigned int digit)
+{
+  return __builtin_popcount(bitmap & ((1u << digit) - 1));
+}
+
+/*
+ * Take another reference to a node
+ *
+ * Parameters:
+ *   node     The node
+ *
+ * Returns: node
+ */
+static inline struct _pe_node *_PE_retain_node(struct _pe_node *node)
+{
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+/*
+ * Drop a reference to a node, freeing it and releasing its children if
+ * it was the last
+ *
+ * Parameters:
+ *   node     The node, or NULL
+ *
+ * Returns: None
+ */
+static void _PE_release_node(struct _pe_node *node)
+{
+  if (node == NULL || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  if (node->kind != PE_LEAF)
+  {
+    struct _pe_branch *branch = (struct _pe_branch *)node;
+
+    for (unsigned int i = 0; i < node->count; i++)
+      _PE_release_node(branch->child[i]);
+  }
+
+  free(node);
+}
+
+/*
+ * Returns: A new leaf, with one reference
+ */
+static struct _pe_node *_PE_leaf_new(uint64_t hash, const char *key, CDictValueType value)
+{
+  size_t len = strlen(key);
+  struct _pe_leaf *leaf = malloc(sizeof(struct _pe_leaf) + len + 1);
+  assert(leaf != NULL);
+
+  leaf->node = (struct _pe_node){1, PE_LEAF, 0, 0, hash};
+  leaf->value = value;
+  memcpy(leaf->key, key, len + 1);
+
+  return &leaf->node;
+}
+
+/*
+ * Returns: A new branch or collision node with room for count children,
+ *   which the caller fills in, and one reference
+ */
+static struct _pe_branch *_PE_branch_new(PENodeKind kind, unsigned int count, uint32_t bitmap, uint64_t hash)
+{
+  struct _pe_branch *branch = malloc(sizeof(struct _pe_branch) + sizeof(struct _pe_node *) * count);
+  assert(branch != NULL);
+
+  branch->node = (struct _pe_node){1, kind, count, bitmap, hash};
+
+  return branch;
+}
+
+/*
+ * Copy a branch or collision node, leaving out one child and making
+ * room for others. The copy takes a new reference to each child it
+ * keeps.
+ *
+ * Parameters:
+ *   node     The node to copy
+ *   skip     The position of the child to leave out, or node->count
+ *   at       The position in the copy at which to leave room
+ *   room     How many children to leave room for at position at
+ *
+ * Returns: The copy, with one reference
+ */
+static struct _pe_branch *_PE_copy(const struct _pe_node *node, unsigned int skip, unsigned int at,
+                                   unsigned int room)
+{
+  const struct _pe_branch *old = (const struct _pe_branch *)node;
+  unsigned int count = node->count - (skip < node->count) + room;
+  struct _pe_branch *branch = _PE_branch_new(node->kind, count, node->bitmap, node->hash);
+  unsigned int j = 0;
+
+  for (unsigned int i = 0; i < node->count; i++)
+  {
+    if (j == at)
+      j += room;
+    if (i != skip)
+      branch->child[j++] = _PE_retain_node(old->child[i]);
+  }
+
+  return branch;
+}
+
+/*
+ * Build the branches that separate two nodes whose hashes differ, from
+ * the given depth down to where their hashes first differ
+ *
+ * Parameters:
+ *   a        A leaf or collision node, whose reference passes to the result
+ *   b        Another, with a different hash
+ *   shift    The depth, in bits of hash consumed
+ *
+ * Returns: A branch holding both, with one reference
+ */
+static struct _pe_node *_PE_merge(struct _pe_node *a, struct _pe_node *b, unsigned int shift)
+{
+  unsigned int da = _PE_digit(a->hash, shift);
+  unsigned int db = _PE_digit(b->hash, shift);
+
+  if (da == db)
+  {
+    struct _pe_branch *branch = _PE_branch_new(PE_BRANCH, 1, 1u << da, 0);
+
+    branch->child[0] = _PE_merge(a, b, shift + PE_BITS);
+    return &branch->node;
+  }
+
+  struct _pe_branch *branch = _PE_branch_new(PE_BRANCH, 2, (1u << da) | (1u << db), 0);
+
+  branch->child[da < db ? 0 : 1] = a;
+  branch->child[da < db ? 1 : 0] = b;
+  return &branch->node;
+}
+
+/*
+ * Find the leaf for a key
+ *
+ * Parameters:
+ *   node     The root of the trie, or NULL
+ *   hash     The key's hash, from CD_hash
+ *   key      The key
+ *
+ * Returns: The leaf, or NULL if key is not present
+ */
+static const struct _pe_leaf *_PE_find(const struct _pe_node *node, uint64_t hash, const char *key)
+{
+  unsigned int shift = 0;
+
+  while (node != NULL)
+  {
+    const struct _pe_branch *branch = (const struct _pe_branch *)node;
+
+    switch (node->kind)
+    {
+    case PE_LEAF:
+    {
+      const struct _pe_leaf *leaf = (const struct _pe_leaf *)node;
+
+      return (node->hash == hash && strcmp(leaf->key, key) == 0) ? leaf : NULL;
+    }
+
+    case PE_BRANCH:
+    {
+      unsigned int digit = _PE_digit(hash, shift);
+
+      if ((node->bitmap & (1u << digit)) == 0)
+        return NULL;
+      node = branch->child[_PE_index(node->bitmap, digit)];
+      shift += PE_BITS;
+      break;
+    }
+
+    case PE_COLLISION:
+      if (node->hash != hash)
+        return NULL;
+      for (unsigned int i = 0; i < node->count; i++)
+        if (strcmp(((const struct _pe_leaf *)branch->child[i])->key, key) == 0)
+          return (const struct _pe_leaf *)branch->child[i];
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Make a copy of a subtrie with a key set to a value, sharing every
+ * node off the path to the key
+ *
+ * Parameters:
+ *   node     The subtrie, or NULL
+ *   shift    Its depth, in bits of hash consumed
+ *   hash     The key's hash
+ *   key      The key
+ *   value    The value
+ *   added    Return space: true if the key was not present before
+ *
+ * Returns: The new subtrie, with one reference
+ */
+static struct _pe_node *_PE_insert(struct _pe_node *node, unsigned int shift, uint64_t hash, const char *key,
+                                   CDictValueType value, bool *added)
+{
+  if (node == NULL)
+  {
+    *added = true;
+    return _PE_leaf_new(hash, key, value);
+  }
+
+  struct _pe_branch *old = (struct _pe_branch *)node;
+
+  if (node->kind == PE_BRANCH)
+  {
+    unsigned int digit = _PE_digit(hash, shift);
+    unsigned int i = _PE_index(node->bitmap, digit);
+
+    if ((node->bitmap & (1u << digit)) == 0)
+    {
+      struct _pe_branch *branch = _PE_copy(node, node->count, i, 1);
+
+      branch->node.bitmap |= 1u << digit;
+      branch->child[i] = _PE_leaf_new(hash, key, value);
+      *added = true;
+      return &branch->node;
+    }
+
+    struct _pe_branch *branch = _PE_copy(node, i, i, 1);
+
+    branch->child[i] = _PE_insert(old->child[i], shift + PE_BITS, hash, key, value, added);
+    return &branch->node;
+  }
+
+  // a leaf or collision node: its keys share a hash, which may not be
+  // this key's
+  if (node->hash != hash)
+  {
+    *added = true;
+    return _PE_merge(_PE_retain_node(node), _PE_leaf_new(hash, key, value), shift);
+  }
+
+  if (node->kind == PE_LEAF)
+  {
+    if (strcmp(((struct _pe_leaf *)node)->key, key) == 0)
+    {
+      *added = false;
+      return _PE_leaf_new(hash, key, value);
+    }
+
+    struct _pe_branch *collision = _PE_branch_new(PE_COLLISION, 2, 0, hash);
+
+    collision->child[0] = _PE_retain_node(node);
+    collision->child[1] = _PE_leaf_new(hash, key, value);
+    *added = true;
+    return &collision->node;
+  }
+
+  unsigned int i = 0;
+
+  while (i < node->count && strcmp(((struct _pe_leaf *)old->child[i])->key, key) != 0)
+    i++;
+
+  struct _pe_branch *collision = _PE_copy(node, i, i, 1);
+
+  collision->child[i] = _PE_leaf_new(hash, key, value);
+  *added = (i == node->count);
+  return &collision->node;
+}
+
+/*
+ * Make a copy of a subtrie without a key, sharing every node off the
+ * path to the key. A branch or collision node left with a single leaf
+ * is replaced by that leaf, so the trie stays as shallow as it would
+ * be had the key never been stored.
+ *
+ * Parameters:
+ *   node     The subtrie
+ *   shift    Its depth, in bits of hash consumed
+ *   hash     The key's hash
+ *   key      The key
+ *   removed  Return space: true if the key was present
+ *
+ * Returns: The new subtrie, with one reference, or NULL if it is
+ *   empty; or NULL if the key was not present
+ */
+static struct _pe_node *_PE_remove(struct _pe_node *node, unsigned int shift, uint64_t hash, const char *key,
+                                   bool *removed)
+{
+  struct _pe_branch *old = (struct _pe_branch *)node;
+  unsigned int i;
+
+  *removed = false;
+
+  switch (node->kind)
+  {
+  case PE_LEAF:
+    *removed = (node->hash == hash && strcmp(((struct _pe_leaf *)node)->key, key) == 0);
+    return NULL;
+
+  case PE_COLLISION:
+    if (node->hash != hash)
+      return NULL;
+    for (i = 0; i < node->count; i++)
+      if (strcmp(((struct _pe_leaf *)old->child[i])->key, key) == 0)
+        break;
+    if (i == node->count)
+      return NULL;
+
+    *removed = true;
+    if (node->count == 2)
+      return _PE_retain_node(old->child[1 - i]);
+    return &_PE_copy(node, i, node->count, 0)->node;
+
+  case PE_BRANCH:
+    break;
+  }
+
+  unsigned int digit = _PE_digit(hash, shift);
+
+  if ((node->bitmap & (1u << digit)) == 0)
+    return NULL;
+
+  i = _PE_index(node->bitmap, digit);
+
+  struct _pe_node *child = _PE_remove(old->child[i], shift + PE_BITS, hash, key, removed);
+
+  if (!*removed)
+    return NULL;
+
+  if (child == NULL)
+  {
+    if (node->count == 1)
+      return NULL;
+    if (node->count == 2 && old->child[1 - i]->kind != PE_BRANCH)
+      return _PE_retain_node(old->child[1 - i]);
+
+    struct _pe_branch *branch = _PE_copy(node, i, node->count, 0);
+
+    branch->node.bitmap &= ~(1u << digit);
+    return &branch->node;
+  }
+
+  if (node->count == 1 && child->kind != PE_BRANCH)
+    return child;
+
+  struct _pe_branch *branch = _PE_copy(node, i, i, 1);
+
+  branch->child[i] = child;
+  return &branch->node;
+}
+
+/*
+ * Call back for each leaf of a subtrie
+ *
+ * Parameters:
+ *   node       The subtrie, or NULL
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+static void _PE_foreach(struct _pe_node *node, CD_foreach_callback callback, void *cb_data)
+{
+  if (node == NULL)
+    return;
+
+  if (node->kind == PE_LEAF)
+  {
+    struct _pe_leaf *leaf = (struct _pe_leaf *)node;
+
+    callback(leaf->key, leaf->value, cb_data);
+    return;
+  }
+
+  for (unsigned int i = 0; i < node->count; i++)
+    _PE_foreach(((struct _pe_branch *)node)->child[i], callback, cb_data);
+}
+
+/*
+ * Returns: A new map over a trie, taking over the reference to root
+ */
+static PEMap _PE_map_new(struct _pe_node *root, unsigned int size)
+{
+  PEMap map = malloc(sizeof(struct _pe_map));
+  assert(map != NULL);
+
+  map->refs = 1;
+  map->size = size;
+  map->root = root;
+
+  return map;
+}
+
+// Documented in .h file
+PEMap PE_new()
+{
+  return _PE_map_new(NULL, 0);
+}
+
+// Documented in .h file
+PEMap PE_retain(PEMap map)
+{
+  __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+  return map;
+}
+
+// Documented in .h file
+void PE_release(PEMap map)
+{
+  if (map == NULL || __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  _PE_release_node(map->root);
+  free(map);
+}
+
+// Documented in .h file
+unsigned int PE_size(PEMap map)
+{
+  return map->size;
+}
+
+// Documented in .h file
+bool PE_contains(PEMap map, const char *key)
+{
+  return _PE_find(map->root, CD_hash(key), key) != NULL;
+}
+
+// Documented in .h file
+CDictValueType PE_retrieve(PEMap map, const char *key)
+{
+  const struct _pe_leaf *leaf = _PE_find(map->root, CD_hash(key), key);
+
+  return (leaf == NULL) ? INVALID_VALUE : leaf->value;
+}
+
+// Documented in .h file
+PEMap PE_store(PEMap map, const char *key, CDictValueType value)
+{
+  if (isnan(value))
+    return PE_retain(map);
+
+  uint64_t hash = CD_hash(key);
+  const struct _pe_leaf *leaf = _PE_find(map->root, hash, key);
+
+  // storing the value a key already has changes nothing
+  if (leaf != NULL && memcmp(&leaf->value, &value, sizeof(value)) == 0)
+    return PE_retain(map);
+
+  bool added;
+  struct _pe_node *root = _PE_insert(map->root, 0, hash, key, value, &added);
+
+  return _PE_map_new(root, map->size + added);
+}
+
+// Documented in .h file
+PEMap PE_delete(PEMap map, const char *key)
+{
+  if (map->root == NULL)
+    return PE_retain(map);
+
+  bool removed;
+  struct _pe_node *root = _PE_remove(map->root, 0, CD_hash(key), key, &removed);
+
+  if (!removed)
+    return PE_retain(map);
+
+  return _PE_map_new(root, map->size - 1);
+}
+
+// Documented in .h file
+void PE_foreach(PEMap map, CD_foreach_callback callback, void *cb_data)
+{
+  _PE_foreach(map->root, callback, cb_data);
+}
+
+/*
+ * Evaluate a subtree for ET_evaluate_persistent, stopping at the first
+ * error. This follows _ET_eval_checked case for case.
+ *
+ * Parameters:
+ *   tree     The subtree
+ *   vars     The map, replaced by each assignment
+ *   result   Return space for the value of the subtree
+ *   err      Return space for the error
+ *
+ * Returns: true on success, false if an error was recorded in err
+ */
+static bool _PE_eval(ExprTree tree, PEMap *vars, double *result, ETError *err)
+{
+  double left = 0, right = 0;
+
+  if (tree == NULL)
+  {
+    *result = 0;
+    return true;
+  }
+
+  switch (tree->type)
+  {
+  case VALUE:
+    *result = tree->n.value;
+    return true;
+
+  case SYMBOL:
+  {
+    const struct _pe_leaf *leaf = _PE_find((*vars)->root, CD_hash(tree->n.symbol), tree->n.symbol);
+
+    if (leaf != NULL)
+    {
+      *result = leaf->value;
+      return true;
+    }
+    *err = (ETError){ET_ERR_UNDEFINED, tree};
+    return false;
+  }
+
+  case OP_ASSIGN:
+  {
+    if (tree->n.child[LEFT]->type != SYMBOL)
+    {
+      *err = (ETError){ET_ERR_BAD_ASSIGN, tree};
+      return false;
+    }
+    if (!_PE_eval(tree->n.child[RIGHT], vars, &right, err))
+      return false;
+
+    PEMap next = PE_store(*vars, tree->n.child[LEFT]->n.symbol, right);
+
+    PE_release(*vars);
+    *vars = next;
+    *result = right;
+    return true;
+  }
+
+  case UNARY_NEGATE:
+    if (!_PE_eval(tree->n.child[LEFT], vars, &left, err))
+      return false;
+    *result = -left;
+    return true;
+
+  default:
+    if (!_PE_eval(tree->n.child[LEFT], vars, &left, err) || !_PE_eval(tree->n.child[RIGHT], vars, &right, err))
+      return false;
+  }
+
+  switch (tree->type)
+  {
+  case OP_ADD:
+    *result = left + right;
+    return true;
+  case OP_SUB:
+    *result = left - right;
+    return true;
+  case OP_MUL:
+    *result = left * right;
+    return true;
+  case OP_DIV:
+    if (right == 0)
+    {
+      *err = (ETError){ET_ERR_DIV_BY_ZERO, tree};
+      return false;
+    }
+    *result = left / right;
+    return true;
+  case OP_POWER:
+    *result = ET_power(tree, left, right);
+    return true;
+  default:
+    assert(0);
+    return false;
+  }
+}
+
+// Documented in .h file
+ETErrorCode ET_evaluate_persistent(ExprTree tree, PEMap *vars, double *result, ETError *err)
+{
+  ETError local;
+  double value;
+
+  if (err == NULL)
+    err = &local;
+
+  if (!_PE_eval(tree, vars, &value, err))
+    return err->code;
+
+  *result = value;
+  return ET_OK;
+}
+
+/*
+ * Make a new version the current one of an environment. The caller
+ * holds the environment's write lock.
+ *
+ * Parameters:
+ *   env      The environment
+ *   next     The new version, whose reference passes to env
+ *
+ * Returns: None
+ */
+static void _PE_env_publish(PEnv env, PEMap next)
+{
+  pthread_mutex_lock(&env->lock);
+  PEMap old = env->current;
+  env->current = next;
+  pthread_mutex_unlock(&env->lock);
+
+  // snapshots may still hold the old version; this frees only what
+  // none of them share
+  PE_release(old);
+}
+
+// Documented in .h file
+PEnv PE_env_new()
+{
+  PEnv env = malloc(sizeof(struct _p_env));
+  assert(env != NULL);
+
+  pthread_mutex_init(&env->write_lock, NULL);
+  pthread_mutex_init(&env->lock, NULL);
+  env->current = PE_new();
+
+  return env;
+}
+
+// Documented in .h file
+void PE_env_free(PEnv env)
+{
+  if (env == NULL)
+    return;
+
+  PE_release(env->current);
+  pthread_mutex_destroy(&env->write_lock);
+  pthread_mutex_destroy(&env->lock);
+  free(env);
+}
+
+// Documented in .h file
+PEMap PE_env_snapshot(PEnv env)
+{
+  pthread_mutex_lock(&env->lock);
+  PEMap snapshot = PE_retain(env->current);
+  pthread_mutex_unlock(&env->lock);
+
+  return snapshot;
+}
+
+// Documented in .h file
+void PE_env_store(PEnv env, const char *key, CDictValueType value)
+{
+  pthread_mutex_lock(&env->write_lock);
+  _PE_env_publish(env, PE_store(env->current, key, value));
+  pthread_mutex_unlock(&env->write_lock);
+}
+
+// Documented in .h file
+void PE_env_store_many(PEnv env, const char *const keys[], const CDictValueType values[], int n)
+{
+  pthread_mutex_lock(&env->write_lock);
+
+  PEMap next = PE_retain(env->current);
+
+  for (int i = 0; i < n; i++)
+  {
+    PEMap map = PE_store(next, keys[i], values[i]);
+
+    PE_release(next);
+    next = map;
+  }
+
+  _PE_env_publish(env, next);
+  pthread_mutex_unlock(&env->write_lock);
+}
+
+// Documented in .h file
+void PE_env_delete(PEnv env, const char *key)
+{
+  pthread_mutex_lock(&env->write_lock);
+  _PE_env_publish(env, PE_delete(env->current, key));
+  pthread_mutex_unlock(&env->write_lock);
+}
@@ -0,0 +1,235 @@
+/*
+ * penv.h
+ *
+ * Persistent variable environments. A PEMap is an immutable map from
+ * variable names to values: storing into it or deleting from it gives
+ * a new map and leaves the old one as it was. The two share all but
+ * the O(log n) nodes on the path to the changed key, so keeping an old
+ * version costs nothing, and a snapshot is just another reference.
+ *
+ * A PEnv holds the current version of such a map for a set of threads.
+ * Writers replace the version one update at a time; readers take a
+ * snapshot in O(1) and see every variable as it stood at that moment,
+ * however long they hold it.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#ifndef _PENV_H_
+#define _PENV_H_
+
+#include <stdbool.h>
+
+#include "cdict.h"
+#include "expr_tree.h"
+
+typedef struct _pe_map *PEMap;
+typedef struct _p_env *PEnv;
+
+/*
+ * Returns an empty map
+ *
+ * Parameters: None
+ *
+ * Returns: The new PEMap
+ *
+ * It is the responsibility of the caller to call PE_release on the
+ * map.
+ */
+PEMap PE_new();
+
+/*
+ * Take another reference to a map, in O(1). The map may be shared
+ * freely between threads, since it never changes.
+ *
+ * Parameters:
+ *   map      The map
+ *
+ * Returns: map
+ *
+ * It is the responsibility of the caller to call PE_release on the
+ * map once more.
+ */
+PEMap PE_retain(PEMap map);
+
+/*
+ * Drop a reference to a map, freeing whatever is no longer used by any
+ * other version
+ *
+ * Parameters:
+ *   map      The map, or NULL
+ *
+ * Returns: None
+ */
+void PE_release(PEMap map);
+
+/*
+ * Returns the number of elements in the map
+ *
+ * Parameters:
+ *   map      The map
+ *
+ * Returns: the map's size
+ */
+unsigned int PE_size(PEMap map);
+
+/*
+ * Is key found in map?
+ *
+ * Parameters:
+ *   map      The map
+ *   key      The key
+ *
+ * Returns: True if key is in map, false otherwise
+ */
+bool PE_contains(PEMap map, const char *key);
+
+/*
+ * Find the value for a given key
+ *
+ * Parameters:
+ *   map      The map
+ *   key      The key
+ *
+ * Returns: The value, or INVALID_VALUE if key not found in map
+ */
+CDictValueType PE_retrieve(PEMap map, const char *key);
+
+/*
+ * Make a version of a map with a key set to a value, copying only the
+ * nodes on the path to the key. As with CD_store, NaN values are not
+ * stored.
+ *
+ * Parameters:
+ *   map      The map, which is not changed
+ *   key      The key
+ *   value    The value
+ *
+ * Returns: The new version
+ *
+ * It is the responsibility of the caller to call PE_release on the
+ * new version.
+ */
+PEMap PE_store(PEMap map, const char *key, CDictValueType value);
+
+/*
+ * Make a version of a map without a key
+ *
+ * Parameters:
+ *   map      The map, which is not changed
+ *   key      The key
+ *
+ * Returns: The new version, which is map itself if key was not in it
+ *
+ * It is the responsibility of the caller to call PE_release on the
+ * new version.
+ */
+PEMap PE_delete(PEMap map, const char *key);
+
+/*
+ * Iterate through the map, calling the user-specified callback
+ * function for each element, in no particular order
+ *
+ * Parameters:
+ *   map        The map
+ *   callback   The function to call
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void PE_foreach(PEMap map, CD_foreach_callback callback, void *cb_data);
+
+/*
+ * Evaluate a tree, reading its variables from a persistent map. The
+ * value and the errors are exactly those of ET_evaluate_checked. Each
+ * assignment replaces *vars with a new version holding the assigned
+ * value, releasing the old one, so a caller that wants to keep the
+ * version it passed in should PE_retain it first.
+ *
+ * Parameters:
+ *   tree     The tree
+ *   vars     The map to read, updated by any assignments; the
+ *            assignments made before an error are kept
+ *   result   Return space for the value of the tree
+ *   err      Return space for a description of the error, or NULL
+ *
+ * Returns: ET_OK on success, otherwise the error, in which case result
+ *   is left unchanged
+ */
+ETErrorCode ET_evaluate_persistent(ExprTree tree, PEMap *vars, double *result, ETError *err);
+
+/*
+ * Returns a newly-allocated environment, whose current version is
+ * empty
+ *
+ * Parameters: None
+ *
+ * Returns: The new PEnv
+ *
+ * It is the responsibility of the caller to call PE_env_free on the
+ * environment.
+ */
+PEnv PE_env_new();
+
+/*
+ * Destroy an environment. Snapshots taken from it remain valid until
+ * they are released.
+ *
+ * Parameters:
+ *   env      The environment
+ *
+ * Returns: None
+ */
+void PE_env_free(PEnv env);
+
+/*
+ * Take a snapshot of the current version of an environment, in O(1).
+ * Later updates to the environment do not change it.
+ *
+ * Parameters:
+ *   env      The environment
+ *
+ * Returns: The current version
+ *
+ * It is the responsibility of the caller to call PE_release on the
+ * snapshot.
+ */
+PEMap PE_env_snapshot(PEnv env);
+
+/*
+ * Store a key, value pair in an environment, as PE_store does
+ *
+ * Parameters:
+ *   env      The environment
+ *   key      The key
+ *   value    The value
+ *
+ * Returns: None
+ */
+void PE_env_store(PEnv env, const char *key, CDictValueType value);
+
+/*
+ * Store a batch of key, value pairs in an environment. A snapshot sees
+ * either all of them or none.
+ *
+ * Parameters:
+ *   env      The environment
+ *   keys     The keys
+ *   values   The values, in the order of keys
+ *   n        The number of pairs
+ *
+ * Returns: None
+ */
+void PE_env_store_many(PEnv env, const char *const keys[], const CDictValueType values[], int n);
+
+/*
+ * Delete a key from an environment. Does nothing if key is not in it.
+ *
+ * Parameters:
+ *   env      The environment
+ *   key      The key
+ *
+ * Returns: None
+ */
+void PE_env_delete(PEnv env, const char *key);
+
+#endif /* _PENV_H_ */
@@ -0,0 +1,411 @@
+/*
+ * reactive.c
+ *
+ * A spreadsheet-style recalculation engine for formulas evaluated
+ * against one CDict. See reactive.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "reactive.h"
+#include "expr_tree_internal.h"
+
+// A variable that some formula reads or writes
+struct _rx_symbol
+{
+  char name[SYMBOL_MAX_SIZE + 1];
+  CDictCell cell;        // where the variable was last found in vars
+  unsigned long version; // its version in vars when last examined
+  int writer;            // the formula that assigns it, or -1
+  int *readers;          // the formulas that read it
+  int num_readers;
+};
+
+struct _rx_formula
+{
+  ExprTree tree;
+  int *reads; // symbols read, by position in the engine's symbol table
+  int num_reads;
+  int *writes; // symbols assigned
+  int num_writes;
+  bool dirty; // must be evaluated on the next update
+  double value;
+  ETErrorCode error;
+};
+
+struct _reactive
+{
+  CDict vars;
+  CDict index; // maps each symbol's name to its position in symbol
+  struct _rx_symbol *symbol;
+  int num_symbols;
+  int symbol_cap;
+  struct _rx_formula *formula;
+  int num_formulas;
+  int formula_cap;
+  int *order;          // formula numbers in topological order
+  unsigned long clock; // CD_clock(vars) at the end of the last update
+  bool pending;        // a formula has been registered since then
+};
+
+/*
+ * Append a value to a list of ints
+ *
+ * Parameters:
+ *   list     The list, which is reallocated
+ *   num      The number of entries in list, which is incremented
+ *   value    The value to append
+ *
+ * Returns: None
+ */
+static void _RX_append(int **list, int *num, int value)
+{
+  *list = realloc(*list, sizeof(int) * (*num + 1));
+  assert(*list != NULL);
+  (*list)[(*num)++] = value;
+}
+
+/*
+ * Returns: true if value is one of the num entries of list
+ */
+static bool _RX_contains(const int *list, int num, int value)
+{
+  for (int i = 0; i < num; i++)
+    if (list[i] == value)
+      return true;
+
+  return false;
+}
+
+/*
+ * Look up the current version of a variable in vars, rebinding the
+ * symbol's cell if the variable has been deleted and stored again
+ *
+ * Parameters:
+ *   rx       The engine
+ *   sym      The symbol
+ *
+ * Returns: The version, or 0 if the variable is not in vars
+ */
+static unsigned long _RX_version(Reactive rx, struct _rx_symbol *sym)
+{
+  if (!CD_cell_valid(rx->vars, sym->cell) && !CD_find_cell(rx->vars, sym->name, &sym->cell))
+    return 0;
+
+  return CD_cell_version(rx->vars, sym->cell);
+}
+
+/*
+ * Find a symbol in the engine's symbol table, adding it if it is not
+ * there yet
+ *
+ * Parameters:
+ *   rx       The engine
+ *   name     The name of the symbol
+ *
+ * Returns: The position of the symbol in the table
+ */
+static int _RX_symbol(Reactive rx, char *name)
+{
+  if (CD_contains(rx->index, name))
+    return (int)CD_retrieve(rx->index, name);
+
+  if (rx->num_symbols == rx->symbol_cap)
+  {
+    rx->symbol_cap *= 2;
+    rx->symbol = realloc(rx->symbol, sizeof(struct _rx_symbol) * rx->symbol_cap);
+    assert(rx->symbol != NULL);
+  }
+
+  struct _rx_symbol *sym = &rx->symbol[rx->num_symbols];
+
+  snprintf(sym->name, sizeof(sym->name), "%s", name);
+  sym->cell = INVALID_CELL;
+  sym->version = _RX_version(rx, sym);
+  sym->writer = -1;
+  sym->readers = NULL;
+  sym->num_readers = 0;
+
+  CD_store(rx->index, name, rx->num_symbols);
+  return rx->num_symbols++;
+}
+
+/*
+ * Record the symbols that a subtree reads and writes, visiting the
+ * nodes in the order in which ET_evaluate_checked does
+ *
+ * Parameters:
+ *   rx       The engine
+ *   f        The formula to record into
+ *   tree     The subtree
+ *
+ * Returns: true on success, false if an assignment is to something
+ *   other than a symbol
+ */
+static bool _RX_collect(Reactive rx, struct _rx_formula *f, ExprTree tree)
+{
+  if (tree == NULL || tree->type == VALUE)
+    return true;
+
+  if (tree->type == SYMBOL)
+  {
+    int s = _RX_symbol(rx, tree->n.symbol);
+
+    // a symbol that the formula has already assigned is read locally
+    if (!_RX_contains(f->writes, f->num_writes, s) && !_RX_contains(f->reads, f->num_reads, s))
+      _RX_append(&f->reads, &f->num_reads, s);
+    return true;
+  }
+
+  if (tree->type == OP_ASSIGN)
+  {
+    if (tree->n.child[LEFT]->type != SYMBOL || !_RX_collect(rx, f, tree->n.child[RIGHT]))
+      return false;
+
+    int s = _RX_symbol(rx, tree->n.child[LEFT]->n.symbol);
+
+    if (!_RX_contains(f->writes, f->num_writes, s))
+      _RX_append(&f->writes, &f->num_writes, s);
+    return true;
+  }
+
+  return _RX_collect(rx, f, tree->n.child[LEFT]) && _RX_collect(rx, f, tree->n.child[RIGHT]);
+}
+
+/*
+ * Put the formulas into topological order, so that each one follows
+ * every formula that assigns a symbol it reads
+ *
+ * Parameters:
+ *   rx       The engine
+ *
+ * Returns: true on success, false if the formulas contain a cycle, in
+ *   which case the order is incomplete
+ */
+static bool _RX_sort(Reactive rx)
+{
+  int n = rx->num_formulas;
+  int *indegree = calloc(n + 1, sizeof(int));
+  int head = 0, tail = 0;
+
+  assert(indegree != NULL);
+  rx->order = realloc(rx->order, sizeof(int) * (n + 1));
+  assert(rx->order != NULL);
+
+  for (int f = 0; f < n; f++)
+    for (int i = 0; i < rx->formula[f].num_reads; i++)
+      if (rx->symbol[rx->formula[f].reads[i]].writer >= 0)
+        indegree[f]++;
+
+  for (int f = 0; f < n; f++)
+    if (indegree[f] == 0)
+      rx->order[tail++] = f;
+
+  // order doubles as the queue of formulas whose inputs are all placed
+  while (head < tail)
+  {
+    struct _rx_formula *f = &rx->formula[rx->order[head++]];
+
+    for (int i = 0; i < f->num_writes; i++)
+    {
+      struct _rx_symbol *sym = &rx->symbol[f->writes[i]];
+
+      for (int r = 0; r < sym->num_readers; r++)
+        if (--indegree[sym->readers[r]] == 0)
+          rx->order[tail++] = sym->readers[r];
+    }
+  }
+
+  free(indegree);
+  return tail == n;
+}
+
+/*
+ * Compare a symbol's version in vars against the one last seen, and
+ * if it has changed, mark every formula that reads it as dirty
+ *
+ * Parameters:
+ *   rx       The engine
+ *   s        The position of the symbol in the symbol table
+ *
+ * Returns: None
+ */
+static void _RX_check(Reactive rx, int s)
+{
+  struct _rx_symbol *sym = &rx->symbol[s];
+  unsigned long version = _RX_version(rx, sym);
+
+  if (version == sym->version)
+    return;
+
+  sym->version = version;
+  for (int r = 0; r < sym->num_readers; r++)
+    rx->formula[sym->readers[r]].dirty = true;
+}
+
+// Documented in .h file
+Reactive RX_new(CDict vars)
+{
+  Reactive rx = malloc(sizeof(struct _reactive));
+  assert(rx != NULL);
+
+  rx->vars = vars;
+  rx->index = CD_new();
+  assert(rx->index != NULL);
+  rx->symbol_cap = 8;
+  rx->symbol = malloc(sizeof(struct _rx_symbol) * rx->symbol_cap);
+  assert(rx->symbol != NULL);
+  rx->num_symbols = 0;
+  rx->formula_cap = 8;
+  rx->formula = malloc(sizeof(struct _rx_formula) * rx->formula_cap);
+  assert(rx->formula != NULL);
+  rx->num_formulas = 0;
+  rx->order = NULL;
+  rx->clock = CD_clock(vars);
+  rx->pending = false;
+
+  return rx;
+}
+
+// Documented in .h file
+void RX_free(Reactive rx)
+{
+  if (rx == NULL)
+    return;
+
+  for (int f = 0; f < rx->num_formulas; f++)
+  {
+    ET_free(rx->formula[f].tree);
+    free(rx->formula[f].reads);
+    free(rx->formula[f].writes);
+  }
+
+  for (int s = 0; s < rx->num_symbols; s++)
+    free(rx->symbol[s].readers);
+
+  CD_free(rx->index);
+  free(rx->symbol);
+  free(rx->formula);
+  free(rx->order);
+  free(rx);
+}
+
+// Documented in .h file
+int RX_register(Reactive rx, ExprTree tree, char *errmsg, size_t errmsg_sz)
+{
+  struct _rx_formula f = {tree, NULL, 0, NULL, 0, true, NAN, ET_OK};
+  int id = rx->num_formulas;
+
+  if (!_RX_collect(rx, &f, tree))
+  {
+    snprintf(errmsg, errmsg_sz, "Syntax error on token EQUAL");
+    goto register_error;
+  }
+
+  for (int i = 0; i < f.num_writes; i++)
+    if (rx->symbol[f.writes[i]].writer >= 0)
+    {
+      snprintf(errmsg, errmsg_sz, "%s is already assigned by formula %d",
+               rx->symbol[f.writes[i]].name, rx->symbol[f.writes[i]].writer);
+      goto register_error;
+    }
+
+  if (rx->num_formulas == rx->formula_cap)
+  {
+    rx->formula_cap *= 2;
+    rx->formula = realloc(rx->formula, sizeof(struct _rx_formula) * rx->formula_cap);
+    assert(rx->formula != NULL);
+  }
+
+  rx->formula[id] = f;
+  rx->num_formulas++;
+  for (int i = 0; i < f.num_writes; i++)
+    rx->symbol[f.writes[i]].writer = id;
+  for (int i = 0; i < f.num_reads; i++)
+    _RX_append(&rx->symbol[f.reads[i]].readers, &rx->symbol[f.reads[i]].num_readers, id);
+
+  if (!_RX_sort(rx))
+  {
+    // undo the registration; the new formula is the last reader of
+    // each symbol it reads
+    for (int i = 0; i < f.num_reads; i++)
+      rx->symbol[f.reads[i]].num_readers--;
+    for (int i = 0; i < f.num_writes; i++)
+      rx->symbol[f.writes[i]].writer = -1;
+    rx->num_formulas--;
+
+    bool sorted = _RX_sort(rx);
+    assert(sorted);
+
+    snprintf(errmsg, errmsg_sz, "Circular reference");
+    goto register_error;
+  }
+
+  rx->pending = true;
+  return id;
+
+register_error:
+  free(f.reads);
+  free(f.writes);
+  return -1;
+}
+
+// Documented in .h file
+int RX_update(Reactive rx)
+{
+  int evaluated = 0;
+
+  if (!rx->pending && CD_clock(rx->vars) == rx->clock)
+    return 0;
+
+  for (int s = 0; s < rx->num_symbols; s++)
+    _RX_check(rx, s);
+
+  for (int i = 0; i < rx->num_formulas; i++)
+  {
+    struct _rx_formula *f = &rx->formula[rx->order[i]];
+
+    if (!f->dirty)
+      continue;
+
+    f->dirty = false;
+    f->error = ET_evaluate_checked(f->tree, rx->vars, &f->value, NULL);
+    if (f->error != ET_OK)
+      f->value = NAN;
+    evaluated++;
+
+    // readers of what changed come later in the order
+    for (int w = 0; w < f->num_writes; w++)
+      _RX_check(rx, f->writes[w]);
+  }
+
+  rx->clock = CD_clock(rx->vars);
+  rx->pending = false;
+  return evaluated;
+}
+
+// Documented in .h file
+int RX_num_formulas(Reactive rx)
+{
+  return rx->num_formulas;
+}
+
+// Documented in .h file
+double RX_value(Reactive rx, int formula)
+{
+  assert(formula >= 0 && formula < rx->num_formulas);
+  return rx->formula[formula].value;
+}
+
+// Documented in .h file
+ETErrorCode RX_error(Reactive rx, int formula)
+{
+  assert(formula >= 0 && formula < rx->num_formulas);
+  return rx->formula[formula].error;
+}
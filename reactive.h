@@ -0,0 +1,107 @@
+/*
+ * reactive.h
+ *
+ * A recalculation engine, in the manner of a spreadsheet, for a set of
+ * formulas evaluated against one CDict. Each formula is an ExprTree
+ * that reads some variables and assigns others. The engine records
+ * which variables each formula reads and writes, keeps the formulas in
+ * topological order, and on each update re-evaluates only the
+ * formulas downstream of a variable whose value has changed.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _REACTIVE_H_
+#define _REACTIVE_H_
+
+#include <stddef.h>
+
+#include "expr_tree.h"
+#include "cdict.h"
+
+typedef struct _reactive *Reactive;
+
+/*
+ * Create an engine with no formulas
+ *
+ * Parameters:
+ *   vars     The variables that the formulas read and assign
+ *
+ * Returns: The new engine
+ *
+ * It is the responsibility of the caller to call RX_free on the
+ * engine. vars must outlive it.
+ */
+Reactive RX_new(CDict vars);
+
+/*
+ * Destroy an engine and every formula registered with it
+ *
+ * Parameters:
+ *   rx       The engine
+ *
+ * Returns: None
+ */
+void RX_free(Reactive rx);
+
+/*
+ * Register a formula. The formula reads every symbol whose value it
+ * uses before it has assigned to that symbol itself, and writes every
+ * symbol that it assigns to. It is first evaluated by the next
+ * RX_update.
+ *
+ * A formula is rejected if it assigns to something other than a
+ * symbol, if it assigns to a symbol that another formula already
+ * assigns, or if it would complete a cycle, in which a formula depends
+ * on its own result (as in x = x + 1).
+ *
+ * Parameters:
+ *   rx         The engine
+ *   tree       The formula; on success the engine takes ownership of it
+ *   errmsg     Return space for an error message, filled in in case of error
+ *   errmsg_sz  The size of errmsg
+ *
+ * Returns: The number of the formula, counting from 0 in order of
+ *   registration, or -1 if the formula is rejected, in which case an
+ *   error message is copied into errmsg and the caller keeps ownership
+ *   of tree
+ */
+int RX_register(Reactive rx, ExprTree tree, char *errmsg, size_t errmsg_sz);
+
+/*
+ * Bring every formula up to date. Formulas that have never been
+ * evaluated, and formulas that read a variable whose value has changed
+ * since they were last evaluated, are re-evaluated, as are the
+ * formulas that read what those assign, and so on. Each formula is
+ * evaluated at most once, after every formula whose result it reads.
+ * A formula whose assignments leave the values unchanged does not
+ * cause its readers to be re-evaluated.
+ *
+ * Variables may be changed between updates by any means, including
+ * CD_store and ET_evaluate on vars.
+ *
+ * Parameters:
+ *   rx       The engine
+ *
+ * Returns: The number of formulas that were evaluated
+ */
+int RX_update(Reactive rx);
+
+/*
+ * Returns: The number of formulas registered with rx
+ */
+int RX_num_formulas(Reactive rx);
+
+/*
+ * Returns: The value of a formula when it was last evaluated, or NaN
+ *   if it has not been evaluated or its evaluation failed
+ */
+double RX_value(Reactive rx, int formula);
+
+/*
+ * Returns: The outcome of the last evaluation of a formula, as
+ *   ET_evaluate_checked reports it; ET_OK if it has not been evaluated
+ */
+ETErrorCode RX_error(Reactive rx, int formula);
+
+#endif /* _REACTIVE_H_ */
@@ -0,0 +1,246 @@
+/*
+ * thread_pool.c
+ *
+ * A fixed-size pool of worker threads that run parallel loops, with
+ * range-splitting work stealing. See thread_pool.h.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+/*
+ * Each worker owns the range [next, end) of task numbers that it has
+ * yet to run. The owner takes tasks from the front of its range;
+ * thieves split off the back half, so owner and thief rarely contend
+ * for the same tasks.
+ */
+struct _tp_worker
+{
+  pthread_mutex_t lock;
+  size_t next;
+  size_t end;
+  int id;
+  pthread_t thread;
+  ThreadPool pool;
+};
+
+struct _thread_pool
+{
+  int num_threads;
+  struct _tp_worker *worker;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  unsigned long generation; // incremented for each TP_run
+  bool shutdown;
+  int workers_busy;
+  TP_task_fn task_fn;
+  void *cb_data;
+};
+
+/*
+ * Find the next task for a worker, stealing from another worker if
+ * its own range is empty
+ *
+ * Parameters:
+ *   pool     The pool
+ *   self     The worker looking for a task
+ *   task     Return space for the task number
+ *
+ * Returns: true if a task was found, false if every range is empty
+ */
+static bool _TP_next_task(ThreadPool pool, struct _tp_worker *self, size_t *task)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&self->lock);
+  if (self->next < self->end)
+  {
+    *task = self->next++;
+    found = true;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  if (found)
+    return true;
+
+  for (int i = 1; i < pool->num_threads && !found; i++)
+  {
+    struct _tp_worker *victim = &pool->worker[(self->id + i) % pool->num_threads];
+    size_t begin = 0, end = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->next < victim->end)
+    {
+      size_t take = (victim->end - victim->next + 1) / 2;
+
+      end = victim->end;
+      begin = end - take;
+      victim->end = begin;
+      found = true;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (found)
+    {
+      pthread_mutex_lock(&self->lock);
+      self->next = begin + 1;
+      self->end = end;
+      pthread_mutex_unlock(&self->lock);
+      *task = begin;
+    }
+  }
+
+  return found;
+}
+
+/*
+ * Body of each worker thread: wait for a loop to be posted, run tasks
+ * until none are left anywhere, check in, and wait again
+ *
+ * Parameters:
+ *   arg      The worker's struct _tp_worker
+ *
+ * Returns: NULL
+ */
+static void *_TP_worker_main(void *arg)
+{
+  struct _tp_worker *self = (struct _tp_worker *)arg;
+  ThreadPool pool = self->pool;
+  unsigned long seen = 0;
+
+  while (true)
+  {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->generation == seen && !pool->shutdown)
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+
+    if (pool->shutdown)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+
+    seen = pool->generation;
+    TP_task_fn task_fn = pool->task_fn;
+    void *cb_data = pool->cb_data;
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t task;
+    while (_TP_next_task(pool, self, &task))
+      task_fn(task, self->id, cb_data);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->workers_busy == 0)
+      pthread_cond_signal(&pool->work_done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// Documented in .h file
+ThreadPool TP_new(int num_threads)
+{
+  if (num_threads <= 0)
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+
+  ThreadPool pool = malloc(sizeof(struct _thread_pool));
+  assert(pool != NULL);
+
+  pool->num_threads = num_threads;
+  pool->worker = malloc(sizeof(struct _tp_worker) * num_threads);
+  assert(pool->worker != NULL);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  pool->generation = 0;
+  pool->shutdown = false;
+  pool->workers_busy = 0;
+  pool->task_fn = NULL;
+  pool->cb_data = NULL;
+
+  for (int i = 0; i < num_threads; i++)
+  {
+    struct _tp_worker *w = &pool->worker[i];
+
+    pthread_mutex_init(&w->lock, NULL);
+    w->next = 0;
+    w->end = 0;
+    w->id = i;
+    w->pool = pool;
+
+    int rc = pthread_create(&w->thread, NULL, _TP_worker_main, w);
+    assert(rc == 0);
+  }
+
+  return pool;
+}
+
+// Documented in .h file
+void TP_free(ThreadPool pool)
+{
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_threads; i++)
+  {
+    pthread_join(pool->worker[i].thread, NULL);
+    pthread_mutex_destroy(&pool->worker[i].lock);
+  }
+
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->worker);
+  free(pool);
+}
+
+// Documented in .h file
+int TP_num_threads(ThreadPool pool)
+{
+  return pool->num_threads;
+}
+
+// Documented in .h file
+void TP_run(ThreadPool pool, size_t num_tasks, TP_task_fn task_fn, void *cb_data)
+{
+  if (pool == NULL || task_fn == NULL || num_tasks == 0)
+    return;
+
+  // deal the tasks out in equal contiguous ranges; stealing evens out the rest
+  for (int i = 0; i < pool->num_threads; i++)
+  {
+    struct _tp_worker *w = &pool->worker[i];
+
+    pthread_mutex_lock(&w->lock);
+    w->next = num_tasks * i / pool->num_threads;
+    w->end = num_tasks * (i + 1) / pool->num_threads;
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task_fn = task_fn;
+  pool->cb_data = cb_data;
+  pool->workers_busy = pool->num_threads;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+
+  while (pool->workers_busy > 0)
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
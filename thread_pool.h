@@ -0,0 +1,73 @@
+/*
+ * thread_pool.h
+ *
+ * A fixed-size pool of worker threads that run parallel loops. The
+ * iterations of a loop are dealt out to the workers in contiguous
+ * ranges; a worker that runs out of iterations steals half of the
+ * remaining range of another worker, so uneven iterations still keep
+ * every thread busy.
+ *
+ * Author: Niyomwungeri Parmenide Ishimwe <parmenin@andrew.cmu.edu>
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stddef.h>
+
+typedef struct _thread_pool *ThreadPool;
+
+/*
+ * Create a pool and start its worker threads
+ *
+ * Parameters:
+ *   num_threads  The number of worker threads, or 0 for one per online CPU
+ *
+ * Returns: The new pool
+ *
+ * It is the responsibility of the caller to call TP_free on the pool.
+ */
+ThreadPool TP_new(int num_threads);
+
+/*
+ * Stop the worker threads and destroy the pool. Must not be called
+ * while TP_run is running.
+ *
+ * Parameters:
+ *   pool     The pool
+ *
+ * Returns: None
+ */
+void TP_free(ThreadPool pool);
+
+/*
+ * Returns: The number of worker threads in pool
+ */
+int TP_num_threads(ThreadPool pool);
+
+typedef void (*TP_task_fn)(size_t task, int worker, void *cb_data);
+
+/*
+ * Run task_fn once for every task number in [0, num_tasks), spread
+ * across the worker threads, and wait until all of them have
+ * finished. Each call to task_fn will be of the form
+ *
+ *   task_fn( <task number>, <worker number>, <cb_data> )
+ *
+ * where the worker number is in [0, TP_num_threads(pool)) and is the
+ * same for every task run by one thread, so it can be used to index
+ * per-thread scratch space. There is no guarantee as to the order in
+ * which tasks run. Only one TP_run may be in progress on a pool at a
+ * time.
+ *
+ * Parameters:
+ *   pool       The pool
+ *   num_tasks  The number of tasks
+ *   task_fn    The function to call for each task
+ *   cb_data    Caller data to pass to the function
+ *
+ * Returns: None
+ */
+void TP_run(ThreadPool pool, size_t num_tasks, TP_task_fn task_fn, void *cb_data);
+
+#endif /* _THREAD_POOL_H_ */